@@ -1,18 +1,28 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "savitar.hpp"
 #include "ckpt_alloc.hpp"
+#include "copy_kernels.hpp"
 #include <emmintrin.h>
 #define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
 
+#if defined(HEAP_FILE) && defined(SNAPSHOT_FORK)
+#error "HEAP_FILE is shared, SNAPSHOT_FORK needs a private heap"
+#endif
+
 /*
  * * * * * * * * * *
  * Global Allocator
  * * * * * * * * * *
  */
 GlobalAlloc* GlobalAlloc::instance = NULL;
+int GlobalAlloc::heapFd = -1;
 
-GlobalAlloc::GlobalAlloc(const char *snapshot, const char *bitmap) {
+GlobalAlloc::GlobalAlloc(const char *snapshot, const char *bitmap,
+        const char *owners, bool populate) {
 
     assert(instance == NULL);
     assert(MinPoolSize % FreeList::BlockSize == 0);
@@ -30,12 +40,17 @@ GlobalAlloc::GlobalAlloc(const char *snapshot, const char *bitmap) {
     if (bitmap != NULL) memcpy(alloc_bitmap, bitmap, bitmapSize());
     else memset(alloc_bitmap, 0, bitmapSize());
 
+    // Block owners
+    block_owners = (uint32_t *)malloc(ownersSize());
+    if (owners != NULL) memcpy(block_owners, owners, ownersSize());
+    else memset(block_owners, 0, ownersSize());
+
     assert(pthread_mutex_init(&allocators_mutex, NULL) == 0);
     assert(pthread_mutex_init(&free_list_mutex, NULL) == 0);
     GlobalAlloc::instance = this;
 
     if (snapshot != NULL) {
-        load(snapshot);
+        load(snapshot, populate);
         return;
     }
 
@@ -53,6 +68,7 @@ GlobalAlloc::GlobalAlloc(const char *snapshot, const char *bitmap) {
 
 GlobalAlloc::~GlobalAlloc() {
     free(alloc_bitmap);
+    free(block_owners);
     std::list<memory_region_t>::iterator it;
     for (it = mapped_regions.begin(); it != mapped_regions.end(); ++it) {
         munmap(it->ptr, it->size);
@@ -65,6 +81,25 @@ GlobalAlloc::~GlobalAlloc() {
     mapped_regions.clear();
     allocators.clear();
     munmap(allocatorsMemory, MaxAllocatorMemorySize);
+    if (heapFd >= 0) close(heapFd);
+    heapFd = -1;
+}
+
+/*
+ * Opens the file backing the heap (HEAP_FILE), e.g., on hugetlbfs
+ * Pages of the file outlive the process (not a reboot), so a restarted
+ * process can map the heap back (see Snapshot::loadImage). Unless the heap
+ * is kept, the file is emptied, restores assume a zeroed heap.
+ */
+bool GlobalAlloc::openHeapFile(bool keep) {
+#ifdef HEAP_FILE
+    assert(heapFd < 0);
+    heapFd = open(HEAP_FILE, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+    return heapFd >= 0;
+#else
+    (void)keep;
+    return false;
+#endif
 }
 
 // Size of bitmap in bytes
@@ -72,21 +107,56 @@ size_t GlobalAlloc::bitmapSize() const {
     return (MaxMemorySize / BitmapGranularity) >> 3;
 }
 
-bool GlobalAlloc::newBlock(memory_region_t *region, uintptr_t addr, size_t size) {
+/*
+ * Unpopulated blocks are left for the snapshot to page in (userfaultfd)
+ * With SNAPSHOT_PAGE_COW, the heap uses 4 KB pages, so snapshots can
+ * write-protect (and copy) single pages instead of 2 MB blocks.
+ * With SNAPSHOT_FORK, the heap is private so a forked snapshot process
+ * keeps a copy-on-write view of it.
+ * With HEAP_FILE, blocks are mapped from the heap file at their offset
+ * from BaseAddress (the file provides the page size).
+ */
+bool GlobalAlloc::newBlock(memory_region_t *region, uintptr_t addr, size_t size,
+        bool populate) {
 #ifdef DEBUG
     fprintf(stdout, "Requesting %zu bytes at %p from the kernel\n", size, (void*)addr);
 #endif
-    region->ptr = mmap((void *)addr, size, PROT_READ | PROT_WRITE, MAP_SHARED |
-            MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+#ifdef SNAPSHOT_PAGE_COW
+    const int pageFlags = 0;
+#else
+    const int pageFlags = MAP_HUGETLB | MAP_HUGE_2MB;
+#endif
+#ifdef SNAPSHOT_FORK
+    const int shareFlags = MAP_PRIVATE;
+#else
+    const int shareFlags = MAP_SHARED;
+#endif
+    int backing = MAP_ANONYMOUS | pageFlags;
+    int fd = -1;
+    off_t offset = 0;
+#ifdef HEAP_FILE
+    if (heapFd < 0) assert(openHeapFile(false));
+    struct stat st;
+    backing = 0;
+    fd = heapFd;
+    offset = addr - BaseAddress;
+    assert(fstat(fd, &st) == 0);
+    if (st.st_size < (off_t)(offset + size)) {
+        assert(ftruncate(fd, offset + size) == 0);
+    }
+#endif
+    region->ptr = mmap((void *)addr, size, PROT_READ | PROT_WRITE, shareFlags |
+            backing | (populate ? MAP_POPULATE : 0), fd, offset);
     if (region->ptr == NULL) return false;
     if (region->ptr != (void *)addr) return false;
     region->size = size;
+    if (!populate) return true;
     if (madvise(region->ptr, region->size, MADV_SEQUENTIAL | MADV_WILLNEED) != 0)
         return false;
     return true;
 }
 
-void *GlobalAlloc::alloc(const size_t size) {
+void *GlobalAlloc::alloc(const size_t size, const ObjectAlloc *owner) {
     void *ptr = NULL;
     free_header_t *head = free_list;
 
@@ -131,6 +201,11 @@ void *GlobalAlloc::alloc(const size_t size) {
         }
     }
 
+    setOwner((uintptr_t)ptr, size, ownerID(owner));
+    if (capturing && captured_owners.count(ownerID(owner)) > 0) {
+        memory_region_t region = { ptr, size };
+        late_allocations.push_back(region);
+    }
     pthread_mutex_unlock(&free_list_mutex);
     return ptr;
 }
@@ -178,6 +253,14 @@ void GlobalAlloc::tryMergingRegions(free_header_t *r) {
 
 void GlobalAlloc::release(void *ptr, size_t size) {
     pthread_mutex_lock(&free_list_mutex);
+    size_t block = ((uintptr_t)ptr - BaseAddress) / FreeList::BlockSize;
+    if (capturing && captured_owners.count(block_owners[block]) > 0) {
+        memory_region_t region = { ptr, size };
+        deferred_releases.push_back(region);
+        pthread_mutex_unlock(&free_list_mutex);
+        return;
+    }
+    setOwner((uintptr_t)ptr, size, 0);
     free_header_t *t = (free_header_t *)ptr;
     t->prev = NULL;
     t->next = free_list;
@@ -188,6 +271,77 @@ void GlobalAlloc::release(void *ptr, size_t size) {
     pthread_mutex_unlock(&free_list_mutex);
 }
 
+/*
+ * Fuzzy snapshots save object allocators one at a time and the global
+ * allocator last, so the blocks of an owner that is already saved must
+ * stay as they were saved: its releases are deferred until the capture is
+ * finished, and blocks it obtains meanwhile are saved as free.
+ */
+void GlobalAlloc::startCapture() {
+    pthread_mutex_lock(&free_list_mutex);
+    capturing = true;
+    pthread_mutex_unlock(&free_list_mutex);
+}
+
+// The allocator of the owner is saved (no transactions on its object)
+void GlobalAlloc::captureOwner(const ObjectAlloc *owner) {
+    pthread_mutex_lock(&free_list_mutex);
+    captured_owners.insert(ownerID(owner));
+    pthread_mutex_unlock(&free_list_mutex);
+}
+
+// Saves the global allocator and block owners, then resumes releases
+void GlobalAlloc::finishCapture(char *global, char *owners) {
+    std::list<memory_region_t> pending;
+    pthread_mutex_lock(&free_list_mutex);
+    save(global);
+    saveOwners(owners);
+    long long *free_list_length = (long long *)global + 1;
+    uint32_t *saved_owners = (uint32_t *)owners;
+    for (auto it = late_allocations.begin(); it != late_allocations.end(); ++it) {
+        long long *entry = free_list_length + 1 + 2 * *free_list_length;
+        _mm_stream_si64(entry, (long long)it->ptr); // saved as free
+        _mm_stream_si64(entry + 1, it->size);
+        *free_list_length = *free_list_length + 1;
+        size_t block = ((uintptr_t)it->ptr - BaseAddress) / FreeList::BlockSize;
+        for (size_t i = 0; i < it->size / FreeList::BlockSize; i++) {
+            saved_owners[block + i] = 0;
+        }
+    }
+    capturing = false;
+    captured_owners.clear();
+    late_allocations.clear();
+    pending.swap(deferred_releases);
+    pthread_mutex_unlock(&free_list_mutex);
+
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        release(it->ptr, it->size);
+    }
+}
+
+// Size of the block owners table in bytes
+size_t GlobalAlloc::ownersSize() const {
+    return (MaxMemorySize / FreeList::BlockSize) * sizeof(uint32_t);
+}
+
+uint32_t GlobalAlloc::ownerID(const ObjectAlloc *owner) const {
+    if (owner == NULL) return 0;
+    return (uint32_t)(owner - allocatorsMemory) + 1;
+}
+
+// Must hold the free list lock
+void GlobalAlloc::setOwner(uintptr_t ptr, size_t size, uint32_t owner) {
+    size_t block = (ptr - BaseAddress) / FreeList::BlockSize;
+    size_t blocks = size / FreeList::BlockSize;
+    for (size_t i = 0; i < blocks; i++) {
+        block_owners[block + i] = owner;
+    }
+}
+
+void GlobalAlloc::saveOwners(char *nvm) const {
+    memcpy(nvm, block_owners, ownersSize());
+}
+
 void GlobalAlloc::setBitmap(uintptr_t ptr, size_t size) {
 
     // TODO optimize for large regions
@@ -247,49 +401,14 @@ void GlobalAlloc::unsetBitmapForBigDealloc(uintptr_t ptr, size_t blocks) {
 }
 
 void GlobalAlloc::saveBitmap(char *nvm) const {
-    __m128i *dst = (__m128i *)nvm;
-    __m128i *src = (__m128i *)alloc_bitmap;
-    __m128i *limit = src + bitmapSize() / sizeof(__m128i);
-
-    while (src < limit) {
-        __m128i xmm0 = _mm_loadu_si128(src + 0);
-        __m128i xmm1 = _mm_loadu_si128(src + 1);
-        __m128i xmm2 = _mm_loadu_si128(src + 2);
-        __m128i xmm3 = _mm_loadu_si128(src + 3);
-        __m128i xmm4 = _mm_loadu_si128(src + 4);
-        __m128i xmm5 = _mm_loadu_si128(src + 5);
-        __m128i xmm6 = _mm_loadu_si128(src + 6);
-        __m128i xmm7 = _mm_loadu_si128(src + 7);
-        __m128i xmm8 = _mm_loadu_si128(src + 8);
-        __m128i xmm9 = _mm_loadu_si128(src + 9);
-        __m128i xmm10 = _mm_loadu_si128(src + 10);
-        __m128i xmm11 = _mm_loadu_si128(src + 11);
-        __m128i xmm12 = _mm_loadu_si128(src + 12);
-        __m128i xmm13 = _mm_loadu_si128(src + 13);
-        __m128i xmm14 = _mm_loadu_si128(src + 14);
-        __m128i xmm15 = _mm_loadu_si128(src + 15);
-
-        _mm_stream_si128(dst + 0, xmm0); // 16 bytes
-        _mm_stream_si128(dst + 1, xmm1);
-        _mm_stream_si128(dst + 2, xmm2);
-        _mm_stream_si128(dst + 3, xmm3);
-        _mm_stream_si128(dst + 4, xmm4);
-        _mm_stream_si128(dst + 5, xmm5);
-        _mm_stream_si128(dst + 6, xmm6);
-        _mm_stream_si128(dst + 7, xmm7);
-        _mm_stream_si128(dst + 8, xmm8);
-        _mm_stream_si128(dst + 9, xmm9);
-        _mm_stream_si128(dst + 10, xmm10);
-        _mm_stream_si128(dst + 11, xmm11);
-        _mm_stream_si128(dst + 12, xmm12);
-        _mm_stream_si128(dst + 13, xmm13);
-        _mm_stream_si128(dst + 14, xmm14);
-        _mm_stream_si128(dst + 15, xmm15);
-
-        src += 16;
-        dst += 16;
-    }
-    //_mm_sfence();
+    Savitar_stream_copy(nvm, alloc_bitmap, bitmapSize());
+}
+
+// Saves the allocation map of a single block
+void GlobalAlloc::saveBitmap(char *nvm, size_t block) const {
+    const size_t words = FreeList::BlockSize / BitmapGranularity / 64;
+    memcpy(nvm + block * words * sizeof(uint64_t),
+            alloc_bitmap + block * words, words * sizeof(uint64_t));
 }
 
 void GlobalAlloc::loadBitmap(const char *nvm) {
@@ -329,7 +448,7 @@ void GlobalAlloc::save(char *nvm) const {
     //_mm_sfence();
 }
 
-void GlobalAlloc::load(const char *nvm) {
+void GlobalAlloc::load(const char *nvm, bool populate) {
     uint64_t *ptr = (uint64_t *)nvm;
     size_t pool_size = ptr[0];
     size_t free_list_length = ptr[1];
@@ -337,7 +456,7 @@ void GlobalAlloc::load(const char *nvm) {
 
     // reconstruct mapped_regions
     memory_region_t region;
-    assert(newBlock(&region, BaseAddress, pool_size));
+    assert(newBlock(&region, BaseAddress, pool_size, populate));
     asm volatile("" ::: "memory");
     mapped_regions.push_back(region);
 
@@ -413,37 +532,25 @@ void GlobalAlloc::report() {
 }
 
 ObjectAlloc *GlobalAlloc::newAllocator(uuid_t uuid) {
-    char uuid_str[64];
-    uuid_unparse(uuid, uuid_str);
-
     pthread_mutex_lock(&allocators_mutex);
     // TODO make sure we do not exceed the upper limit of mapped region
     void *ptr = (void *)&allocatorsMemory[allocators.size()];
     ObjectAlloc *alloc = new (ptr) ObjectAlloc(uuid);
-    allocators.insert(pair<std::string, ObjectAlloc *>(uuid_str, alloc));
+    allocators.insert(uuid, alloc);
     pthread_mutex_unlock(&allocators_mutex);
 
     return alloc;
 }
 
 ObjectAlloc *GlobalAlloc::findAllocator(uuid_t uuid) {
-    char uuid_str[64];
-    uuid_unparse(uuid, uuid_str);
-
-    pthread_mutex_lock(&allocators_mutex);
-    auto it = allocators.find(uuid_str);
-    pthread_mutex_unlock(&allocators_mutex);
-
-    if (it == allocators.end()) return NULL;
-    return it->second;
+    ObjectAlloc **it = allocators.find(uuid);
+    if (it == NULL) return NULL;
+    return *it;
 }
 
 void GlobalAlloc::restoreAllocator(ObjectAlloc *alloc) {
-    char uuid_str[64];
-    uuid_unparse(alloc->my_id, uuid_str);
-
     pthread_mutex_lock(&allocators_mutex);
-    allocators.insert(pair<std::string, ObjectAlloc *>(uuid_str, alloc));
+    allocators.insert(alloc->my_id, alloc);
     pthread_mutex_unlock(&allocators_mutex);
 }
 
@@ -464,7 +571,7 @@ ObjectAlloc::ObjectAlloc(const uuid_t uuid, const char *snapshot) {
     // Create free lists
     free_lists = (FreeList **)malloc(sizeof(FreeList *) * cores);
     for (uint16_t c = 0; c < total_cores; c++) {
-        free_lists[c] = new FreeList(c);
+        free_lists[c] = new FreeList(c, this);
     }
     uuid_copy(my_id, uuid);
 
@@ -644,8 +751,9 @@ const uint64_t FreeList::BucketCaps[14] = {
     0x40000, UINT64_MAX // 256 KB and above
 };
 
-FreeList::FreeList(uint16_t id) {
+FreeList::FreeList(uint16_t id, const ObjectAlloc *owner) {
     my_id = id;
+    this->owner = owner;
     xlock = 0;
 #ifndef __OPTIMIZE__
     lock_holders = 0;
@@ -775,7 +883,8 @@ chunk_header_t *FreeList::alloc(size_t size) {
 
     if (chunk == NULL) {
         // Not found, ask GlobalAlloc for more memory
-        chunk = (chunk_header_t *)GlobalAlloc::getInstance()->alloc(BlockSize);
+        chunk = (chunk_header_t *)GlobalAlloc::getInstance()->alloc(BlockSize,
+                owner);
 #ifndef __OPTIMIZE__
         chunk->used = 0;
         assert(chunk != NULL);
@@ -940,7 +1049,7 @@ chunk_header_t *FreeList::big_alloc(size_t size) {
     size_t allocSize = size & ~(BlockSize - 1);
     if (size > allocSize) allocSize += BlockSize;
 
-    void *ptr = GlobalAlloc::getInstance()->alloc(allocSize);
+    void *ptr = GlobalAlloc::getInstance()->alloc(allocSize, owner);
     chunk_header_t *chunk = (chunk_header_t *)ptr;
 
     chunk->prev_offset = 0;
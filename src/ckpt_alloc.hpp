@@ -6,7 +6,9 @@
 #include <stdlib.h>
 #include <list>
 #include <map>
+#include <set>
 #include <type_traits>
+#include "uuid_map.hpp"
 
 #define TOTAL_ALLOC_BUCKETS     14
 
@@ -48,19 +50,27 @@ typedef struct free_header_t {
  * * Supplies ObjectAlloc with more memory.
  * * Responsible for fixed mapping between restarts.
  * * Maintains the list of allocated pages for snapshots.
+ * * Maintains the owner (object allocator) of each block, so snapshots
+ *   can be restored one object at a time.
  */
 class GlobalAlloc {
 public:
-    GlobalAlloc(const char *snapshot = NULL, const char *bitmap = NULL);
+    GlobalAlloc(const char *snapshot = NULL, const char *bitmap = NULL,
+            const char *owners = NULL, bool populate = true);
     ~GlobalAlloc();
     static GlobalAlloc *getInstance() {
         if (instance == NULL) instance = new GlobalAlloc();
         return instance;
     }
 
-    void *alloc(const size_t size);
+    void *alloc(const size_t size, const ObjectAlloc *owner = NULL);
     void release(void *ptr, size_t size);
 
+    // Fuzzy snapshots save owners one at a time (see startCapture)
+    void startCapture();
+    void captureOwner(const ObjectAlloc *);
+    void finishCapture(char *global, char *owners);
+
     void setBitmap(uintptr_t, size_t);
     void unsetBitmap(uintptr_t, size_t);
     void setBitmapForBigAlloc(uintptr_t, size_t);
@@ -68,12 +78,19 @@ public:
 
     static size_t snapshotSize();
     void save(char *) const;
-    void load(const char *);
+    void load(const char *, bool populate = true);
 
     size_t bitmapSize() const;
     void saveBitmap(char *) const;
+    void saveBitmap(char *, size_t block) const;
     void loadBitmap(const char *);
 
+    // Block owners: index of the owner allocator + 1 (0 = no owner)
+    size_t ownersSize() const;
+    void saveOwners(char *) const;
+    uint32_t blockOwner(size_t block) const { return block_owners[block]; }
+    uint32_t ownerID(const ObjectAlloc *) const;
+
     size_t allocatedBlocks();
     void report();
 
@@ -81,20 +98,30 @@ public:
     ObjectAlloc *findAllocator(uuid_t);
     void restoreAllocator(ObjectAlloc *);
 
+    // Heap backed by a named file (HEAP_FILE), kept to map it back
+    static bool openHeapFile(bool keep);
+
 protected:
-    bool newBlock(memory_region_t *, uintptr_t, size_t);
+    bool newBlock(memory_region_t *, uintptr_t, size_t, bool populate = true);
+    void setOwner(uintptr_t, size_t, uint32_t);
     void tryMergingRegions(free_header_t *);
 
 private:
     static GlobalAlloc *instance;
+    static int heapFd;
 
     uint64_t *alloc_bitmap = NULL;
+    uint32_t *block_owners = NULL;
     pthread_mutex_t free_list_mutex;
     pthread_mutex_t allocators_mutex;
 
     free_header_t *free_list = NULL;
     std::list<memory_region_t> mapped_regions;
-    std::map<std::string, ObjectAlloc *> allocators;
+    std::list<memory_region_t> deferred_releases;
+    std::list<memory_region_t> late_allocations;
+    std::set<uint32_t> captured_owners;
+    bool capturing = false;
+    UUIDMap<ObjectAlloc *> allocators; // lock-free lookups
     ObjectAlloc *allocatorsMemory = NULL;
 
 public:
@@ -162,7 +189,7 @@ public:
  */
 class FreeList {
 public:
-    FreeList(uint16_t);
+    FreeList(uint16_t, const ObjectAlloc *owner = NULL);
     ~FreeList();
 
     void lock();
@@ -190,6 +217,7 @@ private:
     uint64_t chain_lookups; // number of free-list lookups
     uint64_t xlock;
     uint16_t my_id;
+    const ObjectAlloc *owner; // recorded as the owner of new blocks
 #ifndef __OPTIMIZE__
     uint64_t lock_holders;
 #endif
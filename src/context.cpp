@@ -4,23 +4,18 @@
 #include "thread.hpp"
 #include "nvm_manager.hpp"
 #include "snapshot.hpp"
+#include "snapshot_merger.hpp"
+#include "snapshot_scheduler.hpp"
 #include <execinfo.h>
 
-static pthread_t snapshot_thread;
-static pthread_mutex_t snapshot_lock;
-
-static void *snapshot_worker(void *arg) {
-    Snapshot *snap = (Snapshot *)arg;
-    snap->create();
-    delete snap;
-    return NULL;
-}
-
 static void signal_handler(int sig, siginfo_t *si, void *unused) {
     assert(sig == SIGSEGV || sig == SIGUSR1);
     if (sig == SIGSEGV) {
         void *addr = si->si_addr;
         if (!Snapshot::anyActiveSnapshot()) {
+            // First write to a block since the last (incremental) snapshot
+            if (Snapshot::trackedWrite(addr)) return;
+
             void *array[10];
             size_t size;
 
@@ -32,12 +27,7 @@ static void signal_handler(int sig, siginfo_t *si, void *unused) {
         Snapshot::getInstance()->pageFaultHandler(addr);
     }
     else { // SIGUSR1
-        pthread_mutex_lock(&snapshot_lock);
-        if (!Snapshot::anyActiveSnapshot()) {
-            Snapshot *snap = new Snapshot(PMEM_PATH);
-            pthread_create(&snapshot_thread, NULL, snapshot_worker, snap);
-        }
-        pthread_mutex_unlock(&snapshot_lock);
+        SnapshotScheduler::getInstance().signal();
     }
 }
 
@@ -62,14 +52,17 @@ int Savitar_main(MainFunction main_function, int argc, char **argv) {
     NVManager::getInstance(); // recover persistent objects (blocking)
 
     // Register signal handler for snapshots
-    pthread_mutex_init(&snapshot_lock, NULL);
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_flags = SA_SIGINFO;
     sigemptyset(&sa.sa_mask);
     sa.sa_sigaction = signal_handler;
-    assert(sigaction(SIGSEGV, &sa, NULL) == 0);
+    // Snapshots handle writes to protected blocks without signals if possible
+    if (!Snapshot::startWriteProtect()) {
+        assert(sigaction(SIGSEGV, &sa, NULL) == 0);
+    }
     assert(sigaction(SIGUSR1, &sa, NULL) == 0);
+    SnapshotScheduler::getInstance().start();
 
     int *status;
     pthread_t main_thread;
@@ -81,17 +74,13 @@ int Savitar_main(MainFunction main_function, int argc, char **argv) {
     Savitar_thread_create(&main_thread, NULL, main_wrapper, &args);
     pthread_join(main_thread, (void **)&status);
 
-    // Wait for active snapshots to complete
-    pthread_mutex_lock(&snapshot_lock);
-    if (Snapshot::anyActiveSnapshot()) {
-        pthread_join(snapshot_thread, NULL);
-    }
-    pthread_mutex_unlock(&snapshot_lock);
+    // Wait for active snapshots (and merges) to complete
+    SnapshotScheduler::getInstance().stop();
+    SnapshotMerger::getInstance().wait();
 
 #ifndef SYNC_SL
     Savitar_core_finalize();
 #endif // SYNC_SL
-    pthread_mutex_destroy(&snapshot_lock);
 
     int ret_val = *status;
     free(status);
@@ -0,0 +1,174 @@
+#include <string.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include "copy_kernels.hpp"
+
+#define BATCH_WIDTH 256 // bytes streamed per iteration
+
+static void Savitar_copy_sse2(void *dst, const void *src, size_t bytes) {
+    __m128i *dstPtr = (__m128i *)dst;
+    const __m128i *srcPtr = (const __m128i *)src;
+
+    for (size_t i = 0; i < bytes / BATCH_WIDTH; i++) {
+        __m128i xmm0 = _mm_loadu_si128(srcPtr + 0);
+        __m128i xmm1 = _mm_loadu_si128(srcPtr + 1);
+        __m128i xmm2 = _mm_loadu_si128(srcPtr + 2);
+        __m128i xmm3 = _mm_loadu_si128(srcPtr + 3);
+        __m128i xmm4 = _mm_loadu_si128(srcPtr + 4);
+        __m128i xmm5 = _mm_loadu_si128(srcPtr + 5);
+        __m128i xmm6 = _mm_loadu_si128(srcPtr + 6);
+        __m128i xmm7 = _mm_loadu_si128(srcPtr + 7);
+        __m128i xmm8 = _mm_loadu_si128(srcPtr + 8);
+        __m128i xmm9 = _mm_loadu_si128(srcPtr + 9);
+        __m128i xmm10 = _mm_loadu_si128(srcPtr + 10);
+        __m128i xmm11 = _mm_loadu_si128(srcPtr + 11);
+        __m128i xmm12 = _mm_loadu_si128(srcPtr + 12);
+        __m128i xmm13 = _mm_loadu_si128(srcPtr + 13);
+        __m128i xmm14 = _mm_loadu_si128(srcPtr + 14);
+        __m128i xmm15 = _mm_loadu_si128(srcPtr + 15);
+
+        _mm_stream_si128(dstPtr + 0, xmm0); // 16 bytes
+        _mm_stream_si128(dstPtr + 1, xmm1);
+        _mm_stream_si128(dstPtr + 2, xmm2);
+        _mm_stream_si128(dstPtr + 3, xmm3);
+        _mm_stream_si128(dstPtr + 4, xmm4);
+        _mm_stream_si128(dstPtr + 5, xmm5);
+        _mm_stream_si128(dstPtr + 6, xmm6);
+        _mm_stream_si128(dstPtr + 7, xmm7);
+        _mm_stream_si128(dstPtr + 8, xmm8);
+        _mm_stream_si128(dstPtr + 9, xmm9);
+        _mm_stream_si128(dstPtr + 10, xmm10);
+        _mm_stream_si128(dstPtr + 11, xmm11);
+        _mm_stream_si128(dstPtr + 12, xmm12);
+        _mm_stream_si128(dstPtr + 13, xmm13);
+        _mm_stream_si128(dstPtr + 14, xmm14);
+        _mm_stream_si128(dstPtr + 15, xmm15);
+
+        dstPtr += 16;
+        srcPtr += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static void Savitar_copy_avx2(void *dst, const void *src, size_t bytes) {
+    __m256i *dstPtr = (__m256i *)dst;
+    const __m256i *srcPtr = (const __m256i *)src;
+
+    for (size_t i = 0; i < bytes / BATCH_WIDTH; i++) {
+        __m256i ymm0 = _mm256_loadu_si256(srcPtr + 0);
+        __m256i ymm1 = _mm256_loadu_si256(srcPtr + 1);
+        __m256i ymm2 = _mm256_loadu_si256(srcPtr + 2);
+        __m256i ymm3 = _mm256_loadu_si256(srcPtr + 3);
+        __m256i ymm4 = _mm256_loadu_si256(srcPtr + 4);
+        __m256i ymm5 = _mm256_loadu_si256(srcPtr + 5);
+        __m256i ymm6 = _mm256_loadu_si256(srcPtr + 6);
+        __m256i ymm7 = _mm256_loadu_si256(srcPtr + 7);
+
+        _mm256_stream_si256(dstPtr + 0, ymm0); // 32 bytes
+        _mm256_stream_si256(dstPtr + 1, ymm1);
+        _mm256_stream_si256(dstPtr + 2, ymm2);
+        _mm256_stream_si256(dstPtr + 3, ymm3);
+        _mm256_stream_si256(dstPtr + 4, ymm4);
+        _mm256_stream_si256(dstPtr + 5, ymm5);
+        _mm256_stream_si256(dstPtr + 6, ymm6);
+        _mm256_stream_si256(dstPtr + 7, ymm7);
+
+        dstPtr += 8;
+        srcPtr += 8;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void Savitar_copy_avx512(void *dst, const void *src, size_t bytes) {
+    __m512i *dstPtr = (__m512i *)dst;
+    const __m512i *srcPtr = (const __m512i *)src;
+
+    for (size_t i = 0; i < bytes / BATCH_WIDTH; i++) {
+        __m512i zmm0 = _mm512_loadu_si512(srcPtr + 0);
+        __m512i zmm1 = _mm512_loadu_si512(srcPtr + 1);
+        __m512i zmm2 = _mm512_loadu_si512(srcPtr + 2);
+        __m512i zmm3 = _mm512_loadu_si512(srcPtr + 3);
+
+        _mm512_stream_si512(dstPtr + 0, zmm0); // 64 bytes
+        _mm512_stream_si512(dstPtr + 1, zmm1);
+        _mm512_stream_si512(dstPtr + 2, zmm2);
+        _mm512_stream_si512(dstPtr + 3, zmm3);
+
+        dstPtr += 4;
+        srcPtr += 4;
+    }
+}
+
+// Each movdir64b is a single 64-byte (weakly-ordered) write
+__attribute__((target("movdir64b")))
+static void Savitar_copy_movdir64b(void *dst, const void *src, size_t bytes) {
+    char *dstPtr = (char *)dst;
+    const char *srcPtr = (const char *)src;
+
+    for (size_t i = 0; i < bytes / 64; i++) {
+        _movdir64b(dstPtr, srcPtr);
+        dstPtr += 64;
+        srcPtr += 64;
+    }
+}
+
+static bool Savitar_cpu_supports_movdir64b() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & (1 << 28)) != 0; // CPUID.(EAX=7,ECX=0):ECX[28]
+}
+
+// Destination alignment of each kernel
+static size_t Savitar_copy_alignment(CopyFunction copy) {
+    if (copy == Savitar_copy_avx2) return 32;
+    if (copy == Savitar_copy_sse2) return 16;
+    return 64;
+}
+
+size_t Savitar_copy_kernels(CopyKernel *kernels, size_t capacity) {
+    size_t count = 0;
+    __builtin_cpu_init();
+    if (count < capacity) kernels[count++] = { "sse2", Savitar_copy_sse2 };
+    if (count < capacity && __builtin_cpu_supports("avx2")) {
+        kernels[count++] = { "avx2", Savitar_copy_avx2 };
+    }
+    if (count < capacity && __builtin_cpu_supports("avx512f")) {
+        kernels[count++] = { "avx512", Savitar_copy_avx512 };
+    }
+    if (count < capacity && Savitar_cpu_supports_movdir64b()) {
+        kernels[count++] = { "movdir64b", Savitar_copy_movdir64b };
+    }
+    return count;
+}
+
+static CopyKernel Savitar_stream_copy_dispatch() {
+    CopyKernel kernels[4];
+    size_t count = Savitar_copy_kernels(kernels, 4);
+#ifdef COPY_KERNEL
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(kernels[i].name, COPY_KERNEL) == 0) return kernels[i];
+    }
+#endif
+    // Fastest vector kernel (movdir64b is only selected explicitly)
+    while (strcmp(kernels[count - 1].name, "movdir64b") == 0) count--;
+    return kernels[count - 1];
+}
+
+const CopyKernel *Savitar_stream_copy_kernel() {
+    static const CopyKernel kernel = Savitar_stream_copy_dispatch();
+    return &kernel;
+}
+
+void Savitar_stream_copy(void *dst, const void *src, size_t bytes) {
+    static const CopyKernel *kernel = Savitar_stream_copy_kernel();
+    static const size_t alignment = Savitar_copy_alignment(kernel->copy);
+    size_t streamed = 0;
+    if (((uintptr_t)dst & (alignment - 1)) == 0) {
+        streamed = bytes - bytes % BATCH_WIDTH;
+        kernel->copy(dst, src, streamed);
+    }
+    if (streamed < bytes) {
+        memcpy((char *)dst + streamed, (const char *)src + streamed,
+                bytes - streamed);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void (*CopyFunction)(void *, const void *, size_t);
+
+typedef struct CopyKernel {
+    const char *name;
+    CopyFunction copy;
+} CopyKernel;
+
+/*
+ * Copies 'bytes' from 'src' to 'dst' using non-temporal stores
+ * * Uses the fastest kernel supported by the CPU (AVX-512, AVX2, SSE2),
+ *   selected once using CPUID, or the one named by COPY_KERNEL.
+ * * Streams 256 bytes at a time when 'dst' is aligned to the vector width
+ *   and 'bytes' is a multiple of 256 (e.g., 4 KB pages), the remaining
+ *   bytes are copied using regular stores.
+ * * Does not fence, callers issue an sfence before the copy is persisted.
+ */
+void Savitar_stream_copy(void *dst, const void *src, size_t bytes);
+
+// Kernel used by Savitar_stream_copy
+const CopyKernel *Savitar_stream_copy_kernel();
+
+/*
+ * Kernels supported by the CPU (for benchmarks), including movdir64b
+ * (64-byte direct stores) which is never selected by default
+ */
+size_t Savitar_copy_kernels(CopyKernel *kernels, size_t capacity);
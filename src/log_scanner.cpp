@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <immintrin.h>
+#include "log_scanner.hpp"
+
+#define LINE_WIDTH 64 // CACHE_LINE_WIDTH
+
+typedef size_t (*ScanFunction)(const char *, uint64_t, uint64_t, uint64_t,
+        LogScanRecord *, size_t, uint64_t *);
+
+static inline void Savitar_log_scan_emit(const char *base, uint64_t offset,
+        LogScanRecord *record) {
+    const uint64_t *line = (const uint64_t *)(base + offset);
+    record->offset = offset;
+    record->commit_id = line[0];
+    record->tag = line[2];
+}
+
+static size_t Savitar_log_scan_scalar(const char *base, uint64_t begin,
+        uint64_t end, uint64_t magic, LogScanRecord *records,
+        size_t capacity, uint64_t *next) {
+    size_t found = 0;
+    uint64_t offset = begin;
+    for (; offset < end && found < capacity; offset += LINE_WIDTH) {
+        if (*(const uint64_t *)(base + offset + 8) != magic) continue;
+        Savitar_log_scan_emit(base, offset, &records[found++]);
+    }
+    *next = offset;
+    return found;
+}
+
+/*
+ * Tests the magic word of 4 lines at once (gather, 64-byte stride)
+ * Matching lines are emitted in order, if the output fills up in the
+ * middle of a batch, scanning resumes from the line after the last match.
+ */
+__attribute__((target("avx2")))
+static size_t Savitar_log_scan_avx2(const char *base, uint64_t begin,
+        uint64_t end, uint64_t magic, LogScanRecord *records,
+        size_t capacity, uint64_t *next) {
+    const __m256i vmagic = _mm256_set1_epi64x(magic);
+    const __m256i vindex = _mm256_set_epi64x(3 * LINE_WIDTH + 8,
+            2 * LINE_WIDTH + 8, LINE_WIDTH + 8, 8);
+    size_t found = 0;
+    uint64_t offset = begin;
+    while (offset + 4 * LINE_WIDTH <= end) {
+        __m256i words = _mm256_i64gather_epi64(
+                (const long long *)(base + offset), vindex, 1);
+        uint32_t mask = _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpeq_epi64(words, vmagic)));
+        while (mask != 0) {
+            uint32_t lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            Savitar_log_scan_emit(base, offset + lane * LINE_WIDTH,
+                    &records[found++]);
+            if (found == capacity) {
+                *next = offset + (lane + 1) * LINE_WIDTH;
+                return found;
+            }
+        }
+        offset += 4 * LINE_WIDTH;
+    }
+    return found + Savitar_log_scan_scalar(base, offset, end, magic,
+            records + found, capacity - found, next);
+}
+
+// Same as the AVX2 version, 8 lines at once
+__attribute__((target("avx512f")))
+static size_t Savitar_log_scan_avx512(const char *base, uint64_t begin,
+        uint64_t end, uint64_t magic, LogScanRecord *records,
+        size_t capacity, uint64_t *next) {
+    const __m512i vmagic = _mm512_set1_epi64(magic);
+    const __m512i vindex = _mm512_set_epi64(7 * LINE_WIDTH + 8,
+            6 * LINE_WIDTH + 8, 5 * LINE_WIDTH + 8, 4 * LINE_WIDTH + 8,
+            3 * LINE_WIDTH + 8, 2 * LINE_WIDTH + 8, LINE_WIDTH + 8, 8);
+    size_t found = 0;
+    uint64_t offset = begin;
+    while (offset + 8 * LINE_WIDTH <= end) {
+        __m512i words = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(),
+                0xFF, vindex, base + offset, 1);
+        uint32_t mask = _mm512_cmpeq_epi64_mask(words, vmagic);
+        while (mask != 0) {
+            uint32_t lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            Savitar_log_scan_emit(base, offset + lane * LINE_WIDTH,
+                    &records[found++]);
+            if (found == capacity) {
+                *next = offset + (lane + 1) * LINE_WIDTH;
+                return found;
+            }
+        }
+        offset += 8 * LINE_WIDTH;
+    }
+    return found + Savitar_log_scan_scalar(base, offset, end, magic,
+            records + found, capacity - found, next);
+}
+
+static ScanFunction Savitar_log_scan_dispatch() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Savitar_log_scan_avx512;
+    if (__builtin_cpu_supports("avx2")) return Savitar_log_scan_avx2;
+    return Savitar_log_scan_scalar;
+}
+
+size_t Savitar_log_scan(const char *base, uint64_t begin, uint64_t end,
+        uint64_t magic, LogScanRecord *records, size_t capacity,
+        uint64_t *next) {
+    static const ScanFunction scan = Savitar_log_scan_dispatch();
+    assert(begin % LINE_WIDTH == 0);
+    if (capacity == 0 || begin >= end) {
+        *next = begin;
+        return 0;
+    }
+    return scan(base, begin, end, magic, records, capacity, next);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Header of a log entry found by the scanner
+ * Log entries are cache-line aligned and start with (commit id, magic, tag).
+ */
+typedef struct LogScanRecord {
+    uint64_t offset;
+    uint64_t commit_id;
+    uint64_t tag;
+} LogScanRecord;
+
+/*
+ * Scans the 64-byte lines of a log in [begin, end) and finds the lines
+ * that start a log entry (i.e., the second word matches 'magic').
+ * * Uses AVX-512 or AVX2 (if supported by the CPU) to test multiple lines
+ *   at once, falls back to scalar code otherwise.
+ * * Stops after finding 'capacity' entries: returns the number of entries
+ *   written to 'records', and sets 'next' to the offset of the first line
+ *   that has not been scanned yet.
+ * * Does not parse entries, so lines inside large entries are also tested.
+ */
+size_t Savitar_log_scan(const char *base, uint64_t begin, uint64_t end,
+        uint64_t magic, LogScanRecord *records, size_t capacity,
+        uint64_t *next);
@@ -0,0 +1,63 @@
+#pragma once
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+class PersistentObject;
+
+/*
+ * Objects that share nested transactions (callers and callees)
+ * Recorded by live transactions and while replaying logs, so snapshots
+ * can take the objects of a nested transaction at the same log point:
+ * fuzzy snapshots capture them together and selective snapshots save or
+ * keep them together. Objects are never removed (no permanent deletes).
+ */
+class NestedCalls {
+    public:
+        NestedCalls() {
+            pthread_mutex_init(&lock, NULL);
+        }
+
+        ~NestedCalls() {
+            pthread_mutex_destroy(&lock);
+            calls.clear();
+        }
+
+        static NestedCalls& getInstance() {
+            static NestedCalls instance;
+            return instance;
+        }
+
+        void add(PersistentObject *parent, PersistentObject *child) {
+            if (parent == child) return;
+            pthread_mutex_lock(&lock);
+            calls[parent].insert(child);
+            calls[child].insert(parent);
+            pthread_mutex_unlock(&lock);
+        }
+
+        /*
+         * Adds the objects that share nested transactions with the provided
+         * ones, directly or through other objects
+         */
+        void close(set<PersistentObject *> &objects) {
+            vector<PersistentObject *> pending(objects.begin(), objects.end());
+            pthread_mutex_lock(&lock);
+            while (!pending.empty()) {
+                auto it = calls.find(pending.back());
+                pending.pop_back();
+                if (it == calls.end()) continue;
+                for (PersistentObject *object : it->second) {
+                    if (objects.insert(object).second) pending.push_back(object);
+                }
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+    private:
+        pthread_mutex_t lock;
+        map<PersistentObject *, set<PersistentObject *>> calls;
+};
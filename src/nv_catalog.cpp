@@ -40,9 +40,18 @@ NVCatalog::NVCatalog(string path, list< pair<std::string, CatalogEntry *> >& obj
         catalog->magic = CatalogMagic;
         pmem_persist(catalog, CACHE_LINE_WIDTH);
     }
+
+    // Recovery hints (created on demand, all zero for new catalogs)
+    strcpy(catalog_path, PMEM_PATH);
+    strcat(catalog_path, CATALOG_HINTS_FILE_NAME);
+    hints = (CatalogHint *)pmem_map_file(catalog_path, CatalogHintsSize,
+            PMEM_FILE_CREATE, 0666, &mapped_len, NULL);
+    assert(hints != NULL);
+    assert(mapped_len == CatalogHintsSize);
 }
 
 NVCatalog::~NVCatalog() {
+    pmem_unmap(hints, CatalogHintsSize);
     pmem_unmap(catalog, CatalogSize);
 }
 
@@ -71,3 +80,7 @@ void NVCatalog::setFlags(uint64_t flags) {
     catalog->flags = flags;
     pmem_persist(catalog, CACHE_LINE_WIDTH);
 }
+
+void NVCatalog::persistHints() {
+    pmem_persist(hints, catalog->object_count * sizeof(CatalogHint));
+}
@@ -24,6 +24,15 @@ typedef struct Catalog {
 
 const uint64_t CatalogFlagCleanShutdown = 0x0000000000000001;
 
+/*
+ * Recovery hints, one per catalog entry (same index)
+ * accesses: number of transactions on the object, used to order recovery
+ */
+typedef struct CatalogHint {
+    uint64_t accesses;
+} CatalogHint;
+const size_t CatalogHintsSize = MaxPersistentObjects * sizeof(CatalogHint);
+
 class NVCatalog {
     public:
         NVCatalog(string, list< pair<std::string, CatalogEntry *> >&);
@@ -34,8 +43,14 @@ class NVCatalog {
         void setFlags(uint64_t);
         uint64_t getFlags() { return catalog->flags; }
 
+        CatalogHint *getHint(CatalogEntry *entry) {
+            return &hints[entry - catalog->objects];
+        }
+        void persistHints();
+
     private:
         Catalog *catalog = NULL;
+        CatalogHint *hints = NULL;
 
         friend class NVManager;
 };
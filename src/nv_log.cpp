@@ -1,7 +1,12 @@
 #include <libpmem.h>
 #include <uuid/uuid.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <fstream>
 #include <string.h>
+#include <algorithm>
 #include "nv_log.hpp"
 #include "savitar.hpp"
 
@@ -9,6 +14,39 @@
 
 static const uint64_t LogMagic = REDO_LOG_MAGIC;
 
+/*
+ * Shared with forked snapshot children (SNAPSHOT_FORK) so that a child
+ * throttles its copies on the appends of the parent
+ */
+static const size_t LatencyBuckets = 64;
+static volatile uint64_t *latencyHistogram = NULL;
+static volatile bool latencySampling = false;
+
+static inline uint64_t Savitar_log_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t Savitar_log_index_size(uint64_t log_size) {
+    uint64_t size = (log_size / LOG_INDEX_STRIDE) * sizeof(SavitarLogIndexSlot);
+    return (size + CACHE_LINE_WIDTH - 1) & ~((uint64_t)CACHE_LINE_WIDTH - 1);
+}
+
+// Logs created before the commit index use the whole file for entries
+static inline bool Savitar_log_indexed(SavitarLog *log) {
+    return log->checksum == (CHECKSUM(log) ^ REDO_LOG_INDEXED);
+}
+
+uint64_t Savitar_log_capacity(SavitarLog *log) {
+    if (!Savitar_log_indexed(log)) return log->size;
+    return log->size - Savitar_log_index_size(log->size);
+}
+
+static inline SavitarLogIndexSlot *Savitar_log_index(SavitarLog *log) {
+    return (SavitarLogIndexSlot *)((char *)log + Savitar_log_capacity(log));
+}
+
 void Savitar_log_path(uuid_t uuid, char *path) {
     assert(uuid_is_null(uuid) == 0);
 
@@ -56,7 +94,7 @@ SavitarLog *Savitar_log_create(uuid_t id, size_t size) {
         log->head = log->tail;
         log->last_commit = 0;
         log->snapshot_lock = 0;
-        log->checksum = CHECKSUM(log);
+        log->checksum = CHECKSUM(log) ^ REDO_LOG_INDEXED;
         pmem_persist(log, sizeof(struct RedoLog));
         PRINT("Created new semantic log at %s\n", path);
     }
@@ -75,6 +113,7 @@ void Savitar_log_close(SavitarLog *log) {
 
 uint64_t Savitar_log_append(struct RedoLog *log, ArgVector *v, size_t v_size) {
     assert(v_size > 0);
+    uint64_t start = latencySampling ? Savitar_log_clock() : 0;
     size_t entry_size = 2 * sizeof(uint64_t); // Hole for commit_id and magic
     for (size_t i = 0; i < v_size; i++) {
         entry_size += v[i].len;
@@ -83,8 +122,10 @@ uint64_t Savitar_log_append(struct RedoLog *log, ArgVector *v, size_t v_size) {
         entry_size += CACHE_LINE_WIDTH - (entry_size % CACHE_LINE_WIDTH);
     }
 
+    // Must be read before reserving the entry (see SavitarLogIndexSlot)
+    uint64_t commit_floor = log->last_commit;
     uint64_t offset = __sync_fetch_and_add(&log->tail, entry_size);
-    assert(offset + entry_size <= log->size);
+    assert(offset + entry_size <= Savitar_log_capacity(log));
     char *dst = (char *)log + offset + sizeof(uint64_t); // Hole for commit_id
 
     pmem_memcpy_nodrain(dst, &LogMagic, sizeof(LogMagic));
@@ -94,12 +135,61 @@ uint64_t Savitar_log_append(struct RedoLog *log, ArgVector *v, size_t v_size) {
         dst += v[i].len;
     }
 
+    // Update the commit index if the entry crosses a stride boundary
+    uint64_t first_slot = (offset + LOG_INDEX_STRIDE - 1) / LOG_INDEX_STRIDE;
+    uint64_t last_slot = (offset + entry_size - 1) / LOG_INDEX_STRIDE;
+    if (first_slot <= last_slot && Savitar_log_indexed(log)) {
+        SavitarLogIndexSlot slot = { commit_floor, offset };
+        SavitarLogIndexSlot *index = Savitar_log_index(log);
+        for (uint64_t k = first_slot; k <= last_slot; k++) {
+            pmem_memcpy_nodrain(&index[k], &slot, sizeof(slot));
+        }
+    }
+
     pmem_drain();
     pmem_persist(&log->tail, sizeof(log->tail));
 
+    if (start != 0) {
+        uint64_t latency = Savitar_log_clock() - start;
+        size_t bucket = 63 - __builtin_clzll(latency | 1);
+        __sync_fetch_and_add(&latencyHistogram[bucket], 1);
+    }
     return offset;
 }
 
+void Savitar_log_latency_sampling(bool enabled) {
+    if (enabled && latencyHistogram == NULL) {
+        void *histogram = mmap(NULL, LatencyBuckets * sizeof(uint64_t),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(histogram != MAP_FAILED);
+        latencyHistogram = (volatile uint64_t *)histogram;
+    }
+    if (enabled) Savitar_log_latency(0); // drop stale samples
+    __sync_synchronize();
+    latencySampling = enabled;
+}
+
+uint64_t Savitar_log_latency(double percentile) {
+    if (latencyHistogram == NULL) return 0;
+    uint64_t counts[LatencyBuckets];
+    uint64_t total = 0;
+    for (size_t b = 0; b < LatencyBuckets; b++) {
+        counts[b] = __sync_fetch_and_and(&latencyHistogram[b], 0);
+        total += counts[b];
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    size_t b = 0;
+    for (; b < LatencyBuckets - 1; b++) {
+        seen += counts[b];
+        if (seen > rank) break;
+    }
+    return b < 63 ? (uint64_t)2 << b : UINT64_MAX;
+}
+
 void Savitar_log_commit(SavitarLog *log, uint64_t entry_offset) {
     uint64_t commit_id = __sync_add_and_fetch(&log->last_commit, 1);
     assert(commit_id < UINT64_MAX);
@@ -109,3 +199,74 @@ void Savitar_log_commit(SavitarLog *log, uint64_t entry_offset) {
     PRINT("[%d] Marked log entry (%zu) as committed with id = %zu\n",
             (int)pthread_self(), entry_offset, commit_id);
 }
+
+/*
+ * The new head is persisted before the space is returned to the file system
+ * (whole pages between the old and the new head), a crash in between only
+ * leaves some unused space in the log.
+ */
+void Savitar_log_truncate(SavitarLog *log, uint64_t head) {
+    assert(head <= log->tail);
+    uint64_t oldHead = log->head;
+    if (head <= oldHead) return;
+    log->head = head;
+    pmem_persist(&log->head, sizeof(log->head));
+
+    const uint64_t PageSize = 4096;
+    uint64_t start = (oldHead + PageSize - 1) & ~(PageSize - 1);
+    uint64_t end = head & ~(PageSize - 1);
+    if (start >= end) return;
+    char path[255];
+    Savitar_log_path(log->object_id, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                start, end - start) != 0) {
+        PRINT("Failed to release %zu bytes of log %s\n", end - start, path);
+    }
+    close(fd);
+    PRINT("Truncated log %s (head = %zu)\n", path, head);
+}
+
+/*
+ * Uses the commit index to find an upper bound for the offset of the entry,
+ * then scans the log backwards (one cache line at a time) to find the entry.
+ * Slots are not strictly sorted by commit_floor (concurrent appends), but any
+ * slot with a commit_floor >= commit_id is a valid upper bound.
+ * Logs without an index are scanned from the tail.
+ */
+uint64_t Savitar_log_find_commit(SavitarLog *log, uint64_t commit_id) {
+    if (commit_id == 0) return 0; // uncommitted entries are not indexed
+    const uint64_t tail = std::min(log->tail, Savitar_log_capacity(log));
+    uint64_t limit = tail;
+    if (Savitar_log_indexed(log)) {
+        SavitarLogIndexSlot *index = Savitar_log_index(log);
+
+        /*
+         * Binary search over slots [1, tail / stride], empty slots (appends
+         * that were in flight at the time of failure) are treated as upper
+         * bounds
+         */
+        uint64_t low = 1, high = (tail - 1) / LOG_INDEX_STRIDE + 1;
+        while (low < high) {
+            uint64_t mid = low + (high - low) / 2;
+            if (index[mid].offset != 0 && index[mid].commit_floor < commit_id) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        if (low <= (tail - 1) / LOG_INDEX_STRIDE && index[low].offset != 0) {
+            limit = index[low].offset;
+        }
+    }
+
+    const char *data = (const char *)log;
+    for (uint64_t offset = limit; offset > log->head;) {
+        offset -= CACHE_LINE_WIDTH;
+        const uint64_t *line = (const uint64_t *)&data[offset];
+        if (line[1] == REDO_LOG_MAGIC && line[0] == commit_id) return offset;
+    }
+    return 0;
+}
@@ -4,7 +4,8 @@
 #include <stdint.h>
 
 /*
- * checksum: to check if the log is initialized
+ * checksum: to check if the log is initialized, logs with a commit index
+ * store it xor REDO_LOG_INDEXED (older logs have no index region)
  * object_id: uuid of persistent object corresponding to the log
  * size: log size including the header
  * head/tail: offset of entries from the beginning of mapped region
@@ -20,6 +21,18 @@ typedef struct RedoLog {
     uint64_t snapshot_lock; // temporary value
 } SavitarLog;
 
+/*
+ * Sparse commit index, stored at the end of the log (after the entries)
+ * Slot k describes the entry containing byte (k * LOG_INDEX_STRIDE):
+ * offset: beginning of the entry
+ * commit_floor: last commit id before the entry was appended, all entries
+ * at or after 'offset' have larger commit ids
+ */
+typedef struct RedoLogIndexSlot {
+    uint64_t commit_floor;
+    uint64_t offset;
+} SavitarLogIndexSlot;
+
 typedef struct SavitarVector {
     void *addr;
     size_t len;
@@ -32,3 +45,19 @@ void Savitar_log_close(SavitarLog *);
 bool Savitar_log_exists(uuid_t);
 uint64_t Savitar_log_append(SavitarLog *, ArgVector *, size_t);
 void Savitar_log_commit(SavitarLog *, uint64_t);
+// Drops the entries before the offset (no longer needed by any snapshot)
+void Savitar_log_truncate(SavitarLog *, uint64_t);
+
+// End of the entries region (beginning of the commit index, if any)
+uint64_t Savitar_log_capacity(SavitarLog *);
+// Offset of the entry with the provided commit id (0 if not found)
+uint64_t Savitar_log_find_commit(SavitarLog *, uint64_t);
+
+/*
+ * Append latency histogram (log2 buckets, nanoseconds)
+ * Appends are only timed while sampling is enabled (throttled snapshot
+ * copies). Reading a percentile empties the histogram, it returns the upper
+ * bound of the bucket holding the percentile (0 if nothing was sampled).
+ */
+void Savitar_log_latency_sampling(bool);
+uint64_t Savitar_log_latency(double);
@@ -1,12 +1,18 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <cstring>
 #include <queue>
+#include <atomic>
 #include "nv_object.hpp"
 #include "nv_log.hpp"
 #include "savitar.hpp"
 #include "nvm_manager.hpp"
 #include "recovery_context.hpp"
+#include "recovery_scheduler.hpp"
+#include "log_scanner.hpp"
 
 /*
  * Constructor is only called for new objects:
@@ -53,6 +59,7 @@ PersistentObject::~PersistentObject() {
 
 class CommitRecord {
     public:
+        CommitRecord() { }
         CommitRecord(char *ptr, uint64_t commit_id, uint64_t method_tag) {
             _ptr = ptr;
             _commit_id = commit_id;
@@ -73,11 +80,124 @@ inline bool operator< (const CommitRecord& lhs, const CommitRecord& rhs) {
     return lhs.getCommitId() > rhs.getCommitId(); // Force ASC order for priority queue
 }
 
+/*
+ * Single-producer single-consumer ring of decoded log entries
+ * Used by objects with large logs (RECOVERY_PIPELINE_THRESHOLD) to split
+ * recovery into stages: a parse thread streams through the log (issuing
+ * read-ahead for the upcoming pages and prefetching the upcoming lines),
+ * decodes entry headers and runs dry-run Play() calls to find entry sizes,
+ * while the replay stage (Recover) only sorts entries and executes Play().
+ * Both stages use the object at the same time (see Play). Parse threads
+ * take the place of recovery workers (see RecoveryScheduler::claimParser),
+ * and a stage that has to wait (full or empty ring) sleeps until the other
+ * one makes progress, so a parked object costs no CPU.
+ */
+class RecoveryPipeline {
+    public:
+        static const size_t Capacity = 4096; // records, power of two
+        static const size_t ReadAhead = (size_t)4 << 20; // bytes
+        static const size_t PrefetchLines = 16;
+
+        PersistentObject *object;
+        char *ptr; // parse stage cursor
+        const char *limit;
+        uint64_t floor; // entries up to this commit id are not replayed
+        pthread_t thread;
+        std::atomic<bool> done;
+
+        RecoveryPipeline() {
+            pthread_mutex_init(&lock, NULL);
+            pthread_cond_init(&wakeup, NULL);
+        }
+
+        ~RecoveryPipeline() {
+            pthread_mutex_destroy(&lock);
+            pthread_cond_destroy(&wakeup);
+        }
+
+        // Called by the parse stage, sleeps while the ring is full
+        void push(const CommitRecord &record) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == Capacity) {
+                pthread_mutex_lock(&lock);
+                sleep(parserSleeping);
+                while (t - head.load(std::memory_order_acquire) == Capacity) {
+                    pthread_cond_wait(&wakeup, &lock);
+                }
+                parserSleeping.store(false, std::memory_order_relaxed);
+                pthread_mutex_unlock(&lock);
+            }
+            ring[t & (Capacity - 1)] = record;
+            tail.store(t + 1, std::memory_order_release);
+            notify(replaySleeping);
+        }
+
+        // Called by the parse stage after the last record
+        void finish() {
+            done.store(true, std::memory_order_release);
+            notify(replaySleeping);
+        }
+
+        // Called by the replay stage, returns false at the end of the log
+        bool pop(CommitRecord &record) {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t t = tail.load(std::memory_order_acquire);
+            if (t == h) { // parse stage is behind
+                pthread_mutex_lock(&lock);
+                sleep(replaySleeping);
+                while ((t = tail.load(std::memory_order_acquire)) == h &&
+                        !done.load(std::memory_order_acquire)) {
+                    pthread_cond_wait(&wakeup, &lock);
+                }
+                replaySleeping.store(false, std::memory_order_relaxed);
+                pthread_mutex_unlock(&lock);
+                // Records pushed before the end was published
+                if (t == h) t = tail.load(std::memory_order_acquire);
+                if (t == h) return false;
+            }
+            record = ring[h & (Capacity - 1)];
+            if (t - h > 4) { // bring in the arguments of upcoming entries
+                __builtin_prefetch(ring[(h + 4) & (Capacity - 1)].getPtr());
+            }
+            head.store(h + 1, std::memory_order_release);
+            notify(parserSleeping);
+            return true;
+        }
+
+    private:
+        alignas(CACHE_LINE_WIDTH) std::atomic<size_t> head {0};
+        alignas(CACHE_LINE_WIDTH) std::atomic<size_t> tail {0};
+        alignas(CACHE_LINE_WIDTH) CommitRecord ring[Capacity];
+
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        std::atomic<bool> parserSleeping {false};
+        std::atomic<bool> replaySleeping {false};
+
+        /*
+         * Announces the sleeping stage before it re-checks the ring, the
+         * other stage does the opposite (publishes progress before checking
+         * for a sleeper), so no wakeup is lost (must hold the lock)
+         */
+        void sleep(std::atomic<bool> &sleeping) {
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        void notify(std::atomic<bool> &sleeping) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!sleeping.load(std::memory_order_relaxed)) return;
+            pthread_mutex_lock(&lock);
+            pthread_cond_signal(&wakeup);
+            pthread_mutex_unlock(&lock);
+        }
+};
+
 /*
  * [General rules]
  * NVM manager is responsible for recovering all persistent objects through calling their Recover()
- * method at startup. Each object is assigned to a recovery thread. Look for the constructor method of
- * NVManager for more details.
+ * method at startup. Objects are recovered by a bounded pool of recovery threads (RecoveryScheduler).
+ * Look for the constructor method of NVManager for more details.
  * Also, all allocations are handled by the NVM manager object, which either finds the object or creates
  * an new persistent object using the object's factory method.
  * ----------------------------------------------------------------------------------------------------
@@ -95,6 +215,9 @@ inline bool operator< (const CommitRecord& lhs, const CommitRecord& rhs) {
  *   it will wait for the parent object to pass the point specified in the nested transaction log entry.
  *   For example, if the parent log shows commit order 12, the child object waits for the parent to finish
  *   executing the corresponding log entry and update 'last_played_commit_order' to 12.
+ *   Waiting children return from Recover() and are parked by the scheduler, which resumes them once the
+ *   parent has played the entry. A parent that needs a child to reach the nested entry runs the child
+ *   (or whatever the child is waiting for) on its own thread.
  * ----------------------------------------------------------------------------------------------------
  * [Partial commits]
  * These are committed log entries for nested transactions where the system fails before marking the
@@ -103,106 +226,275 @@ inline bool operator< (const CommitRecord& lhs, const CommitRecord& rhs) {
  * B must avoid waiting for A and should end the recovery process.
  * If there are other objects trying to play a log entry that involves the child or parent object, the
  * recovery process for those objects should stop as well.
- * If an unclean shutdown is detected, the NVM manager will initiate a process to fix the log so that
- * uncommitted transactions are not played.
+ * Uncommitted transactions are never played. If an unclean shutdown is detected, Recover() follows the
+ * chain of parent entries for every committed nested transaction and skips the entry (without waiting
+ * for the parent) if the outer-most transaction is not committed. This is done while replaying, so
+ * recovery makes a single pass over each log.
  * ----------------------------------------------------------------------------------------------------
  */
-void PersistentObject::Recover() {
+/*
+ * Replay progress of a recovering object, kept across calls to Recover()
+ * when the object is parked by the recovery scheduler.
+ */
+struct ReplayState {
+    char *ptr;
+    const char *limit;
+    std::priority_queue<CommitRecord> commit_queue;
+    char uuid_prefix[9];
+    RecoveryPipeline *pipeline = NULL;
+    const char *last_read; // beginning of the last entry read
+};
+
+bool PersistentObject::Recover() {
     assert(log != NULL);
     assert(sizeof(uint64_t) == 8); // We assume 2 * sizeof(uint64_t) == 16
-    NVManager *manager = RecoveryContext::getInstance().getManager();
+    RecoveryContext &context = RecoveryContext::getInstance();
+    NVManager *manager = context.getManager();
     assert(manager != NULL);
+    RecoveryScheduler *scheduler = context.getScheduler();
 
-    // Calculating head and limit pointers
-    uint64_t logHead = RecoveryContext::getInstance().queryLogHeadOffset(uuid_str);
-    if (logHead == 0) logHead = log->head;
-    char *ptr = (char *)log + logHead;
-    const char *limit = (char *)log + log->tail;
-
-    char uuid_str[64], uuid_prefix[9];
-    uuid_unparse(uuid, uuid_str);
-    memcpy(uuid_prefix, uuid_str, 8);
-    uuid_prefix[8] = '\0';
-    PRINT("[%s] Started recovering %s\n", uuid_prefix, uuid_str);
-    PRINT("[%s] Log head: %zu\n", uuid_prefix, log->head);
-    PRINT("[%s] New head: %zu\n", uuid_prefix, logHead);
-    PRINT("[%s] Log tail: %zu\n", uuid_prefix, log->tail);
-
-    // Creating data-structures to handle out-of-order entries
-    std::priority_queue<CommitRecord> commit_queue;
-
-    while (ptr < limit) {
-        // 1. Read commit id and method tag from persistent log
-        uint64_t commit_id = *((uint64_t *)ptr);
-        PRINT("[%s] Found record with commit order = %zu\n",
-                uuid_prefix, commit_id);
-        ptr += sizeof(uint64_t);
-
-        uint64_t magic = *((uint64_t *)ptr);
-        if (commit_id == 0 && magic != REDO_LOG_MAGIC) { // partial transaction
-            do {
-                ptr += CACHE_LINE_WIDTH;
-                magic = *((uint64_t *)ptr);
-            } while (magic != REDO_LOG_MAGIC);
-        }
-        // TODO bug fix: update commit_id when skipping partial transactions
+    if (replay == NULL) {
+        replay = new ReplayState();
 
-        ptr += sizeof(uint64_t);
-        assert(magic == REDO_LOG_MAGIC);
-        uint64_t method_tag = *((uint64_t *)ptr);
-        ptr += sizeof(uint64_t);
+        // Calculating head and limit pointers
+        uint64_t logHead = context.queryLogHeadOffset(uuid);
+        if (logHead == 0) logHead = log->head;
+        replay->ptr = (char *)log + logHead;
+        replay->limit = (char *)log + log->tail;
+        replay->last_read = replay->ptr;
 
-        // 2. Add the entry to priority queue to sort entries based on commit id
-        size_t bytes_processed = sizeof(uuid_t);
-        if ((method_tag & NESTED_TX_TAG) == 0) { // dry run
-            bytes_processed = Play(method_tag, (uint64_t *)ptr, true);
-        }
+        memcpy(replay->uuid_prefix, uuid_str, 8);
+        replay->uuid_prefix[8] = '\0';
+        PRINT("[%s] Started recovering %s\n", replay->uuid_prefix, uuid_str);
+        PRINT("[%s] Log head: %zu\n", replay->uuid_prefix, log->head);
+        PRINT("[%s] New head: %zu\n", replay->uuid_prefix, logHead);
+        PRINT("[%s] Log tail: %zu\n", replay->uuid_prefix, log->tail);
 
-        if (commit_id > last_played_commit_id) {
-            commit_queue.push(CommitRecord(ptr, commit_id, method_tag));
+        if ((uint64_t)(replay->limit - replay->ptr) > RECOVERY_PIPELINE_THRESHOLD &&
+                scheduler != NULL && scheduler->claimParser()) {
+            RecoveryPipeline *pipeline = new RecoveryPipeline();
+            pipeline->object = this;
+            pipeline->ptr = replay->ptr;
+            pipeline->limit = replay->limit;
+            pipeline->floor = last_played_commit_id;
+            pipeline->done = false;
+            pthread_create(&pipeline->thread, NULL, parseWorker, pipeline);
+            replay->pipeline = pipeline;
+            PRINT("[%s] Using a parse thread\n", replay->uuid_prefix);
         }
+    }
+    else {
+        PRINT("[%s] Resumed recovering %s\n", replay->uuid_prefix, uuid_str);
+    }
 
-        // 3. Update iterator to point to the next entry
-        ptr += bytes_processed;
-        ptr += CACHE_LINE_WIDTH - ((24 + bytes_processed) % CACHE_LINE_WIDTH);
+    char *&ptr = replay->ptr;
+    const char *limit = replay->limit;
+    RecoveryPipeline *pipeline = replay->pipeline;
+    // Data-structures to handle out-of-order entries
+    std::priority_queue<CommitRecord> &commit_queue = replay->commit_queue;
 
-        // 4. Use the priority queue to play entries in order
+    while (true) {
+        // 1. Use the priority queue to play entries in order
         while (!commit_queue.empty() &&
                 commit_queue.top().getCommitId() == last_played_commit_id + 1) {
             const CommitRecord &record = commit_queue.top();
             PRINT("[%s] Playing record with commit order = %zu\n",
-                    uuid_prefix, record.getCommitId());
+                    replay->uuid_prefix, record.getCommitId());
             if (record.getMethodTag() & NESTED_TX_TAG) { // dependant (nested) transaction
                 off_t parent_offset = (off_t)(record.getMethodTag() & (~NESTED_TX_TAG));
                 PRINT("[%s] Nested transaction, parent entry at offset %zu\n",
-                        uuid_prefix, parent_offset);
+                        replay->uuid_prefix, parent_offset);
                 struct NestedEntry {
                     uuid_t uuid;
                 } *parent_uuid = (struct NestedEntry *)record.getPtr();
-                char parent_uuid_str[64];
-                uuid_unparse(parent_uuid->uuid, parent_uuid_str);
-                PersistentObject *parent = manager->findObject(parent_uuid_str);
+                PersistentObject *parent = manager->findObject(parent_uuid->uuid);
                 assert(parent != NULL);
+                addCaller(parent);
                 uint64_t expected_commit_id = *((uint64_t *)((char *)parent->log +
                             parent_offset));
-                PRINT("[%s] Nested transaction, waiting for object %s to execute commit %zu\n",
-                        uuid_prefix, parent_uuid_str, expected_commit_id);
-                waitForParent(parent, expected_commit_id);
-                while (parent->last_played_commit_id < expected_commit_id) {
-                    assert(parent->isRecovering());
+                if (context.isUncleanShutdown() &&
+                        isAbortedTransaction(parent, parent_offset)) {
+                    // Parent never plays the entry, nothing to wait for
+                    PRINT("[%s] Nested transaction, skipping aborted transaction\n",
+                            replay->uuid_prefix);
+                    context.countAbortedTransaction();
+                }
+                else {
+                    PRINT("[%s] Nested transaction, waiting for object %s to execute commit %zu\n",
+                            replay->uuid_prefix, parent->uuid_str, expected_commit_id);
+                    waitForParent(parent, expected_commit_id);
+                    if (parent->last_played_commit_id < expected_commit_id) {
+                        // Yield the thread, the scheduler resumes us later
+                        assert(parent->isRecovering());
+                        return false;
+                    }
+                    PRINT("[%s] Done waiting for parent object\n", replay->uuid_prefix);
                 }
-                PRINT("[%s] Done waiting for parent object\n", uuid_prefix);
             }
             else {
                 Play(record.getMethodTag(), (uint64_t *)record.getPtr(), false);
             }
             last_played_commit_id = record.getCommitId();
             PRINT("[%s] Finished playing commit order %zu, last played commit updated to %zu\n",
-                    uuid_prefix, record.getCommitId(), last_played_commit_id);
+                    replay->uuid_prefix, record.getCommitId(), last_played_commit_id);
             commit_queue.pop();
+
+            // Wake up children parked on this commit (see RecoveryScheduler::park)
+            __sync_synchronize();
+            if (task != NULL && task->waiting != 0) scheduler->progress(task);
+
+            // Stop for a recovery checkpoint (see RecoveryScheduler::pause)
+            if (task != NULL && scheduler->preempt(task)) {
+                PRINT("[%s] Preempted after commit %zu\n",
+                        replay->uuid_prefix, last_played_commit_id);
+                return false;
+            }
+        }
+
+        // 2. Read the next entry (from the parse stage for large logs)
+        CommitRecord record;
+        if (pipeline != NULL) {
+            if (!pipeline->pop(record)) break;
+        }
+        else if (!parseRecord(ptr, limit, &record)) break;
+        replay->last_read = record.getPtr() - 3 * sizeof(uint64_t);
+
+        // 3. Add the entry to priority queue to sort entries based on commit id
+        if (record.getCommitId() > last_played_commit_id) {
+            commit_queue.push(record);
         }
     }
 
+    if (pipeline != NULL) {
+        pthread_join(pipeline->thread, NULL);
+        delete pipeline;
+        scheduler->releaseParser();
+    }
     assert(commit_queue.empty());
-    PRINT("[%s] Finished recovering %s\n", uuid_prefix, uuid_str);
+    PRINT("[%s] Finished recovering %s\n", replay->uuid_prefix, uuid_str);
+    delete replay;
+    replay = NULL;
+    return true;
+}
+
+/*
+ * Reads commit id and method tag of the log entry at 'ptr' and skips
+ * partial transactions (entries without a commit id or magic).
+ * Returns false if there are no entries left before 'limit'.
+ */
+bool PersistentObject::parseRecord(char *&ptr, const char *limit,
+        CommitRecord *record) {
+    if (ptr >= limit) return false;
+
+    uint64_t commit_id = *((uint64_t *)ptr);
+    ptr += sizeof(uint64_t);
+
+    uint64_t magic = *((uint64_t *)ptr);
+    if (commit_id == 0 && magic != REDO_LOG_MAGIC) { // partial transaction
+        // Skip to the next entry (SIMD scan of cache-line headers)
+        const char *base = (const char *)log;
+        uint64_t line = (ptr - base) - sizeof(uint64_t) + CACHE_LINE_WIDTH;
+        uint64_t next_line;
+        LogScanRecord entry;
+        if (Savitar_log_scan(base, line, limit - base, REDO_LOG_MAGIC,
+                    &entry, 1, &next_line) == 0) {
+            ptr = (char *)limit;
+            return false;
+        }
+        ptr = (char *)base + entry.offset + sizeof(uint64_t);
+        commit_id = entry.commit_id;
+        magic = REDO_LOG_MAGIC;
+    }
+    PRINT("[%.8s] Found record with commit order = %zu\n", uuid_str, commit_id);
+
+    ptr += sizeof(uint64_t);
+    assert(magic == REDO_LOG_MAGIC);
+    uint64_t method_tag = *((uint64_t *)ptr);
+    ptr += sizeof(uint64_t);
+
+    size_t bytes_processed = sizeof(uuid_t);
+    if ((method_tag & NESTED_TX_TAG) == 0) { // dry run
+        bytes_processed = Play(method_tag, (uint64_t *)ptr, true);
+    }
+    *record = CommitRecord(ptr, commit_id, method_tag);
+
+    // Update iterator to point to the next entry
+    ptr += bytes_processed;
+    ptr += CACHE_LINE_WIDTH - ((24 + bytes_processed) % CACHE_LINE_WIDTH);
+    return true;
+}
+
+// Parse stage of the recovery pipeline (see RecoveryPipeline)
+void *PersistentObject::parseWorker(void *arg) {
+    RecoveryPipeline *pipeline = (RecoveryPipeline *)arg;
+    PersistentObject *object = pipeline->object;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    char *advised = (char *)((uintptr_t)pipeline->ptr & ~(page - 1));
+    CommitRecord record;
+
+    while (true) {
+        if (advised < pipeline->limit &&
+                advised < pipeline->ptr + RecoveryPipeline::ReadAhead / 2) {
+            size_t length = pipeline->limit - advised;
+            if (length > RecoveryPipeline::ReadAhead) {
+                length = RecoveryPipeline::ReadAhead;
+            }
+            madvise(advised, length, MADV_WILLNEED);
+            advised += RecoveryPipeline::ReadAhead;
+        }
+        __builtin_prefetch(pipeline->ptr +
+                RecoveryPipeline::PrefetchLines * CACHE_LINE_WIDTH);
+
+        if (!object->parseRecord(pipeline->ptr, pipeline->limit, &record)) break;
+        if (record.getCommitId() > pipeline->floor) pipeline->push(record);
+    }
+
+    pipeline->finish();
+    return NULL;
+}
+
+/*
+ * Log offset to resume replaying from (used by recovery checkpoints)
+ * Every entry that is not played yet is either in the commit queue or was
+ * not read yet, so replaying from the earliest of them and skipping
+ * entries up to last_played_commit_id restores the current progress.
+ */
+uint64_t PersistentObject::replayOffset() {
+    if (!recovering) return log->tail;
+    if (replay == NULL) { // not started yet
+        uint64_t logHead = RecoveryContext::getInstance().queryLogHeadOffset(uuid);
+        return logHead != 0 ? logHead : log->head;
+    }
+
+    const char *offset = replay->last_read;
+    std::priority_queue<CommitRecord> queue = replay->commit_queue;
+    while (!queue.empty()) {
+        const char *entry = queue.top().getPtr() - 3 * sizeof(uint64_t);
+        if (entry < offset) offset = entry;
+        queue.pop();
+    }
+    return offset - (const char *)log;
+}
+
+/*
+ * Follows the chain of parent log entries (starting from the provided entry)
+ * and checks whether the outer-most transaction is committed.
+ * Note: log entries of parent transactions are always persistent before the
+ * entries of their child transactions, so parent entries are not corrupted.
+ */
+bool PersistentObject::isAbortedTransaction(PersistentObject *parent,
+        off_t parent_offset) {
+    NVManager *manager = RecoveryContext::getInstance().getManager();
+    while (true) {
+        uint64_t *parent_ptr = (uint64_t *)((char *)parent->log + parent_offset);
+        assert(parent_ptr[1] == REDO_LOG_MAGIC);
+        uint64_t commit_id = parent_ptr[0];
+        uint64_t method_tag = parent_ptr[2];
+        if (commit_id == 0) return true; // outer transactions commit later
+        if ((method_tag & NESTED_TX_TAG) == 0) return false; // outer-most
+
+        parent = manager->findObject(((uuid_t *)&parent_ptr[3])[0]);
+        assert(parent != NULL);
+        parent_offset = (off_t)(method_tag & (~NESTED_TX_TAG));
+    }
 }
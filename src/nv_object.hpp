@@ -7,9 +7,14 @@
 #include "nv_log.hpp"
 #include "nvm_manager.hpp"
 #include "ckpt_alloc.hpp"
+#include "nested_calls.hpp"
 
 class NVManager;
 class Snapshot;
+class RecoveryScheduler;
+struct RecoveryTask;
+struct ReplayState;
+class CommitRecord;
 
 /*
  * Objects demanding transactional durability must extend this class and
@@ -38,9 +43,19 @@ class PersistentObject {
 
         bool isRecovering() { return recovering != 0; }
         bool isWaitingForSnapshot() { return log->snapshot_lock != 0; }
+        // Locked by a fuzzy snapshot that has not captured it yet
+        bool isBeingCaptured() { return isWaitingForSnapshot() && !captured; }
+        void countAccess() { accesses++; }
 
         ObjectAlloc *getAllocator() { return alloc; }
 
+        // Records the object of the enclosing transaction (see NestedCalls)
+        void addCaller(PersistentObject *parent) {
+            if (parent == nested_caller) return;
+            NestedCalls::getInstance().add(parent, this);
+            nested_caller = parent;
+        }
+
         // TODO support for permanent deletes
         void operator delete (void *ptr) {
             PersistentObject *obj = (PersistentObject *)ptr;
@@ -82,10 +97,25 @@ class PersistentObject {
         }
 
     protected:
-        // Called by NVM Manager during the recovery process
-        void Recover();
+        /*
+         * Called by the recovery scheduler during the recovery process
+         * Returns false if the object has to wait for a parent object to
+         * replay a nested transaction (call again to resume).
+         */
+        bool Recover();
+        bool isAbortedTransaction(PersistentObject *, off_t);
+        uint64_t replayOffset();
+        // Decodes the log entry at 'ptr' and moves 'ptr' to the next entry
+        bool parseRecord(char *&ptr, const char *limit, CommitRecord *record);
+        static void *parseWorker(void *);
 
-        // Called by the NVM Manager through Recover()
+        /*
+         * Called by the NVM Manager through Recover()
+         * Dry runs only return the size of the arguments of the entry. They
+         * must not read or write the state of the object: for large logs
+         * (RECOVERY_PIPELINE_THRESHOLD) they run on a parse thread while
+         * earlier entries are played (see RecoveryPipeline).
+         */
         virtual size_t Play(uint64_t tag, uint64_t *args, bool dry) = 0;
 
         /*
@@ -113,8 +143,21 @@ class PersistentObject {
 
         // commit id of the last played log entry
         uint64_t last_played_commit_id;
+        // number of transactions (approximate), saved as a recovery hint
+        // (only counted with LAZY_RECOVERY)
+        uint64_t accesses = 0;
         ObjectAlloc *alloc = NULL;
+        // last caller recorded in NestedCalls
+        PersistentObject *nested_caller = NULL;
+        // captured by the running fuzzy snapshot (SNAPSHOT_FUZZY)
+        volatile bool captured = false;
+
+        // Recovery progress (only valid while recovering)
+        ReplayState *replay = NULL;
+        RecoveryTask *task = NULL;
 
         friend class NVManager;
         friend class Snapshot;
+        friend class SnapshotScheduler;
+        friend class RecoveryScheduler;
 };
@@ -1,11 +1,14 @@
 #include <pthread.h>
+#include <sched.h>
 #include <list>
 #include <queue>
+#include <set>
 #include "nv_factory.hpp"
 #include "nv_object.hpp"
 #include "nvm_manager.hpp"
 #include "nv_catalog.hpp"
 #include "recovery_context.hpp"
+#include "recovery_scheduler.hpp"
 #include "snapshot.hpp"
 
 using namespace std;
@@ -27,78 +30,181 @@ NVManager::NVManager() {
 
     // Prepare for recovery
     RecoveryContext::getInstance().setManager(this);
-    struct timespec t1, t2;
+    struct timespec t1;
     clock_gettime(CLOCK_REALTIME, &t1);
 
-    // Load the latest snapshot (if any)
-    Snapshot *snapshot = new Snapshot(PMEM_PATH);
-    if (snapshot->lastSnapshotID() > 0) {
-        snapshot->load(snapshot->lastSnapshotID(), this);
+    /*
+     * Load the latest snapshot (if any)
+     * Blocks owned by persistent objects are restored by the recovery
+     * threads right before replaying the log of each object (restoreObject),
+     * so restoring the heap overlaps with replaying the logs.
+     * With UFFD_RESTORE, the heap is paged in on first access instead, and
+     * the snapshot is kept until background threads have copied the rest.
+     * With HEAP_FILE, the heap left by a clean shutdown is mapped back
+     * instead (warm restart), only entries logged since are replayed.
+     */
+    snapshot = new Snapshot(PMEM_PATH);
+    std::set<std::string> catalogObjects;
+    for (auto it = ex_objects.begin(); it != ex_objects.end(); ++it) {
+        catalogObjects.insert(it->first);
     }
-    delete snapshot;
+    bool warm = (catalog->getFlags() & CatalogFlagCleanShutdown) != 0 &&
+        snapshot->loadImage(this, catalogObjects);
+    uint32_t snapshotID = snapshot->lastCompleteSnapshotID();
+    if (!warm && snapshotID > 0) snapshot->load(snapshotID, this);
 
     // Prepare environment for recovery (populate objects from ex_objects)
+    scheduler = new RecoveryScheduler();
+    RecoveryContext::getInstance().setScheduler(scheduler);
     for (auto it = ex_objects.begin(); it != ex_objects.end(); ++it) {
         recoverObject(it->first.c_str(), it->second);
     }
     ex_objects.clear();
-    const size_t obj_count = objects.size();
+    if (pendingRestores == 0 && !snapshot->pagingIn()) {
+        delete snapshot;
+        snapshot = NULL;
+    }
 
     /*
      * Handling unclean shutdowns
-     * We provide support for transaction aborts here. The effect of an aborted
-     * transaction on other objects/transactions is implemented here.
+     * Transactions aborted by the failure (nested transactions whose outer-most
+     * transaction never committed) are detected and skipped by Recover() while
+     * replaying the logs, so recovery makes a single pass over each log.
      */
     uint64_t cflags = catalog->getFlags();
     if ((cflags & CatalogFlagCleanShutdown) == 0) {
-        PRINT("Manager: detected unclean shutdown, fixing redo-logs ...\n");
-        int aborted_transactions = emulateRecoveryAndFixRedoLogs();
-        PRINT("Manager: finished fixing redo-logs, total aborted transactions = %d\n",
-                aborted_transactions);
+        PRINT("Manager: detected unclean shutdown, skipping aborted transactions\n");
+        RecoveryContext::getInstance().setUncleanShutdown(true);
     }
 
     /*
-     * Creating recovery threads (one per persistent object)
-     * We assume number of persistent objects are not much larger than
-     * the number of CPU cores.
-     * If that is not the case, we should partition persistent objects to
-     * groups with no inter-class dependencies and recover partitions
-     * one at a time.
+     * Recovering persistent objects on a bounded pool of threads
+     * Objects waiting on nested transactions are parked by the scheduler,
+     * so the number of objects can be much larger than the number of cores.
      */
     PRINT("Manager: recovering persistent objects ...\n");
-    size_t counter = 0;
-    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * obj_count);
-    for (auto it = objects.begin(); it != objects.end(); ++it) {
-        assert(counter < obj_count);
-        pthread_create(&threads[counter++], NULL, recoveryWorker, it->second);
-    }
-
-    // Wait for recovery threads to return
-    for (size_t i = 0; i < obj_count; i++) {
-        pthread_join(threads[i], NULL);
-    }
-
-    // Cleanup environment
+    recoveryStart = t1;
+#ifdef LAZY_RECOVERY
+    /*
+     * Lazy recovery: return immediately and recover objects in the
+     * background, live threads only block on objects they access
+     */
+    scheduler->start();
+    struct timespec t2;
     clock_gettime(CLOCK_REALTIME, &t2);
-    PRINT("Manager: finished recovering persistent objects!\n");
-    free(threads);
+    uint64_t startupTime = (t2.tv_sec - t1.tv_sec) * 1E9;
+    startupTime += (t2.tv_nsec - t1.tv_nsec);
+    fprintf(stdout, "Startup Time (ms)\t%.2f\n", (double)startupTime / 1E6);
+#else
+    if (RECOVERY_CHECKPOINT_INTERVAL > 0) recoverWithCheckpoints();
+    else scheduler->run();
+    waitForRecovery();
+    RecoveryContext::getInstance().setScheduler(NULL);
+    delete scheduler;
+    scheduler = NULL;
+#endif
 
     PRINT("Manager: updating catalog flags.\n");
     cflags = catalog->getFlags();
     cflags = (cflags & (~CatalogFlagCleanShutdown)); // unclean shutdown
     catalog->setFlags(cflags);
+}
 
-    uint64_t recoveryTime = (t2.tv_sec - t1.tv_sec) * 1E9;
-    recoveryTime += (t2.tv_nsec - t1.tv_nsec);
-    fprintf(stdout, "Recovery Time (ms)\t%.2f\n", (double)recoveryTime / 1E6);
+/*
+ * Restartable recovery
+ * Pauses the recovery threads every RECOVERY_CHECKPOINT_INTERVAL seconds
+ * and saves a snapshot of the replay progress (see Snapshot::checkpoint).
+ * Recoveries that needed checkpoints are followed by one more checkpoint,
+ * so a crash during (or right after) a long recovery resumes from the
+ * latest checkpoint instead of replaying the logs from the beginning.
+ */
+void NVManager::recoverWithCheckpoints() {
+    size_t checkpoints = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RECOVERY_CHECKPOINT_INTERVAL;
+
+    scheduler->start();
+    while (!scheduler->waitUntil(deadline)) {
+        scheduler->pause();
+        checkpointRecovery();
+        scheduler->resume();
+        checkpoints++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RECOVERY_CHECKPOINT_INTERVAL;
+    }
+    if (checkpoints > 0) checkpointRecovery();
+}
+
+void NVManager::checkpointRecovery() {
+    // Snapshots capture the whole heap, finish on-demand restores first
+    for (auto it = objects.begin(); it != objects.end(); ++it) {
+        restoreObject(it->second);
+    }
+
+    Snapshot *checkpoint = new Snapshot(PMEM_PATH);
+    checkpoint->checkpoint(this);
+    delete checkpoint;
+    PRINT("Manager: saved a recovery checkpoint\n");
+}
+
+void NVManager::waitForRecovery() {
+    if (scheduler == NULL || recoveryReported) return;
+    struct timespec t2 = scheduler->wait();
+    lock();
+    if (!recoveryReported) {
+        recoveryReported = true;
+        PRINT("Manager: finished recovering persistent objects!\n");
+        PRINT("Manager: total aborted transactions = %zu\n",
+                RecoveryContext::getInstance().abortedTransactions());
+        uint64_t recoveryTime = (t2.tv_sec - recoveryStart.tv_sec) * 1E9;
+        recoveryTime += (t2.tv_nsec - recoveryStart.tv_nsec);
+        fprintf(stdout, "Recovery Time (ms)\t%.2f\n",
+                (double)recoveryTime / 1E6);
+        // Small logs are dominated by restoring the snapshot
+        if (scheduler->backlog() >= MinMeasuredBacklog && recoveryTime > 0) {
+            measuredThroughput = scheduler->backlog() * 1E9 / recoveryTime;
+        }
+    }
+    unlock();
+}
+
+void NVManager::saveAccessHints() {
+    for (uint64_t i = 0; i < catalog->catalog->object_count; i++) {
+        CatalogEntry *entry = &catalog->catalog->objects[i];
+        PersistentObject *object = findObject(entry->uuid);
+        if (object == NULL) continue;
+        catalog->getHint(entry)->accesses = object->accesses;
+    }
+    catalog->persistHints();
 }
 
 NVManager::~NVManager() {
+    if (scheduler != NULL) { // lazy recovery
+        waitForRecovery();
+        RecoveryContext::getInstance().setScheduler(NULL);
+        delete scheduler;
+    }
+#ifdef LAZY_RECOVERY
+    saveAccessHints();
+#endif
+
+    for (auto it = restores.begin(); it != restores.end(); ++it) {
+        delete it->second;
+    }
+    restores.clear();
+    delete snapshot; // waits for the heap to be paged in
+
+    // The heap image is only used after a clean shutdown (HEAP_FILE)
+    if (!objects.empty()) {
+        Snapshot image(PMEM_PATH, false);
+        image.saveImage(this);
+    }
+
     PRINT("Manager: updating catalog flags before terminating.\n");
     uint64_t cflags = catalog->getFlags();
     cflags = cflags | CatalogFlagCleanShutdown;
     catalog->setFlags(cflags);
-
     delete catalog;
     pthread_mutex_destroy(&_lock);
     pthread_mutex_destroy(&_ckptLock);
@@ -110,13 +216,15 @@ NVManager::~NVManager() {
 }
 
 PersistentObject *NVManager::findRecovered(uuid_t uuid) {
-    char uuid_str[64];
-    uuid_unparse(uuid, uuid_str);
-    auto it = objects.find(uuid_str);
-    if (it == objects.end()) return NULL;
-    PersistentObject *object = it->second;
+    PersistentObject **it = objects.find(uuid);
+    if (it == NULL) return NULL;
+    PersistentObject *object = *it;
+    restoreObject(object);
     assert(!object->assigned);
     object->assigned = true;
+    if (object->isRecovering()) { // lazy recovery
+        scheduler->expedite(object);
+    }
     return object;
 }
 
@@ -126,9 +234,7 @@ void NVManager::createNew(uint64_t type_id, PersistentObject *object) {
         catalog->addConstructorArgs(entry, object->const_args,
                 object->const_args_size);
     }
-    char uuid_str[64];
-    uuid_unparse(object->getUUID(), uuid_str);
-    objects.insert(pair<string, PersistentObject *>(uuid_str, object));
+    objects.insert(object->getUUID(), object);
     object->assigned = true;
 }
 
@@ -138,239 +244,103 @@ void NVManager::destroy(PersistentObject *object) {
 }
 
 void NVManager::recoverObject(const char *uuid_str, CatalogEntry *object) {
-    if (objects.find(uuid_str) != objects.end()) { // Recover from snapshot
+    (void)uuid_str; // only printed, objects are found by their binary uuid
+    PersistentObject *pobj = NULL;
+    PersistentObject **restored = objects.find(object->uuid);
+    if (restored != NULL && snapshot != NULL &&
+            snapshot->pendingObjects() > 0) {
+        // Restored on demand, the object is not accessed before restoreObject
+        PRINT("Adding object to restore queue, uuid = %s\n", uuid_str);
+        RestoreState *restore = new RestoreState();
+        restore->entry = object;
+        restore->log = Savitar_log_open(object->uuid);
+        restore->status = RestorePending;
+        restore->task = scheduler->add(*restored, object->uuid, restore->log,
+                catalog->getHint(object)->accesses);
+        restores[*restored] = restore;
+        pendingRestores++;
+        return;
+    }
+
+    if (restored != NULL) { // Recover from snapshot
         PRINT("Recovering object from snapshot, uuid = %s\n", uuid_str);
-        PersistentObject *pobj = objects.find(uuid_str)->second;
+        pobj = *restored;
         assert(pobj != NULL);
-        PersistentFactory::vTableUpdate(object->type, pobj);
-        PRINT("Updated vTable to %p for persistent object, uuid = %s\n",
-                (void*)(((uintptr_t*)pobj)[0]), uuid_str);
-        pobj->recovering = true;
-        pobj->log = Savitar_log_open(pobj->uuid);
-        pobj->alloc = GlobalAlloc::getInstance()->findAllocator(pobj->uuid);
-        pobj->assigned = false;
+        prepareRestored(pobj, object, Savitar_log_open(pobj->uuid));
     }
     else {
         PRINT("Adding object to recovery queue, uuid = %s\n", uuid_str);
-        PersistentObject *pobj = PersistentFactory::create(this,
-                object->type, object);
+        pobj = PersistentFactory::create(this, object->type, object);
         assert(pobj != NULL);
         pobj->recovering = true;
         pobj->last_played_commit_id = 0;
-        objects.insert(pair<string, PersistentObject *>(uuid_str, pobj));
+        pobj->accesses = 0;
+        objects.insert(object->uuid, pobj);
     }
+    scheduler->add(pobj, catalog->getHint(object)->accesses);
 }
 
-void *NVManager::recoveryWorker(void *arg) {
-    PersistentObject *object = (PersistentObject *)arg;
-    object->Recover();
-    object->recovering = false;
+// Fixes the volatile state of an object restored from the snapshot
+void NVManager::prepareRestored(PersistentObject *pobj, CatalogEntry *object,
+        SavitarLog *log) {
+    PersistentFactory::vTableUpdate(object->type, pobj);
+    PRINT("Updated vTable to %p for persistent object, uuid = %s\n",
+            (void*)(((uintptr_t*)pobj)[0]), pobj->uuid_str);
+    pobj->recovering = true;
+    pobj->log = log;
+    pobj->alloc = GlobalAlloc::getInstance()->findAllocator(pobj->uuid);
+    pobj->assigned = false;
+    pobj->replay = NULL;
+    pobj->task = NULL;
+    pobj->accesses = 0;
+    pobj->nested_caller = NULL;
 }
 
-PersistentObject *NVManager::findObject(string uuid_str) {
-    auto it = objects.find(uuid_str);
-    if (it == objects.end()) {
-        PRINT("Unable to find object with uuid = %s\n", uuid_str.c_str());
-        PRINT("Total objects present: %zu\n", objects.size());
-        return NULL;
+void NVManager::restorePending(PersistentObject *object) {
+    auto it = restores.find(object);
+    if (it == restores.end()) return;
+    RestoreState *restore = it->second;
+    if (restore->status == RestoreDone) return;
+
+    if (!__sync_bool_compare_and_swap(&restore->status, RestorePending,
+                RestoreRunning)) {
+        // Another thread is restoring the object
+        while (restore->status != RestoreDone) sched_yield();
+        return;
     }
-    return it->second;
-}
-
-const char *NVManager::getArgumentPointer(CatalogEntry *entry) {
-    return (const char *)catalog->catalog + entry->args_offset;
-}
 
-typedef struct AbortChainNode {
-    PersistentObject *object;
-    uint64_t log_offset;
-    uint64_t commit_id;
-    struct AbortChainNode *next;
-} AbortChainNode;
-
-typedef struct {
-    pthread_t thread;
-    NVManager *instance;
-    PersistentObject *object;
-    uint64_t max_committed_tx;
-    list<AbortChainNode *> *abort_chains;
-} AbortChainBuilderArg;
-
-void *NVManager::buildAbortChains(void *arg) {
-    NVManager *me = ((AbortChainBuilderArg *)arg)->instance;
-    PersistentObject *object = ((AbortChainBuilderArg *)arg)->object;
-    SavitarLog *log = object->log;
-    priority_queue<uint64_t, vector<uint64_t>, greater<uint64_t> > min_heap;
-
-
-    uint64_t max_committed_tx = 0;
-    uint64_t offset = log->head;
-    const char *data = (const char *)object->log;
-    while (offset < log->tail) {
-        assert(offset % CACHE_LINE_WIDTH == 0);
-        uint64_t commit_id = *((uint64_t *)&data[offset]);
-        offset += sizeof(uint64_t);
-        uint64_t magic = *((uint64_t *)&data[offset]);
-        offset += sizeof (uint64_t);
-        uint64_t method_tag = *((uint64_t *)&data[offset]);
-        offset += sizeof(uint64_t);
-
-        if (magic != REDO_LOG_MAGIC) { // Corrupted log entry
-            offset += CACHE_LINE_WIDTH - 3 * sizeof(uint64_t);
-            continue;
-        }
+    snapshot->restoreObject(object);
+    prepareRestored(object, restore->entry, restore->log);
+    object->task = restore->task;
+    __sync_synchronize();
+    restore->status = RestoreDone;
 
-        if (commit_id != 0) {
-            min_heap.push(commit_id);
-            while (min_heap.top() == max_committed_tx + 1) {
-                max_committed_tx++;
-                min_heap.pop();
-            }
-        }
-
-        if ((method_tag & NESTED_TX_TAG) == 0) {
-            assert(method_tag != 0);
-            offset += object->Play(method_tag,
-                    (uint64_t *)&data[offset], true); // dry run
-            offset += CACHE_LINE_WIDTH - offset % CACHE_LINE_WIDTH;
-            continue;
-        }
-
-        /*
-         * Nested transaction
-         * [1] commit_id == 0: no need to follow the chain
-         * [2] commit_id != 0: follow the chain and check if aborted
-         */
-        if (commit_id == 0) {
-            offset += CACHE_LINE_WIDTH - 3 * sizeof(uint64_t);
-            continue;
-        }
-
-        typedef struct uuid_ptr { uuid_t uuid; } uuid_ptr;
-
-        // Creating abort chain
-        AbortChainNode *head = (AbortChainNode *)malloc(sizeof(AbortChainNode));
-        head->object = object;
-        head->commit_id = commit_id;
-        head->log_offset = offset - 3 * sizeof(uint64_t);
-        head->next = NULL;
-
-        char uuid_str[37];
-        uuid_unparse(((uuid_ptr *)&data[offset])->uuid, uuid_str);
-        auto parent_it = me->objects.find(uuid_str);
-        assert(parent_it != me->objects.end());
-        PersistentObject *parent = parent_it->second;
-        uint64_t parent_offset = method_tag & (~NESTED_TX_TAG);
-
-        /*
-         * Note: we always know the log entry for parent transactions are persistent
-         * before the child transactions, so it is safe to assume parent logs are
-         * not corrupted (i.e., partially persisted).
-         */
-        while (parent != NULL) {
-
-            SavitarLog *parent_log = parent->log;
-            uint64_t *parent_ptr = (uint64_t *)((char *)parent_log + parent_offset);
-            uint64_t parent_commit_id = parent_ptr[0];
-            uint64_t parent_magic = parent_ptr[1];
-            if (parent_magic != REDO_LOG_MAGIC) {
-                PRINT("Invalid magic: (uuid, commit id, offset) = (%s, %zu, %zu)\n",
-                        parent->uuid_str, parent_commit_id, parent_offset);
-            }
-            assert(parent_magic == REDO_LOG_MAGIC);
-            uint64_t parent_method_tag = parent_ptr[2];
-
-            // Adding parent to the chain
-            AbortChainNode *node = (AbortChainNode *)malloc(sizeof(AbortChainNode));
-            node->next = head;
-            node->object = parent;
-            node->log_offset = parent_offset;
-            node->commit_id = parent_commit_id;
-            head = node;
-
-            if ((parent_method_tag & NESTED_TX_TAG) == 0) { // outer-most transaction
-                if (parent_commit_id == 0) { // aborted transaction
-                    ((AbortChainBuilderArg *)arg)->abort_chains->push_back(head);
-                }
-                else {
-                    // Chain clean-up
-                    while (head != NULL) {
-                        AbortChainNode *t = head;
-                        head = head->next;
-                        free(t);
-                    }
-                }
-                parent = NULL;
-            }
-            else {
-                uuid_unparse(((uuid_ptr *)((char *)parent_ptr + 24))->uuid, uuid_str);
-                auto parent_it = me->objects.find(uuid_str);
-                assert(parent_it != me->objects.end());
-                parent = parent_it->second;
-                parent_offset = parent_method_tag & (~NESTED_TX_TAG);
-            }
-        }
-
-        offset += CACHE_LINE_WIDTH - 3 * sizeof(uint64_t);
+    if (__sync_sub_and_fetch(&pendingRestores, 1) == 0) {
+        PRINT("Manager: finished restoring persistent objects\n");
+        delete snapshot;
+        snapshot = NULL;
     }
-
-    ((AbortChainBuilderArg *)arg)->max_committed_tx = max_committed_tx;
-    return NULL;
 }
 
-int NVManager::emulateRecoveryAndFixRedoLogs() {
-
-    size_t counter = 0;
-    const size_t obj_count = objects.size();
-    AbortChainBuilderArg *builders = (AbortChainBuilderArg *)malloc(obj_count *
-            sizeof(AbortChainBuilderArg));
-
-    PRINT("Manager: building abort chains for %zu objects.\n", obj_count);
-    for (auto it = objects.begin(); it != objects.end(); ++it) {
-        assert(counter < obj_count);
-        builders[counter].instance = this;
-        builders[counter].object = it->second;
-        builders[counter].abort_chains = new list<AbortChainNode *>();
-        pthread_create(&builders[counter].thread, NULL, buildAbortChains,
-                &builders[counter]);
-        counter++;
-    }
-
-    // Wait for recovery threads to return
-    for (size_t i = 0; i < obj_count; i++) {
-        pthread_join(builders[i].thread, NULL);
-        AbortChainNode *chain = NULL;
-        PRINT("Manager: processing abort chain for %s (max commit = %zu)\n",
-                builders[i].object->uuid_str, builders[i].max_committed_tx);
-        if (!builders[i].abort_chains->empty()) {
-            PRINT("Aborted nested transactions are not yet supported!");
-        }
-        assert(builders[i].abort_chains->empty());
-        /*
-        while (!builders[i].abort_chains->empty()) {
-            PRINT("\t> Found abort chain:");
-            chain = builders[i].abort_chains->front();
-            while (chain != NULL) {
-                // Process the abort node
-                PRINT("\t\t> %s : (%zu, %zu)\n", chain->object->uuid_str,
-                        chain->log_offset, chain->commit_id);
-                // TODO process chain
-
-                // Cleanup
-                AbortChainNode *t = chain;
-                chain = chain->next;
-                free(t);
-            }
-            builders[i].abort_chains->pop_front();
-        }
-        */
+PersistentObject *NVManager::findObject(const uuid_t uuid) {
+    PersistentObject **it = objects.find(uuid);
+    if (it == NULL) {
+#ifdef DEBUG
+        char uuid_str[64];
+        uuid_unparse(uuid, uuid_str);
+        PRINT("Unable to find object with uuid = %s\n", uuid_str);
+        PRINT("Total objects present: %zu\n", objects.size());
+#endif
+        return NULL;
     }
-    PRINT("Manager: finished building abort chains.\n");
+    restoreObject(*it);
+    return *it;
+}
 
-    // TODO
-    free(builders);
-    return 0;
+const char *NVManager::getArgumentPointer(CatalogEntry *entry) {
+    return (const char *)catalog->catalog + entry->args_offset;
 }
+
 void NVManager::registerThread(pthread_t thread, ThreadConfig *cfg) {
     program_threads[thread] = cfg;
 }
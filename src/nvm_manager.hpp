@@ -1,6 +1,7 @@
 #pragma once
 #include <map>
 #include <pthread.h>
+#include "uuid_map.hpp"
 
 using namespace std;
 class NVCatalog;
@@ -8,12 +9,30 @@ class PersistentObject;
 struct CatalogEntry;
 struct ThreadConfig;
 class Snapshot;
+class RecoveryScheduler;
+struct RecoveryTask;
+typedef struct RedoLog SavitarLog;
+
+// Objects restored from a snapshot on demand (see NVManager::restoreObject)
+typedef enum {
+    RestorePending = 0,
+    RestoreRunning,
+    RestoreDone
+} RestoreStatus;
+
+typedef struct {
+    struct CatalogEntry *entry;
+    SavitarLog *log;
+    struct RecoveryTask *task;
+    volatile uint32_t status;
+} RestoreState;
 
 /*
  * Non-Volatile Memory Manager
  * * Handles creation, recovery and destruction of persistent objects.
  * * Maintains a list of existing persistent objects (i.e., catalog).
- * * Spawns recovery threads on startup to recover all persistent objects.
+ * * Recovers all persistent objects on startup (see RecoveryScheduler),
+ *   either before returning or in the background (LAZY_RECOVERY).
  */
 class NVManager {
     public:
@@ -35,14 +54,14 @@ class NVManager {
          * Find: tries to find an already recovered object
          * Create: saves the newly created object in the catalog
          */
-        PersistentObject *findRecovered(uuid_t);
+        PersistentObject *findRecovered(uuid_t); // blocks until recovered
         void createNew(uint64_t, PersistentObject *);
 
         // Handles 'delete' for persistent objects
         void destroy(PersistentObject *);
 
         // Find pointer to persistent objects using its unique identifier
-        PersistentObject *findObject(string);
+        PersistentObject *findObject(const uuid_t);
 
         const char *getArgumentPointer(CatalogEntry *);
 
@@ -52,29 +71,53 @@ class NVManager {
         void registerThread(pthread_t, ThreadConfig *);
         void unregisterThread(pthread_t);
 
+        // Blocks until all persistent objects are recovered
+        void waitForRecovery();
+
+        // Bytes per second replayed by the last recovery (0 = not measured)
+        uint64_t replayThroughput() const { return measuredThroughput; }
+
+        /*
+         * Makes sure the memory of the object is restored from the snapshot
+         * Must be called before accessing an object during recovery, the
+         * calling thread restores the object if no other thread is doing so.
+         */
+        void restoreObject(PersistentObject *object) {
+            if (pendingRestores != 0) restorePending(object);
+        }
+
     private:
         pthread_mutex_t _lock;
         pthread_mutex_t _ckptLock;
         pthread_cond_t _ckptCondition;
-        map<string, PersistentObject *> objects;
+        UUIDMap<PersistentObject *> objects; // lock-free lookups
         NVCatalog *catalog = NULL;
         map<pthread_t, ThreadConfig *> program_threads;
 
         /*
          * Recovery methods
          * recoverObject: Catalog calls this method to add objects to recovery queue
-         * recoveryWorker: for each object in the recovery queue, a new thread is
-         * created, which calls this method to run the recovery code for its
-         * argument object.
+         * Objects in the recovery queue are then recovered by RecoveryScheduler.
          */
         void recoverObject(const char *, struct CatalogEntry *);
-        static void *recoveryWorker(void *);
+        void prepareRestored(PersistentObject *, struct CatalogEntry *,
+                SavitarLog *);
+        void restorePending(PersistentObject *);
+        void recoverWithCheckpoints();
+        void checkpointRecovery();
+        RecoveryScheduler *scheduler = NULL;
+        Snapshot *snapshot = NULL; // while objects (or pages) are restored on demand
+        map<PersistentObject *, RestoreState *> restores;
+        volatile size_t pendingRestores = 0;
+        struct timespec recoveryStart;
+        bool recoveryReported = false;
+        uint64_t measuredThroughput = 0;
 
-        /*
-         * Method to fix persistent log dependencies after an unclean shutdown
-         */
-        static void *buildAbortChains(void *);
-        int emulateRecoveryAndFixRedoLogs();
+        // Persists access counters of objects as recovery hints
+        void saveAccessHints();
+
+        static const uint64_t MinMeasuredBacklog = (uint64_t)64 << 20;
 
         friend class Snapshot;
+        friend class SnapshotScheduler;
 };
@@ -5,10 +5,12 @@
 #include <assert.h>
 #include <string>
 #include <map>
+#include "uuid_map.hpp"
 
 using namespace std;
 
 class NVManager;
+class RecoveryScheduler;
 
 class RecoveryContext {
     public:
@@ -30,6 +32,21 @@ class RecoveryContext {
         void setManager(NVManager *m) { manager = m; }
         NVManager *getManager() { return manager; }
 
+        void setScheduler(RecoveryScheduler *s) { scheduler = s; }
+        RecoveryScheduler *getScheduler() { return scheduler; }
+
+        /*
+         * Support for unclean shutdowns
+         * Recover() checks nested transactions for aborted outer-most
+         * transactions only after an unclean shutdown.
+         */
+        void setUncleanShutdown(bool unclean) { uncleanShutdown = unclean; }
+        bool isUncleanShutdown() { return uncleanShutdown; }
+        void countAbortedTransaction() {
+            __sync_fetch_and_add(&aborted, 1);
+        }
+        uint64_t abortedTransactions() { return aborted; }
+
         /*
          * Support for recovering nested transactions
          * Pop returns the caller object (NULL means non-nested Tx)
@@ -55,19 +72,22 @@ class RecoveryContext {
             return parent;
         }
 
-        void pushLogHeadOffset(string id, uint64_t head) {
-            logHeadOffsets.insert(pair<string, uint64_t>(id, head));
+        void pushLogHeadOffset(const uuid_t id, uint64_t head) {
+            logHeadOffsets.insert(id, head);
         }
 
-        uint64_t queryLogHeadOffset(string id) {
-            auto it = logHeadOffsets.find(id);
-            if (it == logHeadOffsets.end()) return 0;
-            return it->second;
+        uint64_t queryLogHeadOffset(const uuid_t id) {
+            uint64_t *head = logHeadOffsets.find(id);
+            if (head == NULL) return 0;
+            return *head;
         }
 
     private:
         NVManager *manager = NULL;
+        RecoveryScheduler *scheduler = NULL;
+        bool uncleanShutdown = false;
+        uint64_t aborted = 0;
         map<pthread_t, PersistentObject *> parentObjects;
         pthread_mutex_t lock;
-        map<string, uint64_t> logHeadOffsets;
+        UUIDMap<uint64_t> logHeadOffsets;
 };
@@ -0,0 +1,335 @@
+#include <assert.h>
+#include <sched.h>
+#include <errno.h>
+#include <thread>
+#include "recovery_scheduler.hpp"
+#include "recovery_context.hpp"
+#include "nv_object.hpp"
+#include "savitar.hpp"
+#include "nvm_manager.hpp"
+
+// Number of nested Recover() calls running on the thread
+static __thread int replaying = 0;
+
+bool RecoveryScheduler::isReplaying() {
+    return replaying > 0;
+}
+
+size_t RecoveryScheduler::defaultThreads() {
+    size_t threads = RECOVERY_THREADS;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    return threads;
+}
+
+RecoveryScheduler::RecoveryScheduler(size_t threads) {
+    if (threads == 0) threads = defaultThreads();
+    this->threads = threads;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&condition, NULL);
+    pthread_cond_init(&changed, NULL);
+}
+
+RecoveryScheduler::~RecoveryScheduler() {
+    wait();
+    if (pool != NULL) {
+        for (size_t i = 0; i < workers; i++) {
+            pthread_join(pool[i], NULL);
+        }
+        free(pool);
+    }
+    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+        (*it)->object->task = NULL;
+        delete *it;
+    }
+    tasks.clear();
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&condition);
+    pthread_cond_destroy(&changed);
+}
+
+void RecoveryScheduler::add(PersistentObject *object, uint64_t accesses) {
+    object->task = add(object, object->uuid, object->log, accesses);
+}
+
+RecoveryTask *RecoveryScheduler::add(PersistentObject *object,
+        const uuid_t uuid, SavitarLog *log, uint64_t accesses) {
+    uint64_t head = RecoveryContext::getInstance().queryLogHeadOffset(uuid);
+    if (head == 0) head = log->head;
+
+    RecoveryTask *task = new RecoveryTask();
+    task->object = object;
+    task->backlog = log->tail - head;
+    task->accesses = accesses;
+    task->expedited = false;
+    task->preempted = false;
+    task->dependants = 0;
+    task->waiting = 0;
+    task->state = TaskReady;
+
+    tasks.push_back(task);
+    ready.insert(task);
+    remaining++;
+    totalBacklog += task->backlog;
+    return task;
+}
+
+void RecoveryScheduler::run() {
+    start();
+    wait();
+}
+
+void RecoveryScheduler::start() {
+    assert(pool == NULL);
+    workers = std::min(threads, tasks.size());
+    PRINT("Scheduler: recovering %zu objects using %zu threads\n",
+            tasks.size(), workers);
+
+    clock_gettime(CLOCK_REALTIME, &finished);
+    pool = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+    for (size_t i = 0; i < workers; i++) {
+        pthread_create(&pool[i], NULL, worker, this);
+    }
+}
+
+struct timespec RecoveryScheduler::wait() {
+    pthread_mutex_lock(&lock);
+    while (remaining > 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+bool RecoveryScheduler::waitUntil(const struct timespec &deadline) {
+    pthread_mutex_lock(&lock);
+    while (remaining > 0) {
+        if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = remaining == 0;
+    pthread_mutex_unlock(&lock);
+    return done;
+}
+
+void RecoveryScheduler::pause() {
+    pthread_mutex_lock(&lock);
+    pausing = true;
+    while (running > 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void RecoveryScheduler::resume() {
+    pthread_mutex_lock(&lock);
+    pausing = false;
+    pthread_cond_broadcast(&condition);
+    pthread_mutex_unlock(&lock);
+}
+
+bool RecoveryScheduler::preempt(RecoveryTask *task) {
+    // Nested Recover() calls finish with the caller
+    if (!pausing || replaying > 1) return false;
+    task->preempted = true;
+    return true;
+}
+
+bool RecoveryScheduler::claimParser() {
+    pthread_mutex_lock(&lock);
+    bool idle = running + parsers < threads;
+    if (idle) parsers++;
+    pthread_mutex_unlock(&lock);
+    return idle;
+}
+
+void RecoveryScheduler::releaseParser() {
+    pthread_mutex_lock(&lock);
+    parsers--;
+    pthread_cond_broadcast(&condition);
+    pthread_mutex_unlock(&lock);
+}
+
+void *RecoveryScheduler::worker(void *arg) {
+    RecoveryScheduler *me = (RecoveryScheduler *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&me->lock);
+        RecoveryTask *task = NULL;
+        while (me->remaining > 0) {
+            // Parse threads take the place of workers (see claimParser)
+            if (!me->pausing && me->running + me->parsers < me->threads &&
+                    (task = me->claim(NULL)) != NULL) break;
+            pthread_cond_wait(&me->condition, &me->lock);
+        }
+        pthread_mutex_unlock(&me->lock);
+        if (task == NULL) break; // all objects are recovered
+        me->execute(task);
+    }
+
+    return NULL;
+}
+
+/*
+ * Picks the next task to run (must hold the lock)
+ * If a task is provided, follows its chain of parked parents and returns
+ * the first one that is ready to run.
+ */
+RecoveryTask *RecoveryScheduler::claim(RecoveryTask *preferred) {
+    RecoveryTask *task = NULL;
+    if (preferred != NULL) {
+        while (preferred != NULL && preferred->state == TaskParked) {
+            PersistentObject *parent = preferred->object->wait_parent;
+            preferred = parent != NULL ? parent->task : NULL;
+        }
+        if (preferred == NULL || preferred->state != TaskReady) return NULL;
+        task = preferred;
+    }
+    else {
+        if (ready.empty()) return NULL;
+        task = *ready.begin();
+    }
+
+    ready.erase(task);
+    task->state = TaskRunning;
+    running++;
+    return task;
+}
+
+void RecoveryScheduler::execute(RecoveryTask *task) {
+    PersistentObject *object = task->object;
+    // Objects are restored from the snapshot before their first replay
+    RecoveryContext::getInstance().getManager()->restoreObject(object);
+    replaying++;
+    bool done = object->Recover();
+    replaying--;
+
+    pthread_mutex_lock(&lock);
+    running--;
+    if (parsers > 0) pthread_cond_broadcast(&condition); // budget is back
+    if (done) {
+        task->state = TaskDone;
+        object->recovering = false;
+        if (--remaining == 0) {
+            clock_gettime(CLOCK_REALTIME, &finished);
+            pthread_cond_broadcast(&condition);
+        }
+    }
+    else if (task->preempted) { // resumed after the checkpoint
+        task->preempted = false;
+        task->state = TaskReady;
+        ready.insert(task);
+    }
+    else {
+        park(task);
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+// Must hold the lock
+void RecoveryScheduler::park(RecoveryTask *task) {
+    PersistentObject *object = task->object;
+    PersistentObject *parent = object->wait_parent;
+    assert(parent != NULL && parent->task != NULL);
+    RecoveryTask *parentTask = parent->task;
+
+    /*
+     * Publish the waiter before re-checking the parent, the parent does the
+     * opposite (updates its commit id before checking for waiters)
+     */
+    parentTask->waiting++;
+    __sync_synchronize();
+    if (parent->last_played_commit_id >= object->wait_parent_commit_id) {
+        parentTask->waiting--;
+        makeReady(task);
+        return;
+    }
+    assert(parentTask->state != TaskDone);
+
+    PRINT("Scheduler: parking %s (waiting for %s to play commit %zu)\n",
+            object->uuid_str, parent->uuid_str, object->wait_parent_commit_id);
+    task->state = TaskParked;
+    parentTask->children.push_back(task);
+    if (task->expedited) expedite(parentTask);
+
+    // Move the parent ahead of other objects
+    if (parentTask->state == TaskReady) ready.erase(parentTask);
+    parentTask->dependants++;
+    if (parentTask->state == TaskReady) ready.insert(parentTask);
+}
+
+// Must hold the lock
+void RecoveryScheduler::makeReady(RecoveryTask *task) {
+    task->state = TaskReady;
+    ready.insert(task);
+    pthread_cond_signal(&condition);
+    pthread_cond_broadcast(&changed);
+}
+
+void RecoveryScheduler::progress(RecoveryTask *parentTask) {
+    PersistentObject *parent = parentTask->object;
+    pthread_mutex_lock(&lock);
+    auto it = parentTask->children.begin();
+    while (it != parentTask->children.end()) {
+        RecoveryTask *child = *it;
+        if (parent->last_played_commit_id <
+                child->object->wait_parent_commit_id) {
+            ++it;
+            continue;
+        }
+        it = parentTask->children.erase(it);
+        parentTask->dependants--;
+        parentTask->waiting--;
+        makeReady(child);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void RecoveryScheduler::awaitChild(PersistentObject *child,
+        PersistentObject *parent) {
+    while (!child->isWaitingForParent(parent)) {
+        pthread_mutex_lock(&lock);
+        RecoveryTask *task = claim(child->task);
+        pthread_mutex_unlock(&lock);
+
+        if (task != NULL) execute(task);
+        else sched_yield(); // child is running on another thread
+    }
+}
+
+// Must hold the lock
+void RecoveryScheduler::expedite(RecoveryTask *task) {
+    if (task->expedited) return;
+    if (task->state == TaskReady) ready.erase(task);
+    task->expedited = true;
+    if (task->state == TaskReady) ready.insert(task);
+
+    // The object cannot make progress before its parent
+    if (task->state == TaskParked) {
+        expedite(task->object->wait_parent->task);
+    }
+}
+
+void RecoveryScheduler::expedite(PersistentObject *object) {
+    pthread_mutex_lock(&lock);
+    RecoveryTask *task = object->task;
+    assert(task != NULL);
+    if (task->state != TaskDone) {
+        PRINT("Scheduler: expediting recovery of %s\n", object->uuid_str);
+        expedite(task);
+    }
+    while (task->state != TaskDone) {
+        RecoveryTask *next = claim(task);
+        if (next != NULL) {
+            pthread_mutex_unlock(&lock);
+            execute(next);
+            pthread_mutex_lock(&lock);
+        }
+        else {
+            pthread_cond_wait(&changed, &lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
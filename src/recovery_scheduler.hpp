@@ -0,0 +1,168 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <uuid/uuid.h>
+#include <time.h>
+#include <set>
+#include <vector>
+
+class PersistentObject;
+typedef struct RedoLog SavitarLog;
+
+typedef enum {
+    TaskReady = 0,
+    TaskRunning,
+    TaskParked, // waiting for its parent to replay a nested transaction
+    TaskDone
+} RecoveryTaskState;
+
+/*
+ * Recovery state of a single persistent object
+ * backlog: bytes of log to replay (estimated work)
+ * accesses: number of transactions on the object during the last run
+ * dependants: number of children parked on this object
+ * waiting: lock-free copy of dependants, polled by the object itself after
+ * playing each log entry
+ * expedited: a live thread is blocked on this object (lazy recovery)
+ * preempted: the object stopped replaying for a recovery checkpoint
+ */
+typedef struct RecoveryTask {
+    PersistentObject *object;
+    uint64_t backlog;
+    uint64_t accesses;
+    uint32_t dependants;
+    volatile uint32_t waiting;
+    bool expedited;
+    bool preempted; // yielded to a recovery checkpoint
+    RecoveryTaskState state;
+    std::vector<struct RecoveryTask *> children;
+} RecoveryTask;
+
+struct RecoveryTaskOrder {
+    bool operator() (const RecoveryTask *a, const RecoveryTask *b) const {
+        // Objects needed by live threads first
+        if (a->expedited != b->expedited) return a->expedited;
+        // Parents on the critical path, then hot objects, then the longest replay
+        if (a->dependants != b->dependants) return a->dependants > b->dependants;
+        if (a->accesses != b->accesses) return a->accesses > b->accesses;
+        if (a->backlog != b->backlog) return a->backlog > b->backlog;
+        return a < b;
+    }
+};
+
+/*
+ * Bounded thread pool for recovering persistent objects
+ * * Runs Recover() for every object on a fixed number of worker threads,
+ *   regardless of the number of objects in the catalog.
+ * * An object that reaches a nested transaction before its parent has
+ *   replayed the corresponding commit is parked (no busy-waiting), and is
+ *   put back into the ready queue once the parent catches up.
+ * * Parents with parked children are scheduled first, followed by the most
+ *   frequently accessed objects and objects with the largest log backlog.
+ * * Recovery can run in the background (start), in which case live threads
+ *   block only on the objects they access (expedite).
+ */
+class RecoveryScheduler {
+public:
+    // threads = 0: use RECOVERY_THREADS (or one thread per available core)
+    RecoveryScheduler(size_t threads = 0);
+    ~RecoveryScheduler();
+
+    // RECOVERY_THREADS, or the number of available cores if not set
+    static size_t defaultThreads();
+
+    void add(PersistentObject *, uint64_t accesses = 0);
+
+    /*
+     * Same as above, for objects restored from a snapshot on demand (see
+     * NVManager::restoreObject). The object is not accessed before its
+     * first execution, so the caller links the returned task to the object.
+     */
+    RecoveryTask *add(PersistentObject *, const uuid_t, SavitarLog *,
+            uint64_t accesses);
+
+    // Recovers all added objects (blocking)
+    void run();
+
+    // Bytes of log to replay (sum of backlogs of added objects)
+    uint64_t backlog() const { return totalBacklog; }
+
+    // Starts recovering added objects in the background
+    void start();
+
+    // Waits for background recovery to finish, returns the finish time
+    struct timespec wait();
+
+    // Same as above, returns false if recovery is not finished by deadline
+    bool waitUntil(const struct timespec &deadline);
+
+    /*
+     * Stops replaying logs (for recovery checkpoints)
+     * Blocks until every object is between two log entries: running
+     * objects are preempted (see preempt) and put back in the ready queue.
+     */
+    void pause();
+    void resume();
+
+    /*
+     * Called by an object after replaying a log entry, returns true if the
+     * object has to stop (return from Recover) because of a pause
+     */
+    bool preempt(RecoveryTask *);
+
+    /*
+     * Parse threads of large logs (see RecoveryPipeline) count against the
+     * thread budget: returns false if every thread runs an object or a
+     * parse thread. Workers do not claim objects while the budget is used.
+     */
+    bool claimParser();
+    void releaseParser();
+
+    /*
+     * Called by live threads accessing an object that is still being
+     * recovered. Blocks until the object is recovered, moving it (and
+     * the objects it waits for) to the front of the queue. The calling
+     * thread helps recovering the object instead of sleeping.
+     */
+    void expedite(PersistentObject *);
+
+    // Is the calling thread replaying a log (i.e., inside Recover())?
+    static bool isReplaying();
+
+    /*
+     * Called by a parent object after replaying a log entry, wakes up
+     * children parked on that entry
+     */
+    void progress(RecoveryTask *);
+
+    /*
+     * Called by a parent object (while replaying a nested transaction) to
+     * wait for its child to reach the same transaction. The calling thread
+     * helps recovering the child (or whatever the child is waiting for)
+     * instead of spinning.
+     */
+    void awaitChild(PersistentObject *, PersistentObject *);
+
+private:
+    static void *worker(void *);
+    RecoveryTask *claim(RecoveryTask *);
+    void execute(RecoveryTask *);
+    void park(RecoveryTask *);
+    void makeReady(RecoveryTask *);
+    void expedite(RecoveryTask *);
+
+    pthread_mutex_t lock;
+    pthread_cond_t condition; // a task is ready (or everything is done)
+    pthread_cond_t changed; // a task is done, parked or ready
+    size_t threads;
+    size_t remaining = 0;
+    uint64_t totalBacklog = 0;
+    size_t running = 0; // claimed tasks
+    size_t parsers = 0; // parse threads (see claimParser)
+    volatile bool pausing = false;
+    pthread_t *pool = NULL;
+    size_t workers = 0;
+    struct timespec finished;
+    std::vector<RecoveryTask *> tasks;
+    std::set<RecoveryTask *, RecoveryTaskOrder> ready;
+};
@@ -17,12 +17,69 @@
 #define CATALOG_FILE_NAME           "savitar.cat"
 #define CATALOG_FILE_SIZE           ((size_t)8 << 20) // 8 MB
 #define CATALOG_HEADER_SIZE         ((size_t)2 << 20) // 2 MB
+#define CATALOG_HINTS_FILE_NAME     "savitar.hint"
 #define PMEM_PATH                   "/home/Abhinav/data"
 #ifndef LOG_SIZE
 #define LOG_SIZE                    ((off_t)1 << 30) // 1 GB
 #endif
+#ifndef LOG_INDEX_STRIDE
+#define LOG_INDEX_STRIDE            ((uint64_t)64 << 10) // 64 KB
+#endif
+#ifndef RECOVERY_THREADS
+#define RECOVERY_THREADS            0 // one per available core
+#endif
+#ifndef RECOVERY_CHECKPOINT_INTERVAL // seconds, 0 = no recovery checkpoints
+#define RECOVERY_CHECKPOINT_INTERVAL 0
+#endif
+#ifndef RECOVERY_PIPELINE_THRESHOLD // logs larger than this use a parse thread
+#define RECOVERY_PIPELINE_THRESHOLD ((uint64_t)64 << 20) // 64 MB
+#endif
+#ifndef SNAPSHOT_THREADS // snapshot copy and restore threads
+#define SNAPSHOT_THREADS            0 // one per available core
+#endif
+#ifndef SNAPSHOT_MAX_DELTAS // incremental snapshots between full ones, 0 = off
+// Tracking deltas keeps the heap write-protected after every snapshot, so the
+// first store to each block faults; benchmark commit latency before raising it
+#define SNAPSHOT_MAX_DELTAS         0
+#endif
+#ifndef SNAPSHOT_MAX_SELECTIVE // selective snapshots between full ones, 0 = off
+#define SNAPSHOT_MAX_SELECTIVE      8 // see SnapshotScheduler::setInterval
+#endif
+#ifndef SNAPSHOT_MERGE_LENGTH // deltas merged in the background, 0 = never
+#define SNAPSHOT_MERGE_LENGTH       4
+#endif
+#ifndef SNAPSHOT_MERGE_BANDWIDTH // bytes per second, 0 = no limit
+#define SNAPSHOT_MERGE_BANDWIDTH    ((uint64_t)1 << 30) // 1 GB/s
+#endif
+#ifndef SNAPSHOT_LATENCY_TARGET // log-append P99 (us), 0 = copies are not throttled
+#define SNAPSHOT_LATENCY_TARGET     0
+#endif
+#ifndef SNAPSHOT_COPY_BANDWIDTH // bytes per second, ceiling of throttled copies
+#define SNAPSHOT_COPY_BANDWIDTH     ((uint64_t)4 << 30) // 4 GB/s
+#endif
+#ifndef SNAPSHOT_RTO // recovery time objective (seconds), 0 = no automatic snapshots
+#define SNAPSHOT_RTO                0
+#endif
+#ifndef SNAPSHOT_MIN_INTERVAL // seconds between automatic snapshots
+#define SNAPSHOT_MIN_INTERVAL       60
+#endif
+#ifndef SNAPSHOT_QUIET_START // hours without automatic snapshots (local time)
+#define SNAPSHOT_QUIET_START        0
+#define SNAPSHOT_QUIET_END          0
+#endif
+#ifndef SNAPSHOT_REPLAY_THROUGHPUT // until measured by a recovery
+#define SNAPSHOT_REPLAY_THROUGHPUT  ((uint64_t)256 << 20) // 256 MB/s
+#endif
+#ifndef SNAPSHOT_RETAIN_COUNT // latest snapshots kept, 0 (and no minutes) = keep all
+// Retention deletes older snapshots and truncates logs after every snapshot
+#define SNAPSHOT_RETAIN_COUNT       0
+#endif
+#ifndef SNAPSHOT_RETAIN_MINUTES // snapshots of the last N minutes are kept too
+#define SNAPSHOT_RETAIN_MINUTES     0
+#endif
 #define NESTED_TX_TAG               0x8000000000000000
 #define REDO_LOG_MAGIC              0x5265646F4C6F6745 // RedoLogE
+#define REDO_LOG_INDEXED            0x496E646578656421 // Indexed!
 
 #ifdef DEBUG
 #define PRINT(format, ...)          fprintf(stdout, format, ## __VA_ARGS__)
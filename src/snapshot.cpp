@@ -4,8 +4,16 @@
 #include "nv_object.hpp"
 #include "thread.hpp"
 #include "recovery_context.hpp"
+#include "snapshot_merger.hpp"
+#include "copy_kernels.hpp"
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
@@ -14,22 +22,73 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <algorithm>
+#include <set>
+#include <mutex>
+#include <sched.h>
 
 #define CAS(a,b,c) __sync_bool_compare_and_swap(a,b,c)
 
-Snapshot *Snapshot::instance = NULL;
+#if defined(SNAPSHOT_FUZZY) && defined(SNAPSHOT_FORK)
+#error "SNAPSHOT_FUZZY and SNAPSHOT_FORK are exclusive"
+#endif
+#if defined(SNAPSHOT_MAP_RESTORE) && defined(UFFD_RESTORE)
+#error "SNAPSHOT_MAP_RESTORE and UFFD_RESTORE are exclusive"
+#endif
+#if defined(SNAPSHOT_MAP_RESTORE) && defined(HEAP_FILE)
+#error "SNAPSHOT_MAP_RESTORE maps the heap privately, not from HEAP_FILE"
+#endif
+#if defined(SNAPSHOT_MAP_RESTORE) && defined(SNAPSHOT_UFFD_WP)
+#error "SNAPSHOT_UFFD_WP cannot write-protect file mappings of the heap"
+#endif
 
-Snapshot::Snapshot(const char *snapshotPath) {
-    assert(Snapshot::instance == NULL);
+Snapshot *Snapshot::instance = NULL;
+volatile uint8_t *Snapshot::dirtyBlocks = NULL;
+volatile uint8_t *Snapshot::spareDirtyBlocks = NULL;
+uint32_t Snapshot::trackedSnapshot = 0;
+volatile bool Snapshot::capturing = false;
+volatile bool Snapshot::crossedCapture = false;
+int Snapshot::wpFd = -1;
+size_t Snapshot::wpBlocks = 0;
+
+// Inactive snapshots only read snapshot files (e.g., merges)
+Snapshot::Snapshot(const char *snapshotPath, bool active) {
+    assert(!active || Snapshot::instance == NULL);
     rootPath = snapshotPath;
     fd = 0;
     view = NULL;
+    mappedSize = 0;
+    storedBytes = 0;
     context = NULL;
-    instance = this;
+    pageStates = NULL;
+    nvm = NULL;
+    parent = 0;
+    trackWrites = false;
+    mappedRuns = 0;
+    uffd = -1;
+    pagedBlocks = 0;
+    blockStates = NULL;
+    zeroBlock = NULL;
+    faultThread = NULL;
+    fillThread = NULL;
+    bandwidth = 0;
+    nextCopy = 0;
+    lastAdapted = 0;
+    adaptive = false;
+    if (active) instance = this;
 }
 
 Snapshot::~Snapshot() {
-    instance = NULL;
+    waitForPaging();
+    if (view != NULL) cleanEnvironment(); // restored on demand
+    if (instance == this) instance = NULL;
+}
+
+// Waits for the heap to be paged in (see startPaging)
+void Snapshot::waitForPaging() {
+    if (fillThread == NULL) return;
+    fillThread->join();
+    delete fillThread;
+    fillThread = NULL;
 }
 
 Snapshot *Snapshot::getInstance() {
@@ -41,6 +100,12 @@ bool Snapshot::anyActiveSnapshot() {
     return instance != NULL;
 }
 
+// The manager singleton cannot be used while it is recovering objects
+NVManager *Snapshot::manager() {
+    if (nvm != NULL) return nvm;
+    return &NVManager::getInstance();
+}
+
 void Snapshot::getExistingSnapshots(std::vector<uint32_t> &snapshots) {
     for (auto &p : experimental::filesystem::directory_iterator(rootPath)) {
         experimental::filesystem::path filePath = p.path();
@@ -60,20 +125,93 @@ uint32_t Snapshot::lastSnapshotID() {
     else return snapshots.back();
 }
 
+experimental::filesystem::path Snapshot::snapshotPath(uint32_t id) {
+    experimental::filesystem::path poolPath = rootPath;
+    poolPath /= "snapshot.";
+    poolPath += std::to_string(id);
+    return poolPath;
+}
+
+bool Snapshot::readHeader(uint32_t id, snapshot_header_t *header) {
+    int snapshotFd = open(snapshotPath(id).c_str(), O_RDONLY);
+    if (snapshotFd <= 0) return false;
+    ssize_t bytes = pread(snapshotFd, header, sizeof(snapshot_header_t), 0);
+    close(snapshotFd);
+    return bytes == sizeof(snapshot_header_t);
+}
+
+// Skips snapshots that were interrupted by a crash (time is set last)
+uint32_t Snapshot::lastCompleteSnapshotID() {
+    std::vector<uint32_t> snapshots;
+    getExistingSnapshots(snapshots);
+    while (!snapshots.empty()) {
+        snapshot_header_t header;
+        if (readHeader(snapshots.back(), &header) && header.time != 0) break;
+        PRINT("Skipping incomplete snapshot: %s\n",
+                snapshotPath(snapshots.back()).c_str());
+        snapshots.pop_back();
+    }
+    if (snapshots.empty()) return 0;
+    else return snapshots.back();
+}
+
+/*
+ * Number of deltas between the snapshot and its full snapshot
+ * Walks the headers instead of trusting chain_length, since parents may
+ * have been merged into full snapshots since the snapshot was taken.
+ */
+uint32_t Snapshot::chainLength(uint32_t id) {
+    uint32_t length = 0;
+    snapshot_header_t header;
+    while (readHeader(id, &header) && header.bitmap_offset != LegacyHeaderSize &&
+            header.parent_id != 0) {
+        id = header.parent_id;
+        length++;
+    }
+    return length;
+}
+
+// Checks if a delta can extend the chain of the snapshot (0 = no deltas)
+bool Snapshot::acceptsDelta(uint32_t id, uint32_t maxDeltas) {
+    return maxDeltas > 0 && chainLength(id) < maxDeltas;
+}
+
+// Size of the map of blocks stored in a snapshot file (one bit per block)
+size_t Snapshot::blockMapSize() {
+    return (GlobalAlloc::MaxMemorySize / FreeList::BlockSize) >> 3;
+}
+
+bool Snapshot::storesBlock(const snapshot_header_t *header, size_t block) {
+    const uint64_t *blocks = (const uint64_t *)((const char *)header +
+            header->blocks_offset);
+    return (blocks[block >> 6] >> (block & 63)) & 1;
+}
+
 /*
  * Snapshot layout
- * [header][bitmaps][allocations][data]
+ * [header][bitmaps][global allocator][block owners][stored blocks]
+ * [allocations][block index][data]
+ * Deltas (parent_id != 0) only store the blocks written since their parent.
+ * The data region only holds the allocated, non-zero pages of the stored
+ * blocks (see block_index_t). Snapshots without an index (index_offset = 0)
+ * store every block in a 2 MB slot, indexed by block.
+ */
+/*
+ * Creates the next snapshot file, or the provided file (heap images are
+ * replaced and sized in blocks, see saveImage)
  */
-void Snapshot::prepareSnapshot() {
+void Snapshot::prepareSnapshot(const char *path) {
     // Calculate snapshot size (excluding data)
     GlobalAlloc *instance = GlobalAlloc::getInstance();
     size_t snapshotSize = sizeof(snapshot_header_t);
     snapshotSize += instance->bitmapSize();
     snapshotSize += instance->snapshotSize();
+    snapshotSize += instance->ownersSize();
+    snapshotSize += blockMapSize();
 
     uint32_t objectCount = 0;
-    for (auto it = NVManager::getInstance().objects.begin();
-            it != NVManager::getInstance().objects.end(); it++) {
+    for (auto it = manager()->objects.begin();
+            it != manager()->objects.end(); it++) {
         snapshotSize += sizeof(uint64_t); // last committed log
         snapshotSize += sizeof(uint64_t); // log tail
         snapshotSize += sizeof(uintptr_t); // object pointer
@@ -87,16 +225,28 @@ void Snapshot::prepareSnapshot() {
     }
 
     // Create and map snapshot file
-    experimental::filesystem::path poolPath = rootPath;
-    poolPath /= "snapshot.";
-    poolPath += std::to_string(lastSnapshotID() + 1);
-    fd = open(poolPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
-    assert(fd > 0);
-    assert(fallocate(fd, 0, 0, snapshotSize) == 0);
+    if (path != NULL) {
+        snapshotSize = (snapshotSize + FreeList::BlockSize - 1) &
+            ~(FreeList::BlockSize - 1);
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        assert(fd > 0);
+        assert(ftruncate(fd, snapshotSize) == 0);
+    }
+    else {
+        experimental::filesystem::path poolPath = rootPath;
+        poolPath /= "snapshot.";
+        poolPath += std::to_string(lastSnapshotID() + 1);
+        fd = open(poolPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        assert(fd > 0);
+        assert(fallocate(fd, 0, 0, snapshotSize) == 0);
+    }
     view = (snapshot_header_t *)mmap(NULL, snapshotSize,
             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(view != NULL);
-    assert(madvise(view, snapshotSize, MADV_SEQUENTIAL | MADV_WILLNEED) == 0);
+    assert(view != MAP_FAILED);
+    if (path == NULL) {
+        assert(madvise(view, snapshotSize, MADV_SEQUENTIAL | MADV_WILLNEED) == 0);
+    }
+    mappedSize = snapshotSize;
 
     // Initialize snapshot header
     view->identifier = lastSnapshotID();
@@ -105,8 +255,14 @@ void Snapshot::prepareSnapshot() {
     view->object_count = objectCount;
     view->bitmap_offset = sizeof(snapshot_header_t);
     view->global_offset = view->bitmap_offset + instance->bitmapSize();
-    view->alloc_offset = view->global_offset + instance->snapshotSize();
+    view->owners_offset = view->global_offset + instance->snapshotSize();
+    view->blocks_offset = view->owners_offset + instance->ownersSize();
+    view->alloc_offset = view->blocks_offset + blockMapSize();
     view->data_offset = snapshotSize;
+    view->parent_id = parent;
+    view->chain_length = parent != 0 ? chainLength(parent) + 1 : 0;
+    view->index_offset = 0; // see extendSnapshot
+    storedBytes = 0;
 
     // Initialize snapshot context
     context = (uint64_t *)malloc(instance->bitmapSize() / 8);
@@ -121,35 +277,112 @@ void Snapshot::waitForFaultHandlers(size_t allocatedBlocks) {
     }
 }
 
-uint32_t Snapshot::create() {
+uint32_t Snapshot::create(const std::set<PersistentObject *> *objects) {
+    // Snapshots only capture fully recovered objects (lazy recovery)
+    NVManager::getInstance().waitForRecovery();
+
+    // Blocks paged in by a restore cannot be registered for write-protection
+    // and a forked child has no threads to serve faults on missing blocks
+    Snapshot *restoring = NVManager::getInstance().snapshot;
+#ifdef SNAPSHOT_FORK
+    if (restoring != NULL) restoring->waitForPaging();
+#else
+    if (wpFd >= 0 && restoring != NULL) restoring->waitForPaging();
+#endif
+
     // Block creation of new persistent objects
     NVManager::getInstance().lock();
 
-    struct timespec t1, t2, t3;
-    prepareSnapshot();
+    // Save the blocks written since the last snapshot (if it is tracked)
+    if (dirtyBlocks != NULL && trackedSnapshot == lastSnapshotID() &&
+            acceptsDelta(trackedSnapshot, SNAPSHOT_MAX_DELTAS)) {
+        parent = trackedSnapshot;
+    }
 
-    // Extend the snapshot off the critical path
     // Leave some slack for Global Allocator (slack = MinPoolSize)
     // TODO need to communicate this with the allocator
     size_t allocatedBlocks = GlobalAlloc::getInstance()->allocatedBlocks();
     allocatedBlocks += GlobalAlloc::MinPoolSize / FreeList::BlockSize;
+
+    // Selective snapshots keep the other objects from the last snapshot
+    // (full snapshots bound the chains, see SnapshotScheduler::setInterval)
+#ifdef SNAPSHOT_FUZZY
+    assert(objects == NULL); // objects are not captured at once
+#endif
+    parent_tables_t parentTables;
+    uint32_t last = lastSnapshotID();
+    bool selective = objects != NULL && last != 0 &&
+        acceptsDelta(last, SNAPSHOT_MAX_SELECTIVE) &&
+        readParentTables(last, allocatedBlocks, &parentTables);
+    if (selective) parent = last;
+    else if (objects != NULL) {
+        PRINT("Selective snapshot of %zu objects taken as a full snapshot\n",
+                objects->size());
+    }
+
+    struct timespec t1, t2, t3;
+    prepareSnapshot();
+
+    // Extend the snapshot off the critical path
     extendSnapshot(allocatedBlocks);
 
-    // Freeze the system (begin synchronous snapshot)
-    clock_gettime(CLOCK_REALTIME, &t1);
-    blockNewTransactions();
-    waitForRunningTransactions();
+    // Background copies back off when they slow down transactions
+    startThrottling(SNAPSHOT_LATENCY_TARGET > 0 ? SNAPSHOT_COPY_BANDWIDTH : 0,
+            true);
 
-    // Save allocation tables and mark pages as R/O
+#ifdef SNAPSHOT_FUZZY
+    // Objects are captured one group at a time (no global freeze)
+    clock_gettime(CLOCK_REALTIME, &t1);
+    t2 = t1;
     allocatedBlocks = GlobalAlloc::getInstance()->allocatedBlocks();
-    saveAllocationTables();
-    markPagesReadOnly();
-
-    // Start the asynchronous stage (begin asynchronous snapshot)
-    clock_gettime(CLOCK_REALTIME, &t2);
-    unblockNewTransactions();
+    uint64_t pause = captureObjects(allocatedBlocks);
     saveModifiedPages(allocatedBlocks);
     waitForFaultHandlers(allocatedBlocks);
+
+    // A nested transaction crossed the capture point, freeze instead
+    bool fuzzy = !crossedCapture;
+    if (!fuzzy) {
+        PRINT("Nested transaction crossed the fuzzy snapshot, freezing\n");
+        resetCapture(allocatedBlocks);
+    }
+    else view->size = view->data_offset + storedBytes;
+#else
+    const bool fuzzy = false;
+#endif
+    if (!fuzzy) {
+        // Freeze the system (begin synchronous snapshot)
+        clock_gettime(CLOCK_REALTIME, &t1);
+        blockNewTransactions();
+        waitForRunningTransactions();
+
+        // Save allocation tables and mark pages as R/O
+        allocatedBlocks = GlobalAlloc::getInstance()->allocatedBlocks();
+        saveAllocationTables();
+        if (selective) inheritObjects(*objects, parentTables, allocatedBlocks);
+#ifdef SNAPSHOT_FORK
+        // The child saves the heap, the kernel copies pages written meanwhile
+        pid_t child = fork();
+        assert(child >= 0);
+        if (child == 0) forkWorker(allocatedBlocks);
+
+        // Start the asynchronous stage (begin asynchronous snapshot)
+        clock_gettime(CLOCK_REALTIME, &t2);
+        unblockNewTransactions();
+        int status;
+        assert(waitpid(child, &status, 0) == child);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#else
+        markPagesReadOnly();
+
+        // Start the asynchronous stage (begin asynchronous snapshot)
+        clock_gettime(CLOCK_REALTIME, &t2);
+        unblockNewTransactions();
+        saveModifiedPages(allocatedBlocks);
+        waitForFaultHandlers(allocatedBlocks);
+        view->size = view->data_offset + storedBytes;
+#endif
+    }
+    stopThrottling();
     _mm_clflush(view);
     clock_gettime(CLOCK_REALTIME, &t3);
 
@@ -160,13 +393,63 @@ uint32_t Snapshot::create() {
     uint64_t latency = (t2.tv_sec - t1.tv_sec) * 1E9;
     latency += (t2.tv_nsec - t1.tv_nsec);
     view->sync_latency = latency / 1E3; // us
+#ifdef SNAPSHOT_FUZZY
+    if (fuzzy) view->sync_latency = pause / 1E3; // longest pause of a group
+#endif
     latency = (t3.tv_sec - t2.tv_sec) * 1E9;
     latency += (t3.tv_nsec - t2.tv_nsec);
     view->async_latency = latency / 1E3; // us
+    if (trackWrites) trackedSnapshot = view->identifier; // next parent
+    // Long chains are merged in the background
+    uint32_t id = view->identifier;
+    bool longChain = SNAPSHOT_MERGE_LENGTH > 0 &&
+        view->chain_length >= SNAPSHOT_MERGE_LENGTH;
     cleanEnvironment();
+    if (longChain) SnapshotMerger::getInstance().merge(id);
+    if (SNAPSHOT_RETAIN_COUNT > 0 || SNAPSHOT_RETAIN_MINUTES > 0) {
+        SnapshotMerger::getInstance().collect();
+    }
+#ifdef LAZY_RECOVERY
+    NVManager::getInstance().saveAccessHints();
+#endif
     NVManager::getInstance().unlock();
 
-    return lastSnapshotID() - 1;
+    return id;
+}
+
+/*
+ * Recovery checkpoint, taken while the recovery scheduler is paused
+ * Same as create(), except that no transactions are running (pages are
+ * copied synchronously) and objects are saved with their replay progress
+ * (last played commit and the log offset to resume from) instead of their
+ * log tails. Loading the checkpoint resumes recovery from that point.
+ */
+uint32_t Snapshot::checkpoint(NVManager *manager) {
+    nvm = manager;
+    struct timespec t1, t2;
+    clock_gettime(CLOCK_REALTIME, &t1);
+
+    prepareSnapshot();
+    size_t allocatedBlocks = GlobalAlloc::getInstance()->allocatedBlocks();
+    extendSnapshot(allocatedBlocks);
+    saveAllocationTables(true);
+    markPagesReadOnly(false);
+    saveModifiedPages(allocatedBlocks);
+    view->size = view->data_offset + storedBytes;
+    _mm_clflush(view);
+    clock_gettime(CLOCK_REALTIME, &t2);
+
+    // Finalize the snapshot
+    view->time = time(NULL);
+    uint64_t latency = (t2.tv_sec - t1.tv_sec) * 1E9;
+    latency += (t2.tv_nsec - t1.tv_nsec);
+    view->sync_latency = latency / 1E3; // us
+    view->async_latency = 0;
+    uint32_t id = view->identifier;
+    cleanEnvironment();
+    nvm = NULL;
+
+    return id;
 }
 
 void Snapshot::pageFaultHandler(void *addr) {
@@ -176,40 +459,151 @@ void Snapshot::pageFaultHandler(void *addr) {
     uintptr_t alignedAddr = (uintptr_t)addr & ~(FreeList::BlockSize - 1);
     assert(alignedAddr >= LB && alignedAddr < UB);
 
-    const size_t PPBlk = FreeList::BlockSize / GlobalAlloc::BitmapGranularity;
     off_t offset = (alignedAddr - LB) >> 21; // 2 MB pages
 
+    // Tracked writes before the snapshot freezes the system
+    if (context == NULL && trackedWrite(addr)) return;
+
+    // Only the written page is copied, the worker copies the rest
+    if (pageStates != NULL && (context[offset] == UsedHugePage ||
+                context[offset] == LockedHugePage)) {
+        uintptr_t pageAddr = (uintptr_t)addr & ~(GlobalAlloc::BitmapGranularity - 1);
+        savePage(offset, (pageAddr - alignedAddr) / GlobalAlloc::BitmapGranularity);
+        if (trackWrites) dirtyBlocks[offset] = 1;
+        writeProtect((void *)pageAddr, GlobalAlloc::BitmapGranularity, false);
+        return;
+    }
+
     if (!CAS(&context[offset], UsedHugePage, LockedHugePage)) {
         // Wait for the other thread who owns the lock
+        while (context[offset] == LockedHugePage) { }
+        // Saved blocks stay read-only while writes are tracked
+        if (trackedWrite(addr)) return;
         while (context[offset] != SavedHugePage) { }
         return;
     }
 
-    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
-    bitmap += offset * PPBlk / 64; // 8 * sizeof(uint64_t)
-    char *src = (char *)alignedAddr;
-    char *dst = (char *)view + view->data_offset + (offset << 21);
+    saveBlock(offset);
+    _mm_sfence();
+    if (trackWrites) dirtyBlocks[offset] = 1;
+    writeProtect((void *)alignedAddr, FreeList::BlockSize, false);
+    assert(CAS(&context[offset], LockedHugePage, SavedHugePage));
+}
 
-    // Copy modified 4 KB pages
-    for (size_t i = 0; i < (PPBlk >> 6); i++) {
-        uint64_t bit = bitmap[i];
-        for (off_t p = 0; p < 64; p++) {
-            if (bit & 0x0000000000000001) {
-                nonTemporalPageCopy(dst, src);
-            }
-            else {
-                nonTemporalCacheLineCopy(dst, src);
-            }
-            src = src + GlobalAlloc::BitmapGranularity;
-            dst = dst + GlobalAlloc::BitmapGranularity;
-            bit = bit >> 1;
-        }
+/*
+ * Marks a write-protected block as written since the last snapshot
+ * Returns false if writes are not tracked (no snapshot was taken yet).
+ * Called from the SIGSEGV handler.
+ */
+bool Snapshot::trackedWrite(void *addr) {
+    if (dirtyBlocks == NULL) return false;
+    const uintptr_t LB = GlobalAlloc::BaseAddress;
+    const uintptr_t UB = GlobalAlloc::BaseAddress + GlobalAlloc::MaxMemorySize;
+    uintptr_t alignedAddr = (uintptr_t)addr & ~(FreeList::BlockSize - 1);
+    if (alignedAddr < LB || alignedAddr >= UB) return false;
+
+    dirtyBlocks[(alignedAddr - LB) / FreeList::BlockSize] = 1;
+    writeProtect((void *)alignedAddr, FreeList::BlockSize, false);
+    return true;
+}
+
+/*
+ * Write-protects heap blocks with userfaultfd(2) instead of mprotect(2)
+ * and SIGSEGV (SNAPSHOT_UFFD_WP). Writes to protected blocks are reported
+ * to a pool of fault threads, which run the same handlers as the signal
+ * handler (pageFaultHandler and trackedWrite). Returns false if write-
+ * protection is not supported, the caller installs the SIGSEGV handler.
+ */
+bool Snapshot::startWriteProtect() {
+#ifdef SNAPSHOT_UFFD_WP
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        PRINT("userfaultfd is not available (errno = %d)\n", errno);
+        return false;
     }
 
-    _mm_sfence();
-    assert(mprotect((void *)alignedAddr, FreeList::BlockSize,
-                PROT_READ | PROT_WRITE) == 0);
-    assert(CAS(&context[offset], LockedHugePage, SavedHugePage));
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+    if (ioctl(fd, UFFDIO_API, &api) != 0) {
+        PRINT("userfaultfd does not write-protect the heap (errno = %d)\n",
+                errno);
+        close(fd);
+        return false;
+    }
+
+    wpFd = fd;
+    for (size_t i = 0; i < WriteFaultThreads; i++) {
+        std::thread(&Snapshot::writeFaultWorker).detach();
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Registers the blocks allocated since the last snapshot
+bool Snapshot::registerWriteProtect(size_t allocatedBlocks) {
+    if (allocatedBlocks <= wpBlocks) return true;
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = GlobalAlloc::BaseAddress + wpBlocks * FreeList::BlockSize;
+    reg.range.len = (allocatedBlocks - wpBlocks) * FreeList::BlockSize;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(wpFd, UFFDIO_REGISTER, &reg) != 0 ||
+            (reg.ioctls & ((uint64_t)1 << _UFFDIO_WRITEPROTECT)) == 0) {
+        PRINT("Failed to register the heap (errno = %d)\n", errno);
+        return false;
+    }
+    wpBlocks = allocatedBlocks;
+    return true;
+}
+
+// Unprotecting a range wakes up the threads writing to it
+void Snapshot::writeProtect(void *addr, size_t length, bool protect) {
+    if (wpFd < 0) {
+        assert(mprotect(addr, length,
+                    protect ? PROT_READ : PROT_READ | PROT_WRITE) == 0);
+        return;
+    }
+    struct uffdio_writeprotect wp;
+    wp.range.start = (uintptr_t)addr;
+    wp.range.len = length;
+    wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    assert(ioctl(wpFd, UFFDIO_WRITEPROTECT, &wp) == 0);
+}
+
+void Snapshot::writeFaultWorker() {
+    struct pollfd fds;
+    fds.fd = wpFd;
+    fds.events = POLLIN;
+
+    while (true) {
+        if (poll(&fds, 1, -1) < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        // Faults are read by one of the threads
+        struct uffd_msg msg;
+        if (read(wpFd, &msg, sizeof(msg)) != sizeof(msg)) continue;
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+                (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) == 0) continue;
+
+        void *addr = (void *)msg.arg.pagefault.address;
+        uintptr_t block = (uintptr_t)addr & ~(FreeList::BlockSize - 1);
+        if (anyActiveSnapshot()) getInstance()->pageFaultHandler(addr);
+        else if (!trackedWrite(addr)) {
+            writeProtect((void *)block, FreeList::BlockSize, false);
+        }
+
+        // Unprotected before the fault was read
+        struct uffdio_range range;
+        range.start = block;
+        range.len = FreeList::BlockSize;
+        ioctl(wpFd, UFFDIO_WAKE, &range);
+    }
 }
 
 void Snapshot::blockNewTransactions() {
@@ -237,7 +631,199 @@ void Snapshot::waitForRunningTransactions() {
     }
 }
 
-void Snapshot::saveAllocationTables() {
+/*
+ * Fuzzy snapshots (SNAPSHOT_FUZZY) capture objects one group at a time
+ * A group is an object and the objects it shares nested transactions with
+ * (see NestedCalls), so a nested transaction is on the same side of the
+ * capture point of all its objects. Only the transactions of the group
+ * wait. Once the group is quiescent, the log positions and allocators of
+ * its objects are saved and their blocks are write-protected, the blocks
+ * are then copied on write or by the snapshot threads as usual. Recovery
+ * replays each log from the position saved with its object. The global
+ * allocator is saved last, the blocks of saved owners are kept as they
+ * were saved (see GlobalAlloc::startCapture), and writes are not tracked
+ * (fuzzy snapshots are full snapshots).
+ * Returns the longest pause of a group (ns).
+ */
+uint64_t Snapshot::captureObjects(size_t allocatedBlocks) {
+    GlobalAlloc *instance = GlobalAlloc::getInstance();
+    NVManager &nvm = NVManager::getInstance();
+    char *snapshot = (char *)view + view->alloc_offset;
+    uint64_t longestPause = 0;
+    assert(allocatedBlocks * sizeof(block_index_t) <=
+            (size_t)(view->data_offset - view->index_offset));
+
+    trackWrites = false;
+    storedBytes = 0;
+    for (size_t b = 0; b < allocatedBlocks; b++) context[b] = FreeHugePage;
+    if (wpFd >= 0) assert(registerWriteProtect(allocatedBlocks));
+#ifdef SNAPSHOT_PAGE_COW
+    const size_t PPBlk = FreeList::BlockSize / GlobalAlloc::BitmapGranularity;
+    pageStates = (volatile uint8_t *)calloc(allocatedBlocks * PPBlk,
+            sizeof(uint8_t));
+#endif
+    instance->startCapture();
+    for (auto it = nvm.objects.begin(); it != nvm.objects.end(); it++) {
+        it->second->captured = false;
+    }
+    crossedCapture = false;
+    __sync_synchronize();
+    capturing = true;
+    __sync_synchronize();
+
+    for (auto it = nvm.objects.begin(); it != nvm.objects.end(); it++) {
+        if (it->second->captured) continue;
+        std::set<PersistentObject *> group;
+        group.insert(it->second);
+        NestedCalls::getInstance().close(group);
+
+        struct timespec t1, t2;
+        clock_gettime(CLOCK_REALTIME, &t1);
+        std::set<uint32_t> owners;
+        for (auto g = group.begin(); g != group.end();) {
+            if ((*g)->captured) { // joined a captured group meanwhile
+                g = group.erase(g);
+                continue;
+            }
+            (*g)->log->snapshot_lock = 1;
+            owners.insert(instance->ownerID((*g)->alloc));
+            ++g;
+        }
+        __sync_synchronize();
+        waitForObjectTransactions(group);
+
+        // Allocations happen in transactions, no need to lock
+        for (auto g = group.begin(); g != group.end(); ++g) {
+            PersistentObject *object = *g;
+            *((uint64_t *)snapshot) = object->log->last_commit;
+            snapshot += sizeof(uint64_t);
+            *((uint64_t *)snapshot) = object->log->tail;
+            snapshot += sizeof(uint64_t);
+            *((uintptr_t *)snapshot) = (uintptr_t)object;
+            snapshot += sizeof(uintptr_t);
+            object->alloc->save(snapshot);
+            snapshot += object->alloc->snapshotSize();
+            instance->captureOwner(object->alloc);
+        }
+        for (size_t b = 0; b < allocatedBlocks; b++) {
+            if (owners.count(instance->blockOwner(b)) > 0) captureBlock(b);
+        }
+
+        for (auto g = group.begin(); g != group.end(); ++g) {
+            (*g)->captured = true;
+            (*g)->log->snapshot_lock = 0;
+        }
+        _mm_sfence();
+        pthread_mutex_lock(nvm.ckptLock());
+        pthread_cond_broadcast(nvm.ckptCondition());
+        pthread_mutex_unlock(nvm.ckptLock());
+
+        clock_gettime(CLOCK_REALTIME, &t2);
+        uint64_t pause = (t2.tv_sec - t1.tv_sec) * 1E9;
+        pause += (t2.tv_nsec - t1.tv_nsec);
+        longestPause = std::max(longestPause, pause);
+    }
+    capturing = false;
+    __sync_synchronize();
+    pthread_mutex_lock(nvm.ckptLock());
+    pthread_cond_broadcast(nvm.ckptCondition());
+    pthread_mutex_unlock(nvm.ckptLock());
+
+    // Blocks without an owner, then the global allocator
+    for (size_t b = 0; b < allocatedBlocks; b++) {
+        if (instance->blockOwner(b) == 0) captureBlock(b);
+    }
+    instance->finishCapture((char *)view + view->global_offset,
+            (char *)view + view->owners_offset);
+    _mm_sfence();
+    return longestPause;
+}
+
+/*
+ * Checks if a transaction on the object waits for a fuzzy snapshot
+ * 'parent' is the object of the enclosing transaction (NULL if none), and
+ * 'held' tells if a capture waits for an outer transaction of the thread.
+ * Nested transactions only wait while objects are captured: one from a
+ * captured object enters an object that is not captured yet once it is
+ * captured. Other nested transactions that cross the capture point cannot
+ * be undone (the transaction of the parent already runs), the snapshot is
+ * retaken with a global freeze instead (see create).
+ */
+bool Snapshot::waitsForCapture(PersistentObject *object,
+        PersistentObject *parent, bool held) {
+    bool locked = object->isWaitingForSnapshot();
+    if (parent == NULL) return locked && !held;
+    if (!capturing) return false; // a freeze waits for the parent
+    if (held) { // the capture waits for this transaction
+        if (parent->captured != object->captured) crossedCapture = true;
+        return false;
+    }
+    if (locked) return true;
+    if (crossedCapture) return false; // retaken anyway
+    if (parent->captured && !object->captured) return true;
+    if (!parent->captured && object->captured) crossedCapture = true;
+    return false;
+}
+
+// Waits until no thread runs a (possibly nested) transaction on the objects
+void Snapshot::waitForObjectTransactions(
+        const std::set<PersistentObject *> &objects) {
+    NVManager &nvm = NVManager::getInstance();
+    bool running = true;
+
+    while (running) {
+        running = false;
+        for (auto it = nvm.program_threads.begin();
+                it != nvm.program_threads.end() && !running; it++) {
+            volatile uint64_t *txBuffer = it->second->tx_buffer;
+            volatile NvMethodCall *calls = it->second->buffer;
+            for (uint64_t i = 0; i < txBuffer[0]; i++) {
+                if (objects.count((PersistentObject *)calls[i].obj_ptr) > 0) {
+                    running = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Drops the blocks of a fuzzy snapshot that has to be retaken, the
+ * allocation tables are saved again by the global freeze
+ */
+void Snapshot::resetCapture(size_t allocatedBlocks) {
+    memset((char *)view + view->blocks_offset, 0, blockMapSize());
+    memset((char *)view + view->index_offset, 0,
+            allocatedBlocks * sizeof(block_index_t));
+    free((void *)pageStates);
+    pageStates = NULL;
+    storedBytes = 0;
+}
+
+/*
+ * Saves the allocation map of a block and write-protects it (fuzzy
+ * snapshots), the block gets a slot for each allocated page
+ */
+void Snapshot::captureBlock(size_t block) {
+    char *bitmap = (char *)view + view->bitmap_offset;
+    uint64_t *blocks = (uint64_t *)((char *)view + view->blocks_offset);
+    block_index_t *index = (block_index_t *)((char *)view + view->index_offset);
+    GlobalAlloc::getInstance()->saveBitmap(bitmap, block);
+
+    const uint64_t *words = (const uint64_t *)bitmap + block * 8;
+    size_t pages = 0;
+    for (size_t i = 0; i < 8; i++) pages += __builtin_popcountll(words[i]);
+    if (pages == 0) return;
+
+    blocks[block >> 6] |= (uint64_t)1 << (block & 63);
+    index[block].offset = storedBytes;
+    storedBytes += pages * GlobalAlloc::BitmapGranularity;
+    writeProtect((char *)GlobalAlloc::BaseAddress + block * FreeList::BlockSize,
+            FreeList::BlockSize, true);
+    context[block] = UsedHugePage;
+}
+
+void Snapshot::saveAllocationTables(bool recovering) {
     // Save allocation bitmap
     char *bitmap = (char *)view + view->bitmap_offset;
     GlobalAlloc::getInstance()->saveBitmap(bitmap);
@@ -246,16 +832,28 @@ void Snapshot::saveAllocationTables() {
     char *snapshot = (char *)view + view->global_offset;
     GlobalAlloc::getInstance()->save(snapshot);
 
+    // Save block owners
+    snapshot = (char *)view + view->owners_offset;
+    GlobalAlloc::getInstance()->saveOwners(snapshot);
+
     // Save object allocators
     // No need to lock since all threads are blocked
     snapshot = (char *)view + view->alloc_offset;
-    for (auto it = NVManager::getInstance().objects.begin();
-            it != NVManager::getInstance().objects.end(); it++) {
+    for (auto it = manager()->objects.begin();
+            it != manager()->objects.end(); it++) {
         ObjectAlloc *alloc = it->second->alloc;
-        *((uint64_t *)snapshot) = it->second->log->last_commit;
-        snapshot += sizeof(uint64_t);
-        *((uint64_t *)snapshot) = it->second->log->tail;
-        snapshot += sizeof(uint64_t);
+        if (recovering) { // replay progress
+            *((uint64_t *)snapshot) = it->second->last_played_commit_id;
+            snapshot += sizeof(uint64_t);
+            *((uint64_t *)snapshot) = it->second->replayOffset();
+            snapshot += sizeof(uint64_t);
+        }
+        else {
+            *((uint64_t *)snapshot) = it->second->log->last_commit;
+            snapshot += sizeof(uint64_t);
+            *((uint64_t *)snapshot) = it->second->log->tail;
+            snapshot += sizeof(uint64_t);
+        }
         *((uintptr_t *)snapshot) = (uintptr_t)it->second;
         snapshot += sizeof(uintptr_t);
         alloc->save(snapshot);
@@ -265,161 +863,492 @@ void Snapshot::saveAllocationTables() {
     _mm_sfence();
 }
 
-void Snapshot::markPagesReadOnly() {
+// Size of an object in the allocation tables of a snapshot
+// [last commit][log tail][object][uuid][cores][allocator][free lists]
+static size_t allocationEntrySize(const uint64_t *fields) {
+    return 5 * sizeof(uint64_t) + sizeof(uuid_t) +
+        fields[5] * FreeList::snapshotSize();
+}
+
+/*
+ * Reads the allocation tables of the parent of a selective snapshot
+ * Only the owners and allocation map of the first blocks are read. Legacy
+ * snapshots do not record block owners and cannot be parents.
+ */
+bool Snapshot::readParentTables(uint32_t id, size_t blocks,
+        parent_tables_t *tables) {
+    int snapshotFd = open(snapshotPath(id).c_str(), O_RDONLY);
+    if (snapshotFd <= 0) return false;
+    snapshot_header_t header;
+    bool valid = pread(snapshotFd, &header, sizeof(header), 0) ==
+        sizeof(header) && header.time != 0 &&
+        header.bitmap_offset != LegacyHeaderSize;
+
+    if (valid) {
+        const size_t words = FreeList::BlockSize / GlobalAlloc::BitmapGranularity / 64;
+        blocks = std::min(blocks, GlobalAlloc::MaxMemorySize / FreeList::BlockSize);
+        off_t end = isSparse(&header) ? header.index_offset : header.data_offset;
+        tables->owners.resize(blocks);
+        tables->bitmap.resize(blocks * words);
+        tables->allocations.resize(end - header.alloc_offset);
+        tables->objects = header.object_count;
+
+        ssize_t size = blocks * sizeof(uint32_t);
+        valid = pread(snapshotFd, tables->owners.data(), size,
+                header.owners_offset) == size;
+        size = tables->bitmap.size() * sizeof(uint64_t);
+        valid = valid && pread(snapshotFd, tables->bitmap.data(), size,
+                header.bitmap_offset) == size;
+        size = tables->allocations.size();
+        valid = valid && pread(snapshotFd, tables->allocations.data(), size,
+                header.alloc_offset) == size;
+    }
+    close(snapshotFd);
+    return valid;
+}
+
+/*
+ * Objects saved by a selective snapshot: the selected objects, the ones
+ * that cannot be kept, and the objects they share nested transactions
+ * with, so both sides of a nested transaction resume from the same point
+ */
+std::set<PersistentObject *> Snapshot::savedObjects(
+        const std::set<PersistentObject *> &selected,
+        const std::set<PersistentObject *> &unkept, NestedCalls &calls) {
+    std::set<PersistentObject *> saved(selected.begin(), selected.end());
+    saved.insert(unkept.begin(), unkept.end());
+    calls.close(saved);
+    return saved;
+}
+
+/*
+ * Keeps the objects that are not saved as they are in the parent
+ * (selective snapshots). Their log positions, allocators and allocation
+ * maps are copied from the parent, and their blocks are stored by the
+ * parent (chain). Objects that obtained or released blocks since the
+ * parent, or that are not in the parent, are saved as well, since the
+ * global allocator is always saved as it is now (see savedObjects).
+ */
+void Snapshot::inheritObjects(const std::set<PersistentObject *> &objects,
+        const parent_tables_t &tables, size_t allocatedBlocks) {
+    GlobalAlloc *instance = GlobalAlloc::getInstance();
+    std::set<uint32_t> saved; // owners of the saved objects
+    saved.insert(0); // blocks without an owner
+    for (size_t b = 0; b < allocatedBlocks; b++) {
+        uint32_t previous = b < tables.owners.size() ? tables.owners[b] : 0;
+        if (instance->blockOwner(b) == previous) continue;
+        saved.insert(instance->blockOwner(b));
+        saved.insert(previous);
+    }
+
+    UUIDMap<const char *> entries;
+    const char *entry = tables.allocations.data();
+    for (uint32_t o = 0; o < tables.objects; o++) {
+        const uint64_t *fields = (const uint64_t *)entry;
+        entries.insert((const unsigned char *)&fields[3], entry);
+        entry += allocationEntrySize(fields);
+        assert(entry <= tables.allocations.data() + tables.allocations.size());
+    }
+
+    // Objects that cannot be kept from the parent
+    std::set<PersistentObject *> unkept;
+    char *current = (char *)view + view->alloc_offset;
+    for (uint32_t o = 0; o < view->object_count; o++) {
+        uint64_t *fields = (uint64_t *)current;
+        size_t size = allocationEntrySize(fields);
+        PersistentObject *object = (PersistentObject *)fields[2];
+        const char **kept = entries.find((const unsigned char *)&fields[3]);
+        if (saved.count(instance->ownerID(object->alloc)) > 0 ||
+                kept == NULL ||
+                allocationEntrySize((const uint64_t *)*kept) != size) {
+            unkept.insert(object);
+        }
+        current += size;
+    }
+    std::set<PersistentObject *> toSave = savedObjects(objects, unkept,
+            NestedCalls::getInstance());
+
+    // The object pointer is the only field that is not copied
+    current = (char *)view + view->alloc_offset;
+    for (uint32_t o = 0; o < view->object_count; o++) {
+        uint64_t *fields = (uint64_t *)current;
+        size_t size = allocationEntrySize(fields);
+        PersistentObject *object = (PersistentObject *)fields[2];
+        if (toSave.count(object) > 0) {
+            saved.insert(instance->ownerID(object->alloc));
+        }
+        else {
+            const char **kept = entries.find((const unsigned char *)&fields[3]);
+            memcpy(fields, *kept, 2 * sizeof(uint64_t));
+            memcpy(&fields[3], *kept + 3 * sizeof(uint64_t),
+                    size - 3 * sizeof(uint64_t));
+        }
+        current += size;
+    }
+
+    const size_t words = FreeList::BlockSize / GlobalAlloc::BitmapGranularity / 64;
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    inherited.assign(allocatedBlocks, 0);
+    for (size_t b = 0; b < allocatedBlocks; b++) {
+        if (saved.count(instance->blockOwner(b)) > 0) continue;
+        inherited[b] = 1;
+        memcpy(bitmap + b * words, &tables.bitmap[b * words],
+                words * sizeof(uint64_t));
+    }
+    _mm_sfence();
+}
+
+/*
+ * Decides which blocks to save and write-protects allocated blocks
+ * Deltas skip blocks that were not written since their parent. With
+ * incremental snapshots enabled, a new generation of dirty blocks starts
+ * here: allocated blocks are write-protected (and clean) until written,
+ * other blocks are dirty, since their writes cannot be tracked.
+ */
+void Snapshot::markPagesReadOnly(bool readOnly) {
 
     GlobalAlloc *instance = GlobalAlloc::getInstance();
     size_t allocatedBlocks = instance->allocatedBlocks();
+    const size_t maxBlocks = GlobalAlloc::MaxMemorySize / FreeList::BlockSize;
     uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    uint64_t *blocks = (uint64_t *)((char *)view + view->blocks_offset);
+    block_index_t *index = (block_index_t *)((char *)view + view->index_offset);
+    assert(allocatedBlocks * sizeof(block_index_t) <=
+            (size_t)(view->data_offset - view->index_offset));
+
+    volatile uint8_t *written = parent != 0 && parent == trackedSnapshot ?
+        dirtyBlocks : NULL;
+    volatile uint8_t *tracked = NULL;
+    trackWrites = readOnly && SNAPSHOT_MAX_DELTAS > 0;
+#ifdef SNAPSHOT_FUZZY
+    trackWrites = false; // fuzzy snapshots are full snapshots
+#endif
+    if (trackWrites) {
+        if (spareDirtyBlocks == NULL) {
+            spareDirtyBlocks = (volatile uint8_t *)malloc(maxBlocks);
+        }
+        tracked = spareDirtyBlocks;
+        memset((void *)tracked, 1, maxBlocks);
+    }
+
+    // Stored blocks get a slot for each allocated page
+    storedBytes = 0;
+    for (size_t b = 0; b < allocatedBlocks; b++, bitmap += 8) {
+        size_t pages = 0;
+        for (size_t i = 0; i < 8; i++) pages += __builtin_popcountll(bitmap[i]);
+
+        if (pages == 0) {
+            context[b] = FreeHugePage;
+            continue;
+        }
+        if (!inherited.empty() && inherited[b]) {
+            // Kept from the parent, still dirty if written since then
+            context[b] = SavedHugePage;
+            if (tracked != NULL) tracked[b] = written != NULL ? written[b] : 1;
+            continue;
+        }
+        if (written != NULL && written[b] == 0) {
+            context[b] = SavedHugePage; // stored by the parent
+        }
+        else {
+            context[b] = UsedHugePage;
+            blocks[b >> 6] |= (uint64_t)1 << (b & 63);
+            index[b].offset = storedBytes;
+            storedBytes += pages * GlobalAlloc::BitmapGranularity;
+        }
+        if (tracked != NULL) tracked[b] = 0;
+    }
+
+    // Publish the new generation before write-protecting blocks
+    if (tracked != NULL) {
+        spareDirtyBlocks = dirtyBlocks;
+        dirtyBlocks = tracked;
+        __sync_synchronize();
+    }
+    if (!readOnly) return;
+    if (wpFd >= 0) assert(registerWriteProtect(allocatedBlocks));
+#ifdef SNAPSHOT_PAGE_COW
+    const size_t PPBlk = FreeList::BlockSize / GlobalAlloc::BitmapGranularity;
+    pageStates = (volatile uint8_t *)calloc(allocatedBlocks * PPBlk,
+            sizeof(uint8_t));
+    __sync_synchronize();
+#endif
 
-    off_t bitmapOffset = 0;
-    bool isAllocated;
     size_t regionSize = 0;
     uintptr_t addr = GlobalAlloc::BaseAddress;
-
     for (size_t b = 0; b < allocatedBlocks; b++) {
-        isAllocated = bitmap[bitmapOffset++] > 0;  // 0
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 1
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 2
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 3
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 4
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 5
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 6
-        isAllocated |= bitmap[bitmapOffset++] > 0; // 7
-
-        if (isAllocated) {
-            context[b] = UsedHugePage;
+        if (context[b] != FreeHugePage) {
             regionSize += FreeList::BlockSize;
+            continue;
         }
-        else {
-            context[b] = FreeHugePage;
-            if (regionSize > 0) {
-                assert(mprotect((void *)addr, regionSize, PROT_READ) == 0);
-                regionSize = 0;
-            }
-            addr = GlobalAlloc::BaseAddress + (b + 1) * FreeList::BlockSize;
+        if (regionSize > 0) {
+            writeProtect((void *)addr, regionSize, true);
+            regionSize = 0;
         }
+        addr = GlobalAlloc::BaseAddress + (b + 1) * FreeList::BlockSize;
     }
 
     if (regionSize > 0) {
-        assert(mprotect((void *)addr, regionSize, PROT_READ) == 0);
+        writeProtect((void *)addr, regionSize, true);
     }
 }
 
-void Snapshot::nonTemporalCacheLineCopy(char *dst, char *src) {
-    __m128i *dstPtr = (__m128i *)dst;
-    __m128i *srcPtr = (__m128i *)src;
-
-    // 64 bytes = 512 bits = 4 * 128 bits
-    __m128i xmm0 = _mm_loadu_si128(srcPtr + 0);
-    __m128i xmm1 = _mm_loadu_si128(srcPtr + 1);
-    __m128i xmm2 = _mm_loadu_si128(srcPtr + 2);
-    __m128i xmm3 = _mm_loadu_si128(srcPtr + 3);
-
-    _mm_stream_si128(dstPtr + 0, xmm0);
-    _mm_stream_si128(dstPtr + 1, xmm1);
-    _mm_stream_si128(dstPtr + 2, xmm2);
-    _mm_stream_si128(dstPtr + 3, xmm3);
+// Pages that are stored as holes (checked before saving the page)
+bool Snapshot::zeroPage(const char *page) {
+    const __m128i *ptr = (const __m128i *)page;
+    const __m128i zero = _mm_setzero_si128();
+
+    // 64 bytes at a time, most non-zero pages are found in the first line
+    for (size_t i = 0; i < 4096 / sizeof(__m128i); i += 4) {
+        __m128i xmm0 = _mm_or_si128(_mm_loadu_si128(ptr + i + 0),
+                _mm_loadu_si128(ptr + i + 1));
+        __m128i xmm1 = _mm_or_si128(_mm_loadu_si128(ptr + i + 2),
+                _mm_loadu_si128(ptr + i + 3));
+        xmm0 = _mm_or_si128(xmm0, xmm1);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(xmm0, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Snapshot::nonTemporalPageCopy(char *dst, char *src) {
-    __m128i *dstPtr = (__m128i *)dst;
-    __m128i *srcPtr = (__m128i *)src;
-
-    // 4096 bytes = 32768 bits = 256 x 128 bits = 16 x 16 x 128 bits
-    #pragma unroll(16)
-    for (int i = 0; i < 16; i++) {
-        __m128i xmm0 = _mm_loadu_si128(srcPtr + 0);
-        __m128i xmm1 = _mm_loadu_si128(srcPtr + 1);
-        __m128i xmm2 = _mm_loadu_si128(srcPtr + 2);
-        __m128i xmm3 = _mm_loadu_si128(srcPtr + 3);
-        __m128i xmm4 = _mm_loadu_si128(srcPtr + 4);
-        __m128i xmm5 = _mm_loadu_si128(srcPtr + 5);
-        __m128i xmm6 = _mm_loadu_si128(srcPtr + 6);
-        __m128i xmm7 = _mm_loadu_si128(srcPtr + 7);
-        __m128i xmm8 = _mm_loadu_si128(srcPtr + 8);
-        __m128i xmm9 = _mm_loadu_si128(srcPtr + 9);
-        __m128i xmm10 = _mm_loadu_si128(srcPtr + 10);
-        __m128i xmm11 = _mm_loadu_si128(srcPtr + 11);
-        __m128i xmm12 = _mm_loadu_si128(srcPtr + 12);
-        __m128i xmm13 = _mm_loadu_si128(srcPtr + 13);
-        __m128i xmm14 = _mm_loadu_si128(srcPtr + 14);
-        __m128i xmm15 = _mm_loadu_si128(srcPtr + 15);
-
-        _mm_stream_si128(dstPtr + 0, xmm0); // 16 bytes
-        _mm_stream_si128(dstPtr + 1, xmm1);
-        _mm_stream_si128(dstPtr + 2, xmm2);
-        _mm_stream_si128(dstPtr + 3, xmm3);
-        _mm_stream_si128(dstPtr + 4, xmm4);
-        _mm_stream_si128(dstPtr + 5, xmm5);
-        _mm_stream_si128(dstPtr + 6, xmm6);
-        _mm_stream_si128(dstPtr + 7, xmm7);
-        _mm_stream_si128(dstPtr + 8, xmm8);
-        _mm_stream_si128(dstPtr + 9, xmm9);
-        _mm_stream_si128(dstPtr + 10, xmm10);
-        _mm_stream_si128(dstPtr + 11, xmm11);
-        _mm_stream_si128(dstPtr + 12, xmm12);
-        _mm_stream_si128(dstPtr + 13, xmm13);
-        _mm_stream_si128(dstPtr + 14, xmm14);
-        _mm_stream_si128(dstPtr + 15, xmm15);
-
-        dstPtr += 16;
-        srcPtr += 16;
-    }
-}
-
-void Snapshot::snapshotWorker(off_t offset, size_t length) {
-
-    GlobalAlloc *ga = GlobalAlloc::getInstance();
-    const size_t BlockSize = FreeList::BlockSize;
-    const size_t PPBlk = BlockSize / ga->BitmapGranularity;
-    const size_t BitmapStepSize = PPBlk / 64; // 8 for 2 MB super-pages
+    Savitar_stream_copy(dst, src, GlobalAlloc::BitmapGranularity);
+}
 
-    // Setup data and bitmap pointers
-    char *dst = (char *)view + view->data_offset + offset * BlockSize;
-    char *src = (char *)ga->BaseAddress + offset * BlockSize;
-    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
-    bitmap += offset * BitmapStepSize;
-
-    for (off_t sp = 0; sp < length; sp++) {
-        if (CAS(&context[offset + sp], UsedHugePage, LockedHugePage)) {
-
-            // Copy modified 4 KB pages
-            void *oldSrc = src;
-            for (size_t b = 0; b < PPBlk; b += 64) {
-                uint64_t bit = *bitmap;
-                for (off_t p = 0; p < 64; p++) {
-                    if (bit & 0x0000000000000001) {
-                        nonTemporalPageCopy(dst, src);
-                    }
-                    else {
-                        // TODO avoid this by filling unused pages at recovery
-                        nonTemporalCacheLineCopy(dst, src);
-                    }
-                    src = src + GlobalAlloc::BitmapGranularity;
-                    dst = dst + GlobalAlloc::BitmapGranularity;
-                    bit >>= 1;
-                }
-                bitmap++;
-            }
+void Snapshot::snapshotBlock(size_t block) {
+    char *src = (char *)GlobalAlloc::BaseAddress + block * FreeList::BlockSize;
+    if (!CAS(&context[block], UsedHugePage, LockedHugePage)) return;
 
-            // Persist changes
-            _mm_sfence();
+    saveBlock(block);
 
-            assert(mprotect(oldSrc, FreeList::BlockSize,
-                        PROT_READ | PROT_WRITE) == 0);
+    // Persist changes
+    _mm_sfence();
+    if (bandwidth > 0) throttle(allocatedBytes(block));
 
-            assert(CAS(&context[offset + sp], LockedHugePage, SavedHugePage));
-        }
-        else {
-            // Update pointers (skip by one block)
-            src = src + BlockSize;
-            dst = dst + BlockSize;
-            bitmap = bitmap + BitmapStepSize;
-        }
+    // Tracked blocks are made writable by their first write
+    if (!trackWrites) {
+        writeProtect(src, FreeList::BlockSize, false);
     }
+
+    assert(CAS(&context[block], LockedHugePage, SavedHugePage));
 }
 
-void Snapshot::unblockNewTransactions() {
+size_t Snapshot::defaultThreads() {
+    size_t threads = SNAPSHOT_THREADS;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    return threads;
+}
+
+/*
+ * NUMA nodes of the machine and their CPUs (from sysfs), read once
+ * Machines without NUMA information are a single node.
+ */
+static const std::vector<cpu_set_t> &numaNodes() {
+    static std::vector<cpu_set_t> nodes;
+    static std::once_flag once;
+    std::call_once(once, []() {
+        for (int n = 0;; n++) {
+            char path[64];
+            sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+            FILE *file = fopen(path, "r");
+            if (file == NULL) break;
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            int first, last;
+            while (fscanf(file, "%d", &first) == 1) {
+                last = first;
+                if (fscanf(file, "-%d", &last) != 1) last = first;
+                for (int c = first; c <= last; c++) CPU_SET(c, &cpus);
+                if (fgetc(file) != ',') break;
+            }
+            fclose(file);
+            nodes.push_back(cpus);
+        }
+        if (nodes.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            nodes.push_back(cpus);
+        }
+    });
+    return nodes;
+}
+
+/*
+ * Runs fn on each block of the list using SnapshotThreads threads
+ * Blocks are handed out in chunks (16 MB), threads copying sparse blocks
+ * simply take more chunks. If the heap spans NUMA nodes, blocks are queued
+ * on the node holding their memory (move_pages(2) only queries, unmapped
+ * blocks are interleaved) and threads are bound to the nodes, taking chunks
+ * of other nodes once their own node is drained. The caller runs a share.
+ */
+void Snapshot::parallelForBlocks(const std::vector<size_t> &blocks,
+        void (Snapshot::*fn)(size_t)) {
+    const size_t ChunkLength = 8; // blocks (16 MB)
+    size_t chunks = (blocks.size() + ChunkLength - 1) / ChunkLength;
+    size_t threads = std::min(SnapshotThreads, chunks);
+    size_t nodes = numaNodes().size();
+    if (threads <= 1) nodes = 1;
+
+    block_queues_t queues;
+    queues.lists.resize(nodes);
+    queues.cursors.assign(nodes, 0);
+    if (nodes == 1) {
+        queues.lists[0] = blocks;
+    }
+    else {
+        std::vector<void *> pages(blocks.size());
+        std::vector<int> status(blocks.size(), -1);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            pages[i] = (void *)(GlobalAlloc::BaseAddress +
+                    blocks[i] * FreeList::BlockSize);
+        }
+        if (syscall(SYS_move_pages, 0, blocks.size(), pages.data(), NULL,
+                    status.data(), 0) != 0) {
+            status.assign(blocks.size(), -1);
+        }
+        for (size_t i = 0; i < blocks.size(); i++) {
+            size_t node = status[i] >= 0 && (size_t)status[i] < nodes ?
+                status[i] : (i / ChunkLength) % nodes;
+            queues.lists[node].push_back(blocks[i]);
+        }
+    }
+
+    vector<std::thread *> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.push_back(new thread(&Snapshot::blockWorker, this, &queues,
+                    i % nodes, nodes > 1, fn));
+    }
+    blockWorker(&queues, 0, false, fn);
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+}
+
+void Snapshot::blockWorker(block_queues_t *queues, size_t home, bool bind,
+        void (Snapshot::*fn)(size_t)) {
+    const size_t ChunkLength = 8; // blocks (16 MB)
+    if (bind) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &numaNodes()[home]);
+    }
+
+    size_t nodes = queues->lists.size();
+    for (size_t n = 0; n < nodes; n++) {
+        size_t node = (home + n) % nodes;
+        const std::vector<size_t> &list = queues->lists[node];
+        size_t begin;
+        while ((begin = __sync_fetch_and_add(&queues->cursors[node],
+                        ChunkLength)) < list.size()) {
+            size_t end = std::min(begin + ChunkLength, list.size());
+            for (size_t i = begin; i < end; i++) (this->*fn)(list[i]);
+        }
+    }
+    _mm_sfence();
+}
+
+/*
+ * Runs in the child process of a forked snapshot (SNAPSHOT_FORK)
+ * The child has a copy-on-write view of the (private) heap at the time of
+ * the fork, so blocks are saved without write-protection while the parent
+ * runs transactions. Only the forking thread exists in the child, the
+ * snapshot threads are created here and the child never returns.
+ */
+void Snapshot::forkWorker(size_t allocatedBlocks) {
+    wpFd = -1; // belongs to the parent's address space
+    markPagesReadOnly(false);
+    saveModifiedPages(allocatedBlocks);
+    view->size = view->data_offset + storedBytes;
+    _exit(0);
+}
+
+// Bytes of a block allocated at the time of the snapshot
+size_t Snapshot::allocatedBytes(size_t block) {
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    bitmap += block * 8; // 2 MB = 512 x 4 KB
+    size_t pages = 0;
+    for (size_t i = 0; i < 8; i++) pages += __builtin_popcountll(bitmap[i]);
+    return pages * GlobalAlloc::BitmapGranularity;
+}
+
+/*
+ * Copies the allocated, non-zero 4 KB pages of a block to its slots
+ * (assigned by markPagesReadOnly) and records them in the block index
+ */
+void Snapshot::saveBlock(size_t block) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    if (pageStates != NULL) { // pages may be copied by fault handlers
+        for (size_t p = 0; p < FreeList::BlockSize / PageSize; p++) {
+            savePage(block, p);
+        }
+        return;
+    }
+
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    bitmap += block * 8; // 2 MB = 512 x 4 KB
+    block_index_t *entry = (block_index_t *)((char *)view +
+            view->index_offset) + block;
+    char *src = (char *)GlobalAlloc::BaseAddress + block * FreeList::BlockSize;
+    char *dst = (char *)view + view->data_offset + entry->offset;
+
+    for (size_t i = 0; i < 8; i++) {
+        uint64_t bit = bitmap[i];
+        uint64_t stored = 0;
+        for (off_t p = 0; p < 64; p++, src += PageSize, bit >>= 1) {
+            if ((bit & 0x0000000000000001) == 0) continue;
+            if (!zeroPage(src)) {
+                nonTemporalPageCopy(dst, src);
+                stored |= (uint64_t)1 << p;
+            }
+            dst += PageSize;
+        }
+        _mm_stream_si64((long long *)&entry->pages[i], stored);
+    }
+}
+
+/*
+ * Copies a 4 KB page of a block (SNAPSHOT_PAGE_COW), at most once
+ * Pages are claimed by the first thread (fault handler or worker), others
+ * wait until the page is copied. Unallocated pages are only marked copied.
+ */
+void Snapshot::savePage(size_t block, size_t page) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    volatile uint8_t *state = &pageStates[block * (FreeList::BlockSize /
+            PageSize) + page];
+    if (!CAS(state, PagePending, PageCopying)) {
+        while (*state != PageCopied) { }
+        return;
+    }
+
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    bitmap += block * 8; // 2 MB = 512 x 4 KB
+    char *src = (char *)GlobalAlloc::BaseAddress + block * FreeList::BlockSize +
+        page * PageSize;
+    if (((bitmap[page >> 6] >> (page & 63)) & 1) && !zeroPage(src)) {
+        block_index_t *entry = (block_index_t *)((char *)view +
+                view->index_offset) + block;
+        char *dst = (char *)view + view->data_offset + entry->offset +
+            pageSlot(bitmap, page) * PageSize;
+        nonTemporalPageCopy(dst, src);
+        _mm_sfence();
+        __sync_fetch_and_or(&entry->pages[page >> 6], (uint64_t)1 << (page & 63));
+    }
+    __sync_synchronize();
+    *state = PageCopied;
+}
+
+// Allocated pages of a block before the page (slot of the page)
+size_t Snapshot::pageSlot(const uint64_t *bitmap, size_t page) {
+    size_t slot = 0;
+    for (size_t i = 0; i < (page >> 6); i++) {
+        slot += __builtin_popcountll(bitmap[i]);
+    }
+    return slot + __builtin_popcountll(bitmap[page >> 6] &
+            (((uint64_t)1 << (page & 63)) - 1));
+}
+
+void Snapshot::unblockNewTransactions() {
     NVManager &nvm = NVManager::getInstance();
     for (auto it = nvm.objects.begin(); it != nvm.objects.end(); it++) {
         it->second->log->snapshot_lock = 0;
@@ -431,155 +1360,559 @@ void Snapshot::unblockNewTransactions() {
     pthread_mutex_unlock(nvm.ckptLock());
 }
 
+/*
+ * Reserves the block index and the data region (up to allocatedBlocks)
+ * The data region is sparse, only the slots of stored (non-zero) pages are
+ * written, and the file is truncated to them once the snapshot is taken.
+ */
 void Snapshot::extendSnapshot(size_t allocatedBlocks) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
     size_t snapshotSize = view->size;
+    size_t indexOffset = (snapshotSize + PageSize - 1) & ~(PageSize - 1);
+    size_t indexSize = allocatedBlocks * sizeof(block_index_t);
+    indexSize = (indexSize + PageSize - 1) & ~(PageSize - 1);
     size_t dataSize = allocatedBlocks * FreeList::BlockSize;
-    assert(munmap(view, snapshotSize) == 0);
-    assert(fallocate(fd, 0, snapshotSize, dataSize) == 0);
-    snapshotSize += dataSize;
+    assert(munmap(view, mappedSize) == 0);
+    snapshotSize = indexOffset + indexSize + dataSize;
+    assert(ftruncate(fd, snapshotSize) == 0);
+    if (indexSize > 0) {
+        assert(fallocate(fd, 0, indexOffset, indexSize) == 0);
+    }
     // TODO support for huge-pages
     view = (snapshot_header_t *)mmap(NULL, snapshotSize,
             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(view != NULL);
+    assert(view != MAP_FAILED);
+    mappedSize = snapshotSize;
 
-    uintptr_t ptr = (uintptr_t)view + view->data_offset;
-    ptr = ptr & ~(4096 - 1);
-    assert(madvise((void *)ptr, dataSize, MADV_WILLNEED) == 0);
+    view->index_offset = indexOffset;
+    view->data_offset = indexOffset + indexSize;
     view->size = snapshotSize;
 }
 
 void Snapshot::saveModifiedPages(size_t allocatedBlocks) {
-
-    // Calculate shares for each snapshot thread
-    assert(allocatedBlocks % SnapshotThreads == 0);
-    size_t shareLength = allocatedBlocks / SnapshotThreads;
-
-    // Start snapshot threads
-    off_t threadIndex = 0;
-    vector<std::thread *> threads;
-    for (size_t i = 0; i < SnapshotThreads; i++) {
-        threads.push_back(new thread(&Snapshot::snapshotWorker, this,
-                    threadIndex, shareLength));
-        threadIndex += shareLength;
-    }
-
-    // Wait for completion
-    for (size_t i = 0; i < SnapshotThreads; i++) {
-        std::thread *thread = threads.back();
-        thread->join();
-        threads.pop_back();
-        delete thread;
+    // Blocks still to be saved (fault handlers may save some meanwhile)
+    std::vector<size_t> blocks;
+    for (size_t b = 0; b < allocatedBlocks; b++) {
+        if (context[b] == UsedHugePage) blocks.push_back(b);
     }
+    parallelForBlocks(blocks, &Snapshot::snapshotBlock);
 }
 
 void Snapshot::cleanEnvironment() {
     free(context);
     context = NULL;
+    free((void *)pageStates);
+    pageStates = NULL;
     size_t snapshotSize = view->size;
-    munmap(view, snapshotSize);
+    munmap(view, mappedSize);
+    // Drops the unused part of the data region (see extendSnapshot)
+    if (mappedSize > snapshotSize) assert(ftruncate(fd, snapshotSize) == 0);
     close(fd);
+    mappedSize = 0;
     view = NULL;
     fd = 0;
+
+    for (size_t i = 0; i < chain.size(); i++) {
+        munmap(chain[i], chain[i]->size);
+        close(chainFds[i]);
+    }
+    chain.clear();
+    chainFds.clear();
 }
 
-void Snapshot::loadSnapshot(uint32_t id) {
-    experimental::filesystem::path poolPath = rootPath;
-    poolPath /= "snapshot.";
-    poolPath += std::to_string(id);
+snapshot_header_t *Snapshot::mapSnapshot(uint32_t id, int *snapshotFd) {
+    experimental::filesystem::path poolPath = snapshotPath(id);
     PRINT("Loading from snapshot: %s\n", poolPath.c_str());
-    fd = open(poolPath.c_str(), O_RDONLY, 0666);
-    assert(fd > 0);
+    *snapshotFd = open(poolPath.c_str(), O_RDONLY, 0666);
+    assert(*snapshotFd > 0);
+
+    snapshot_header_t *header = (snapshot_header_t *)mmap(NULL,
+            sizeof(snapshot_header_t), PROT_READ, MAP_SHARED, *snapshotFd, 0);
+    assert(header != NULL);
+    size_t snapshotSize = header->size;
+    munmap(header, sizeof(snapshot_header_t));
+
+    header = (snapshot_header_t *)mmap(NULL, snapshotSize,
+            PROT_READ, MAP_SHARED, *snapshotFd, 0);
+    assert(header != NULL);
+    PRINT("Mapped snapshot: %zu bytes at %p\n", snapshotSize, header);
+    return header;
+}
 
-    view = (snapshot_header_t *)mmap(NULL, sizeof(snapshot_header_t),
-            PROT_READ, MAP_SHARED, fd, 0);
-    assert(view != NULL);
-    size_t snapshotSize = view->size;
-    munmap(view, sizeof(snapshot_header_t));
+/*
+ * Maps the snapshot, and the chain of its parents if it is a delta
+ * (chain[0] is the parent of the snapshot, chain.back() a full snapshot)
+ */
+void Snapshot::loadSnapshot(uint32_t id) {
+    view = mapSnapshot(id, &fd);
+    mappedSize = view->size;
+    if (view->bitmap_offset == LegacyHeaderSize) return;
+
+    uint32_t parentID = view->parent_id;
+    while (parentID != 0) {
+        int parentFd;
+        snapshot_header_t *header = mapSnapshot(parentID, &parentFd);
+        assert(header->time != 0); // parents are complete snapshots
+        chain.push_back(header);
+        chainFds.push_back(parentFd);
+        parentID = header->parent_id;
+    }
+}
 
-    view = (snapshot_header_t *)mmap(NULL, snapshotSize,
-            PROT_READ, MAP_SHARED, fd, 0);
-    assert(view != NULL);
-    PRINT("Mapped snapshot: %zu bytes at %p\n", snapshotSize, view);
+// Newest snapshot storing a block in the chain of snapshots
+snapshot_header_t *Snapshot::sourceSnapshot(size_t block) {
+    snapshot_header_t *header = view;
+    for (size_t i = 0; i < chain.size(); i++) {
+        if (storesBlock(header, block)) break;
+        header = chain[i];
+    }
+    return header;
 }
 
-// TODO merge the following with snapshotWorker
-void Snapshot::restoreWorker(off_t offset, size_t length) {
+// Newest copy of a block (snapshots without a block index)
+char *Snapshot::blockSource(size_t block) {
+    snapshot_header_t *header = sourceSnapshot(block);
+    assert(!isSparse(header));
+    return (char *)header + header->data_offset + block * FreeList::BlockSize;
+}
 
-    GlobalAlloc *ga = GlobalAlloc::getInstance();
-    const size_t PagesPerBlock = FreeList::BlockSize / ga->BitmapGranularity;
-    const size_t BitmapStepSize = PagesPerBlock / 64;
+bool Snapshot::isSparse(const snapshot_header_t *header) const {
+    return header->bitmap_offset != LegacyHeaderSize && header->index_offset != 0;
+}
 
-    char *src = (char *)view + view->data_offset + offset * FreeList::BlockSize;
-    char *dst = (char *)(ga->BaseAddress + offset * FreeList::BlockSize);
+/*
+ * Copy of a 4 KB page of a block in the snapshot, NULL if the page is not
+ * stored (zero pages of sparse snapshots). Slots are assigned to the pages
+ * allocated at the time of the snapshot, in address order.
+ */
+const char *Snapshot::pageSource(const snapshot_header_t *header,
+        size_t block, size_t page) {
+    const char *data = (const char *)header + header->data_offset;
+    if (!isSparse(header)) {
+        return data + block * FreeList::BlockSize +
+            page * GlobalAlloc::BitmapGranularity;
+    }
+
+    size_t indexedBlocks = (header->data_offset - header->index_offset) /
+        sizeof(block_index_t);
+    if (block >= indexedBlocks) return NULL;
+    const block_index_t *entry = (const block_index_t *)((const char *)header +
+            header->index_offset) + block;
+    if (((entry->pages[page >> 6] >> (page & 63)) & 1) == 0) return NULL;
+
+    const uint64_t *bitmap = (const uint64_t *)((const char *)header +
+            header->bitmap_offset) + block * 8;
+    return data + entry->offset +
+        pageSlot(bitmap, page) * GlobalAlloc::BitmapGranularity;
+}
+
+/*
+ * Copies the allocated pages of a block from the newest snapshot storing
+ * it. Pages that are not stored are only cleared if dst is not zeroed.
+ */
+void Snapshot::loadBlock(char *dst, size_t block, bool zeroed) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    snapshot_header_t *header = sourceSnapshot(block);
     uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
-    bitmap += offset * BitmapStepSize;
+    bitmap += block * 8; // 2 MB = 512 x 4 KB
 
-    for (size_t sp = 0; sp < length; sp++) {
-        // Skip over unused super-pages (blocks)
-        if (bitmap[0] == 0 && bitmap[1] == 0 &&
-            bitmap[2] == 0 && bitmap[3] == 0 &&
-            bitmap[4] == 0 && bitmap[5] == 0 &&
-            bitmap[6] == 0 && bitmap[7] == 0) {
+    for (size_t i = 0; i < 8; i++) {
+        uint64_t bit = bitmap[i];
+        for (size_t p = 0; p < 64; p++, dst += PageSize, bit >>= 1) {
+            const char *src = NULL;
+            if (bit & 0x0000000000000001) {
+                src = pageSource(header, block, (i << 6) + p);
+            }
+            if (src != NULL) nonTemporalPageCopy(dst, (char *)src);
+            else if (!zeroed) memset(dst, 0, PageSize);
+        }
+    }
+}
+
+// The restored heap is freshly mapped (zeroed)
+void Snapshot::restoreBlock(size_t block) {
+    char *dst = (char *)(GlobalAlloc::BaseAddress + block * FreeList::BlockSize);
+    loadBlock(dst, block, true);
+}
 
-            bitmap += 8;
-            src = src + FreeList::BlockSize;
-            dst = dst + FreeList::BlockSize;
+void Snapshot::restoreBlocksParallel(const std::vector<size_t> &blocks) {
+    parallelForBlocks(blocks, &Snapshot::restoreBlock);
+}
+
+// Descriptor of a mapped snapshot (the loaded one or one of its parents)
+int Snapshot::sourceFd(const snapshot_header_t *header) {
+    if (header == view) return fd;
+    for (size_t i = 0; i < chain.size(); i++) {
+        if (chain[i] == header) return chainFds[i];
+    }
+    assert(false);
+    return -1;
+}
+
+/*
+ * Maps the stored pages of a block from the snapshot file instead of
+ * copying them (SNAPSHOT_MAP_RESTORE). Mappings are private, so pages are
+ * read from the file until they are first written, then copied to memory
+ * by the kernel. Pages stored in consecutive slots are mapped at once,
+ * pages of short runs are copied (so sparse blocks do not exhaust the
+ * mappings of the process). Huge-page heaps are only replaced by whole
+ * blocks, blocks with zero or unallocated pages are copied.
+ */
+void Snapshot::mapBlock(size_t block) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    const size_t PagesPerBlock = FreeList::BlockSize / PageSize;
+#ifdef SNAPSHOT_PAGE_COW
+    const size_t MinRunLength = 16; // pages (64 KB)
+#else
+    const size_t MinRunLength = PagesPerBlock;
+#endif
+    const size_t MaxMappedRuns = 32768; // below vm.max_map_count
+    const snapshot_header_t *header = sourceSnapshot(block);
+    const uint64_t *bitmap = (const uint64_t *)((char *)view +
+            view->bitmap_offset) + block * 8;
+    char *dst = (char *)(GlobalAlloc::BaseAddress + block * FreeList::BlockSize);
+
+    size_t p = 0;
+    while (p < PagesPerBlock) {
+        const char *src = NULL;
+        if ((bitmap[p >> 6] >> (p & 63)) & 1) src = pageSource(header, block, p);
+        if (src == NULL) { // left zeroed
+            p++;
             continue;
         }
 
-        for (size_t b = 0; b < PagesPerBlock; b += 64) {
-            uint64_t bit = *bitmap;
-            for (off_t p = 0; p < 64; p++) {
-                if (bit & 0x0000000000000001) {
-                    nonTemporalPageCopy(dst, src);
-                }
-                else {
-                    nonTemporalCacheLineCopy(dst, src);
-                }
-                src = src + GlobalAlloc::BitmapGranularity;
-                dst = dst + GlobalAlloc::BitmapGranularity;
-                bit >>= 1;
+        // Pages following each other in the file
+        size_t run = 1;
+        while (p + run < PagesPerBlock &&
+                ((bitmap[(p + run) >> 6] >> ((p + run) & 63)) & 1) &&
+                pageSource(header, block, p + run) == src + run * PageSize) {
+            run++;
+        }
+
+        off_t offset = src - (const char *)header;
+        if (run >= MinRunLength && offset % PageSize == 0 &&
+                __sync_fetch_and_add(&mappedRuns, 1) < MaxMappedRuns) {
+            void *addr = mmap(dst + p * PageSize, run * PageSize,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                    sourceFd(header), offset);
+            assert(addr == dst + p * PageSize);
+        }
+        else {
+            for (size_t i = 0; i < run; i++) {
+                nonTemporalPageCopy(dst + (p + i) * PageSize,
+                        (char *)src + i * PageSize);
             }
-            bitmap++;
         }
+        p += run;
     }
 }
 
-void Snapshot::load(uint32_t id, NVManager *manager) {
+/*
+ * Assigns allocated blocks to the objects owning them (see GlobalAlloc),
+ * and restores blocks that are not owned by any object being restored.
+ * Blocks holding a persistent object owned by another object are restored
+ * here too, since the manager updates the object (e.g., its vtable) right
+ * after restoring the blocks it owns.
+ */
+void Snapshot::prepareObjectRestores() {
+    GlobalAlloc *ga = GlobalAlloc::getInstance();
+    const size_t allocatedBlocks = ga->allocatedBlocks();
+
+    std::map<uint32_t, object_restore_t *> owners;
+    std::vector<bool> shared(allocatedBlocks, false);
+    for (auto it = restores.begin(); it != restores.end(); ++it) {
+        uint32_t owner = ga->ownerID(it->second.alloc);
+        owners[owner] = &it->second;
+        size_t block = ((uintptr_t)it->first - GlobalAlloc::BaseAddress) /
+            FreeList::BlockSize;
+        if (block < allocatedBlocks && ga->blockOwner(block) != owner) {
+            shared[block] = true;
+        }
+    }
 
-    loadSnapshot(id);
+    std::vector<size_t> common;
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    for (size_t b = 0; b < allocatedBlocks; b++, bitmap += 8) {
+        // Skip over unused super-pages (blocks)
+        if (bitmap[0] == 0 && bitmap[1] == 0 &&
+            bitmap[2] == 0 && bitmap[3] == 0 &&
+            bitmap[4] == 0 && bitmap[5] == 0 &&
+            bitmap[6] == 0 && bitmap[7] == 0) continue;
 
-    // Global allocator and the bitmap
-    const char *bitmap = (const char *)((char *)view + view->bitmap_offset);
-    const char *gaCkpt = (const char *)((char *)view + view->global_offset);
-    GlobalAlloc *ga = new GlobalAlloc(gaCkpt, bitmap);
+        auto owner = owners.find(ga->blockOwner(b));
+        if (shared[b] || owner == owners.end()) common.push_back(b);
+        else owner->second->blocks.push_back(b);
+    }
 
-    // Data
-    const char *data = (const char *)((char *)view + view->data_offset);
-    size_t dataSize = view->size - (size_t)view->data_offset;
+    restoreBlocksParallel(common);
+    PRINT("Restored %zu shared blocks, %zu objects are restored on demand\n",
+            common.size(), restores.size());
+}
 
-    // TODO replace this with on-demand paging using userfaultfd(2)
-    // Start restore threads
-    size_t shareLength = ga->allocatedBlocks() / SnapshotThreads;
-    off_t threadIndex = 0;
+/*
+ * Restores the blocks owned by the object and its allocator's free blocks
+ * Called (once per object) by NVManager before recovering the object.
+ */
+void Snapshot::restoreObject(PersistentObject *object) {
+    auto it = restores.find(object);
+    if (it == restores.end()) return;
+
+    object_restore_t &restore = it->second;
+    restoreBlocksParallel(restore.blocks);
+    restore.alloc->releaseFreeBlocks();
+    object->last_played_commit_id = restore.last_commit;
+}
+
+/*
+ * Registers the restored heap with userfaultfd(2)
+ * The first access to a block faults, and the fault handler copies the
+ * block from the snapshot (pageInBlock), while background threads copy
+ * the remaining blocks (fillWorker). Returns false if userfaultfd is not
+ * available (e.g., not permitted), the heap is then restored eagerly.
+ */
+bool Snapshot::startPaging(size_t allocatedBlocks) {
+#if defined(SNAPSHOT_PAGE_COW) && defined(SNAPSHOT_FORK)
+    const uint64_t HeapFeature = 0; // private anonymous memory
+#elif defined(SNAPSHOT_PAGE_COW)
+    const uint64_t HeapFeature = UFFD_FEATURE_MISSING_SHMEM; // 4 KB pages
+#else
+    const uint64_t HeapFeature = UFFD_FEATURE_MISSING_HUGETLBFS;
+#endif
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        PRINT("userfaultfd is not available (errno = %d)\n", errno);
+        return false;
+    }
+
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = GlobalAlloc::BaseAddress;
+    reg.range.len = allocatedBlocks * FreeList::BlockSize;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(uffd, UFFDIO_API, &api) != 0 ||
+            (api.features & HeapFeature) != HeapFeature ||
+            ioctl(uffd, UFFDIO_REGISTER, &reg) != 0 ||
+            (reg.ioctls & ((uint64_t)1 << _UFFDIO_COPY)) == 0) {
+        PRINT("userfaultfd does not support the heap (errno = %d)\n", errno);
+        close(uffd);
+        uffd = -1;
+        return false;
+    }
+
+    pagedBlocks = allocatedBlocks;
+    blockStates = (volatile uint8_t *)calloc(allocatedBlocks, sizeof(uint8_t));
+    zeroBlock = (char *)aligned_alloc(FreeList::BlockSize, FreeList::BlockSize);
+    memset(zeroBlock, 0, FreeList::BlockSize);
+    assert(pipe(stopPipe) == 0);
+    faultThread = new thread(&Snapshot::faultWorker, this);
+    fillThread = new thread(&Snapshot::fillWorker, this);
+    PRINT("Paging in %zu blocks from the snapshot\n", allocatedBlocks);
+    return true;
+}
+
+/*
+ * Copies a block from the snapshot into the heap (at most once)
+ * Blocks of sparse snapshots are assembled in the caller's buffer first.
+ * UFFDIO_COPY wakes up the threads waiting on the block. Returns false
+ * if the block is copied by another thread.
+ */
+bool Snapshot::pageInBlock(size_t block, char *buffer) {
+    if (!CAS(&blockStates[block], BlockMissing, BlockCopying)) return false;
+
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    bitmap += block * 8; // 2 MB = 64 x 4 KB
+    bool used = false;
+    for (size_t i = 0; i < 8; i++) used = used || bitmap[i] != 0;
+
+    // Unused blocks are zero-filled, same as the eager restore
+    struct uffdio_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.dst = GlobalAlloc::BaseAddress + block * FreeList::BlockSize;
+    copy.src = (uintptr_t)zeroBlock;
+    if (used && isSparse(sourceSnapshot(block))) {
+        loadBlock(buffer, block, false);
+        _mm_sfence();
+        copy.src = (uintptr_t)buffer;
+    }
+    else if (used) copy.src = (uintptr_t)blockSource(block);
+    copy.len = FreeList::BlockSize;
+    int ret;
+    while ((ret = ioctl(uffd, UFFDIO_COPY, &copy)) != 0 && errno == EAGAIN) {
+        copy.copy = 0;
+    }
+
+    // Free blocks are populated by GlobalAlloc (free-list headers)
+    if (ret != 0) {
+        assert(errno == EEXIST);
+        struct uffdio_range range = { copy.dst, copy.len };
+        ioctl(uffd, UFFDIO_WAKE, &range);
+    }
+    blockStates[block] = BlockCopied;
+    return true;
+}
+
+void Snapshot::faultWorker() {
+    char *buffer = (char *)aligned_alloc(FreeList::BlockSize,
+            FreeList::BlockSize);
+    struct pollfd fds[2];
+    fds[0].fd = uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopPipe[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+        if (fds[1].revents != 0) break;
+
+        struct uffd_msg msg;
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg)) continue;
+        if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+
+        uintptr_t addr = msg.arg.pagefault.address;
+        size_t block = (addr - GlobalAlloc::BaseAddress) / FreeList::BlockSize;
+        if (!pageInBlock(block, buffer) && blockStates[block] == BlockCopied) {
+            // Copied after the fault was reported
+            struct uffdio_range range;
+            range.start = addr & ~(FreeList::BlockSize - 1);
+            range.len = FreeList::BlockSize;
+            ioctl(uffd, UFFDIO_WAKE, &range);
+        }
+    }
+    free(buffer);
+}
+
+void Snapshot::fillBlocks(size_t offset, size_t length) {
+    char *buffer = (char *)aligned_alloc(FreeList::BlockSize,
+            FreeList::BlockSize);
+    for (size_t b = offset; b < offset + length; b++) {
+        uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+        bitmap += b * 8;
+        // Unused blocks are only paged in when accessed
+        if (bitmap[0] == 0 && bitmap[1] == 0 &&
+            bitmap[2] == 0 && bitmap[3] == 0 &&
+            bitmap[4] == 0 && bitmap[5] == 0 &&
+            bitmap[6] == 0 && bitmap[7] == 0) continue;
+        pageInBlock(b, buffer);
+    }
+    free(buffer);
+}
+
+/*
+ * Copies the blocks that were not accessed yet, then unregisters the
+ * heap and stops the fault handler
+ */
+void Snapshot::fillWorker() {
+    struct timespec t1, t2;
+    clock_gettime(CLOCK_REALTIME, &t1);
+
+    size_t shareLength = pagedBlocks / SnapshotThreads;
+    size_t offset = 0;
     vector<std::thread *> threads;
-    for (size_t i = 0; i < SnapshotThreads; i++) {
-        threads.push_back(new thread(&Snapshot::restoreWorker, this,
-                    threadIndex, shareLength));
-        threadIndex += shareLength;
+    for (size_t i = 1; i < SnapshotThreads; i++) {
+        threads.push_back(new thread(&Snapshot::fillBlocks, this,
+                    offset, shareLength));
+        offset += shareLength;
     }
+    fillBlocks(offset, pagedBlocks - offset);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+
+    // Unused blocks that were never accessed are mapped by the kernel
+    struct uffdio_range range;
+    range.start = GlobalAlloc::BaseAddress;
+    range.len = pagedBlocks * FreeList::BlockSize;
+    assert(ioctl(uffd, UFFDIO_UNREGISTER, &range) == 0);
+    assert(write(stopPipe[1], "", 1) == 1);
+    faultThread->join();
+    delete faultThread;
+    faultThread = NULL;
+
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    close(uffd);
+    uffd = -1;
+    free((void *)blockStates);
+    blockStates = NULL;
+    free(zeroBlock);
+    zeroBlock = NULL;
 
-    // Wait for completion
-    for (size_t i = 0; i < SnapshotThreads; i++) {
-        std::thread *thread = threads.back();
-        thread->join();
-        threads.pop_back();
-        delete thread;
+    clock_gettime(CLOCK_REALTIME, &t2);
+    uint64_t latency = (t2.tv_sec - t1.tv_sec) * 1E9;
+    latency += (t2.tv_nsec - t1.tv_nsec);
+    PRINT("Finished paging in %zu blocks (%.2f ms)\n", pagedBlocks,
+            (double)latency / 1E6);
+}
+
+/*
+ * Loads the snapshot
+ * If the snapshot records block owners and a manager is provided, only
+ * blocks without an owner are restored here. Blocks owned by persistent
+ * objects are restored one object at a time (restoreObject), so recovery
+ * threads can replay the log of an object as soon as its blocks are in
+ * place, instead of waiting for the whole heap.
+ * With UFFD_RESTORE, the heap is paged in on demand instead (startPaging),
+ * so load returns without copying any blocks.
+ * With SNAPSHOT_MAP_RESTORE, the heap is mapped from the snapshot files
+ * (mapBlock), pages are only copied when they are first written.
+ * Snapshots that are still being restored once loaded do not block new
+ * snapshots (see anyActiveSnapshot).
+ */
+void Snapshot::load(uint32_t id, NVManager *manager) {
+    loadSnapshot(id);
+    restore(manager, false);
+}
+
+/*
+ * Restores the allocators and objects of the mapped snapshot, and the heap
+ * unless it is resident (heap image, see loadImage)
+ */
+void Snapshot::restore(NVManager *manager, bool resident) {
+    const bool legacy = view->bitmap_offset == LegacyHeaderSize;
+#ifdef UFFD_RESTORE
+    bool paging = manager != NULL && !resident;
+#else
+    bool paging = false;
+#endif
+#ifdef SNAPSHOT_MAP_RESTORE
+    bool mapping = !legacy;
+#else
+    bool mapping = false;
+#endif
+
+    // Global allocator, the bitmap and block owners
+    const char *bitmap = (const char *)((char *)view + view->bitmap_offset);
+    const char *gaCkpt = (const char *)((char *)view + view->global_offset);
+    const char *owners = legacy ? NULL :
+        (const char *)((char *)view + view->owners_offset);
+    GlobalAlloc *ga = new GlobalAlloc(gaCkpt, bitmap, owners,
+            !paging && !mapping && !resident);
+    if (paging) paging = startPaging(ga->allocatedBlocks());
+
+    if (!paging && !resident && (manager == NULL || legacy || mapping)) {
+        // Restore the used blocks (unused ones are zeroed by the kernel)
+        const uint64_t *words = (const uint64_t *)bitmap;
+        std::vector<size_t> blocks;
+        for (size_t b = 0; b < ga->allocatedBlocks(); b++, words += 8) {
+            if (words[0] == 0 && words[1] == 0 &&
+                words[2] == 0 && words[3] == 0 &&
+                words[4] == 0 && words[5] == 0 &&
+                words[6] == 0 && words[7] == 0) continue;
+            blocks.push_back(b);
+        }
+        if (mapping) parallelForBlocks(blocks, &Snapshot::mapBlock);
+        else restoreBlocksParallel(blocks);
+        PRINT("Finished restoring pages from snapshot\n");
     }
-    PRINT("Finished restoring pages from snapshot\n");
 
     // Persistent objects and allocators
-    std::map<std::string, uint64_t> lastCommitIDs;
     char *objCkpt = (char *)view + view->alloc_offset;
     for (uint32_t i = 0; i < view->object_count; i++) {
         uint64_t lastCommit = *((uint64_t *)objCkpt);
@@ -598,40 +1931,433 @@ void Snapshot::load(uint32_t id, NVManager *manager) {
         ga->restoreAllocator(alloc);
         objCkpt += alloc->snapshotSize();
 
+        object_restore_t &restore = restores[(PersistentObject *)objectPtr];
+        restore.alloc = alloc;
+        restore.last_commit = lastCommit;
         if (manager != NULL) {
-            char uuid_str[64];
-            uuid_unparse(uuid, uuid_str);
-            manager->objects.insert(pair<string, PersistentObject *>(
-                        uuid_str, (PersistentObject *)objectPtr));
-            lastCommitIDs.insert(pair<string, uint64_t>(uuid_str, lastCommit));
-            RecoveryContext::getInstance().pushLogHeadOffset(uuid_str, logTail);
+            manager->objects.insert(uuid, (PersistentObject *)objectPtr);
+            RecoveryContext::getInstance().pushLogHeadOffset(uuid, logTail);
         }
     }
     PRINT("Finished restoring allocators for %d object(s)\n", view->object_count);
 
-    // Fix unused huge-pages (free blocks)
-    objCkpt = (char *)view + view->alloc_offset;
-    for (uint32_t i = 0; i < view->object_count; i++) {
-        objCkpt += sizeof(uint64_t); // last commit
-        objCkpt += sizeof(uint64_t); // log tail
-        objCkpt += sizeof(uintptr_t); // object pointer
+    if (!paging && !mapping && !resident && manager != NULL && !legacy) {
+        prepareObjectRestores();
+        instance = NULL;
+        return; // keep the snapshot mapped, objects are restored on demand
+    }
 
-        uuid_t uuid;
-        memcpy(uuid, objCkpt, sizeof(uuid_t));
-        ObjectAlloc *alloc = ga->findAllocator(uuid);
-        assert(alloc != NULL);
-        alloc->releaseFreeBlocks();
-        objCkpt += alloc->snapshotSize();
+    // Fix unused huge-pages (free blocks) and reset last played commit IDs
+    for (auto it = restores.begin(); it != restores.end(); ++it) {
+        it->second.alloc->releaseFreeBlocks();
+        if (manager != NULL) {
+            it->first->last_played_commit_id = it->second.last_commit;
+        }
+    }
+    restores.clear();
+    if (paging) {
+        instance = NULL;
+        return; // keep the snapshot mapped until all blocks are paged in
+    }
+    cleanEnvironment();
+}
+
+/*
+ * Saves the allocation tables of the heap at a clean shutdown (HEAP_FILE)
+ * The heap stays in its file, the next process maps it back (loadImage)
+ * instead of restoring the latest snapshot, as long as the machine is not
+ * rebooted. The image is a snapshot without data, stored next to the heap
+ * file (in memory, so both are lost together).
+ */
+bool Snapshot::saveImage(NVManager *manager) {
+#ifdef HEAP_FILE
+    nvm = manager;
+    prepareSnapshot(HEAP_FILE ".tables");
+    view->identifier = lastSnapshotID(); // no snapshots after the image
+    saveAllocationTables();
+    __sync_synchronize();
+    view->time = time(NULL); // complete
+    cleanEnvironment();
+    nvm = NULL;
+    PRINT("Saved the heap image for a warm restart\n");
+    return true;
+#else
+    (void)manager;
+    return false;
+#endif
+}
+
+/*
+ * Maps back the heap left in HEAP_FILE by a clean shutdown (warm restart)
+ * The image is only used if no snapshot was taken since and it has the
+ * objects of the catalog. It is invalidated before the heap is used, a
+ * crash afterwards restores the latest snapshot instead. Objects resume
+ * from the log tails saved at shutdown. Returns false (nothing is loaded)
+ * without a valid image.
+ */
+bool Snapshot::loadImage(NVManager *manager,
+        const std::set<std::string> &catalog) {
+#ifdef HEAP_FILE
+    int imageFd = open(HEAP_FILE ".tables", O_RDWR);
+    if (imageFd < 0) return false;
+    struct stat st;
+    snapshot_header_t *image = (snapshot_header_t *)MAP_FAILED;
+    if (fstat(imageFd, &st) == 0 && st.st_size >= (off_t)sizeof(*image)) {
+        image = (snapshot_header_t *)mmap(NULL, st.st_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0);
+    }
+    bool valid = image != MAP_FAILED && image->time != 0 &&
+        image->size == (uint64_t)st.st_size &&
+        image->identifier == lastSnapshotID() &&
+        image->object_count == catalog.size();
+
+    const char *entry = valid ? (const char *)image + image->alloc_offset : NULL;
+    for (uint32_t i = 0; valid && i < image->object_count; i++) {
+        const uint64_t *fields = (const uint64_t *)entry;
+        char uuid[64];
+        uuid_unparse((const unsigned char *)&fields[3], uuid);
+        valid = catalog.count(uuid) > 0;
+        entry += allocationEntrySize(fields);
+        valid = valid && entry <= (const char *)image + image->data_offset;
+    }
+    if (!valid) {
+        PRINT("No valid heap image, restoring from the snapshot\n");
+        if (image != MAP_FAILED) munmap(image, st.st_size);
+        close(imageFd);
+        return false;
+    }
+
+    image->time = 0; // used once, even if this process crashes
+    assert(msync(image, sizeof(*image), MS_SYNC) == 0);
+    view = image;
+    fd = imageFd;
+    mappedSize = st.st_size;
+    assert(GlobalAlloc::openHeapFile(true));
+    restore(manager, true);
+    PRINT("Mapped back the heap image (warm restart)\n");
+    return true;
+#else
+    (void)manager;
+    (void)catalog;
+    return false;
+#endif
+}
+
+/*
+ * Rewrites a delta as a full snapshot with the same contents
+ * The full snapshot is written to snapshot.N.merge and renamed over
+ * snapshot.N once it is complete, so a crash leaves one of them intact.
+ * Only snapshot files are read, no transactions or snapshots are blocked.
+ * Copies are throttled to bytesPerSecond (0 = no limit). Returns false if
+ * the snapshot is not a (complete) delta.
+ */
+bool Snapshot::merge(uint32_t id, uint64_t bytesPerSecond) {
+    loadSnapshot(id);
+    if (chain.empty() || view->time == 0) {
+        cleanEnvironment();
+        return false;
+    }
+
+    experimental::filesystem::path poolPath = snapshotPath(id);
+    experimental::filesystem::path mergePath = poolPath;
+    mergePath += ".merge";
+    int mergeFd = open(mergePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    assert(mergeFd > 0);
+
+    // Same allocation tables, the merged snapshot is sparse
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    size_t tablesSize = isSparse(view) ? view->index_offset : view->data_offset;
+    size_t dataBlocks = isSparse(view) ?
+        (view->data_offset - view->index_offset) / sizeof(block_index_t) :
+        (view->size - view->data_offset) / FreeList::BlockSize;
+    size_t indexOffset = (tablesSize + PageSize - 1) & ~(PageSize - 1);
+    size_t indexSize = dataBlocks * sizeof(block_index_t);
+    indexSize = (indexSize + PageSize - 1) & ~(PageSize - 1);
+
+    // All allocated blocks are stored
+    std::vector<size_t> pages(dataBlocks, 0);
+    size_t dataSize = 0;
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    for (size_t b = 0; b < dataBlocks; b++, bitmap += 8) {
+        for (size_t i = 0; i < 8; i++) pages[b] += __builtin_popcountll(bitmap[i]);
+        dataSize += pages[b] * PageSize;
+    }
+
+    size_t snapshotSize = indexOffset + indexSize + dataSize;
+    assert(ftruncate(mergeFd, snapshotSize) == 0);
+    snapshot_header_t *merged = (snapshot_header_t *)mmap(NULL, snapshotSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED, mergeFd, 0);
+    assert(merged != MAP_FAILED);
+    memcpy(merged, view, tablesSize);
+    merged->time = 0;
+    merged->size = snapshotSize;
+    merged->parent_id = 0;
+    merged->chain_length = 0;
+    merged->index_offset = indexOffset;
+    merged->data_offset = indexOffset + indexSize;
+    uint64_t *blocks = (uint64_t *)((char *)merged + merged->blocks_offset);
+    memset(blocks, 0, blockMapSize());
+    block_index_t *index = (block_index_t *)((char *)merged + indexOffset);
+    size_t storedSize = 0;
+    for (size_t b = 0; b < dataBlocks; b++) {
+        if (pages[b] == 0) continue;
+        blocks[b >> 6] |= (uint64_t)1 << (b & 63);
+        index[b].offset = storedSize;
+        storedSize += pages[b] * PageSize;
     }
 
+    // Copy blocks from the newest snapshot storing them
+    struct timespec t1, t2;
+    clock_gettime(CLOCK_REALTIME, &t1);
+    startThrottling(bytesPerSecond);
+    size_t shareLength = dataBlocks / SnapshotThreads;
+    size_t offset = 0;
+    vector<std::thread *> threads;
+    for (size_t i = 1; i < SnapshotThreads; i++) {
+        threads.push_back(new thread(&Snapshot::mergeWorker, this,
+                    (char *)merged, offset, shareLength));
+        offset += shareLength;
+    }
+    mergeWorker((char *)merged, offset, dataBlocks - offset);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    _mm_sfence();
+
+    // Complete the snapshot before replacing the delta
+    merged->time = view->time;
+    assert(msync(merged, snapshotSize, MS_SYNC) == 0);
+    munmap(merged, snapshotSize);
+    close(mergeFd);
+    PRINT("Merged %zu snapshot(s) into snapshot %u\n", chain.size() + 1, id);
     cleanEnvironment();
-    if (manager == NULL) return;
+    assert(rename(mergePath.c_str(), poolPath.c_str()) == 0);
+
+    clock_gettime(CLOCK_REALTIME, &t2);
+    uint64_t latency = (t2.tv_sec - t1.tv_sec) * 1E9;
+    latency += (t2.tv_nsec - t1.tv_nsec);
+    PRINT("Merge Time (ms)\t%.2f\n", (double)latency / 1E6);
+    return true;
+}
+
+void Snapshot::mergeWorker(char *merged, size_t offset, size_t length) {
+    const size_t PageSize = GlobalAlloc::BitmapGranularity;
+    const snapshot_header_t *header = (const snapshot_header_t *)merged;
+    uint64_t *bitmap = (uint64_t *)((char *)view + view->bitmap_offset);
+    bitmap += offset * 8; // 2 MB = 512 x 4 KB
+    block_index_t *index = (block_index_t *)(merged + header->index_offset);
+
+    for (size_t b = offset; b < offset + length; b++, bitmap += 8) {
+        if (!storesBlock(header, b)) continue;
+        snapshot_header_t *source = sourceSnapshot(b);
+        char *dst = merged + header->data_offset + index[b].offset;
+        size_t copied = 0;
+
+        // Copy allocated, non-zero 4 KB pages
+        for (size_t i = 0; i < 8; i++) {
+            uint64_t bit = bitmap[i];
+            uint64_t stored = 0;
+            for (size_t p = 0; p < 64; p++, bit >>= 1) {
+                if ((bit & 0x0000000000000001) == 0) continue;
+                const char *src = pageSource(source, b, (i << 6) + p);
+                if (src != NULL && !zeroPage(src)) {
+                    nonTemporalPageCopy(dst, (char *)src);
+                    stored |= (uint64_t)1 << p;
+                    copied += PageSize;
+                }
+                dst += PageSize;
+            }
+            _mm_stream_si64((long long *)&index[b].pages[i], stored);
+        }
+        if (copied > 0) throttle(copied);
+    }
+}
+
+static inline uint64_t monotonicTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void Snapshot::startThrottling(uint64_t bytesPerSecond, bool adaptive) {
+    this->adaptive = adaptive && bytesPerSecond > 0;
+    nextCopy = monotonicTime();
+    lastAdapted = nextCopy;
+    bandwidth = bytesPerSecond;
+    if (this->adaptive) Savitar_log_latency_sampling(true);
+}
+
+void Snapshot::stopThrottling() {
+    if (adaptive) Savitar_log_latency_sampling(false);
+    adaptive = false;
+    bandwidth = 0;
+}
+
+/*
+ * Sleeps while copies run ahead of the bandwidth budget
+ * Threads reserve their bytes in the bucket (which holds up to 10 ms of
+ * copies, so short pauses are not made up with bursts) and sleep until the
+ * reservation is due.
+ */
+void Snapshot::throttle(size_t bytes) {
+    const uint64_t Burst = 10000000; // 10 ms
+    uint64_t now = monotonicTime();
+    adaptBandwidth(now);
+    uint64_t rate = bandwidth;
+    if (rate == 0) return;
+
+    uint64_t cost = (uint64_t)((double)bytes * 1E9 / rate);
+    uint64_t due, next;
+    do {
+        due = nextCopy;
+        next = std::max(due, now - Burst) + cost;
+    } while (!CAS(&nextCopy, due, next));
+    if (next > now + Burst) usleep((next - now - Burst) / 1000);
+}
+
+/*
+ * Adjusts throttled snapshot copies to the foreground (AIMD, every 10 ms)
+ * Halves the bandwidth while the log-append P99 misses the target, probes
+ * for more (1/16 of the ceiling) otherwise.
+ */
+void Snapshot::adaptBandwidth(uint64_t now) {
+    const uint64_t Period = 10000000; // 10 ms
+    if (!adaptive) return;
+    uint64_t last = lastAdapted;
+    if (now < last + Period || !CAS(&lastAdapted, last, now)) return;
+
+    const uint64_t Ceiling = SNAPSHOT_COPY_BANDWIDTH;
+    uint64_t p99 = Savitar_log_latency(0.99);
+    uint64_t rate = bandwidth;
+    if (p99 > (uint64_t)SNAPSHOT_LATENCY_TARGET * 1000) {
+        rate = std::max(rate / 2, Ceiling / 64);
+    }
+    else {
+        rate = std::min(rate + Ceiling / 16, Ceiling);
+    }
+    if (rate != bandwidth) {
+        PRINT("Snapshot: copy bandwidth %zu MB/s (append P99 %zu ns)\n",
+                (size_t)(rate >> 20), (size_t)p99);
+    }
+    bandwidth = rate;
+}
+
+/*
+ * Deletes snapshots outside the retention policy
+ * Keeps the latest 'keep' complete snapshots, the ones taken in the last
+ * 'minutes' and the parents of kept deltas. Only snapshots older than the
+ * latest complete one are deleted (newer ones may still be written), so a
+ * snapshot is never deleted before a durable successor exists. Deltas are
+ * deleted before their parents and logs are only truncated afterwards, a
+ * crash never leaves a snapshot without the log entries it replays.
+ * Must not run concurrently with merges. Returns the number of deleted
+ * snapshots.
+ */
+size_t Snapshot::collectGarbage(uint32_t keep, uint64_t minutes,
+        NVManager *manager) {
+    if (keep == 0 && minutes == 0) return 0; // keep everything
+    uint32_t latest = lastCompleteSnapshotID();
+    if (latest == 0) return 0;
+
+    std::vector<uint32_t> snapshots;
+    getExistingSnapshots(snapshots);
+    std::vector<uint32_t> kept;
+    uint64_t since = time(NULL) - minutes * 60;
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        if (*it > latest) continue; // being written
+        snapshot_header_t header;
+        if (!readHeader(*it, &header) || header.time == 0) continue;
+        if (*it == latest || kept.size() < keep ||
+                (minutes > 0 && header.time >= since)) {
+            kept.push_back(*it);
+        }
+    }
+
+    // Deltas are restored on top of their parents
+    std::set<uint32_t> retained(kept.begin(), kept.end());
+    for (size_t i = 0; i < kept.size(); i++) {
+        uint32_t id = kept[i];
+        snapshot_header_t header;
+        while (readHeader(id, &header) &&
+                header.bitmap_offset != LegacyHeaderSize &&
+                header.parent_id != 0) {
+            id = header.parent_id;
+            retained.insert(id);
+        }
+    }
+
+    size_t deleted = 0;
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        if (*it >= latest || retained.count(*it) != 0) continue;
+        PRINT("Deleting snapshot: %s\n", snapshotPath(*it).c_str());
+        if (remove(snapshotPath(*it).c_str()) == 0) deleted++;
+    }
+
+    // Merges interrupted by a crash
+    for (auto &p : experimental::filesystem::directory_iterator(rootPath)) {
+        experimental::filesystem::path filePath = p.path();
+        if (filePath.extension() != ".merge") continue;
+        if (filePath.stem().stem() != "snapshot") continue;
+        remove(filePath.c_str());
+    }
+
+    if (manager != NULL) {
+        truncateLogs(std::vector<uint32_t>(retained.begin(), retained.end()),
+                manager);
+    }
+    return deleted;
+}
+
+/*
+ * Truncates logs up to the oldest log tail saved by the snapshots
+ * Objects missing from any of the snapshots keep their whole log, since
+ * restoring that snapshot replays them from the head.
+ */
+void Snapshot::truncateLogs(const std::vector<uint32_t> &snapshots,
+        NVManager *manager) {
+    typedef struct {
+        uint64_t head; // oldest log tail
+        size_t snapshots; // snapshots saving the object
+    } log_range_t;
+    UUIDMap<log_range_t> ranges;
+
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        int snapshotFd = open(snapshotPath(snapshots[i]).c_str(), O_RDONLY);
+        if (snapshotFd <= 0) return;
+        snapshot_header_t header;
+        size_t bytes = pread(snapshotFd, &header, sizeof(header), 0);
+        assert(bytes == sizeof(header));
+        off_t end = isSparse(&header) ? header.index_offset : header.data_offset;
+        std::vector<char> allocations(end - header.alloc_offset);
+        bytes = pread(snapshotFd, allocations.data(), allocations.size(),
+                header.alloc_offset);
+        assert(bytes == allocations.size());
+        close(snapshotFd);
+
+        char *entry = allocations.data();
+        for (uint32_t o = 0; o < header.object_count; o++) {
+            uint64_t *fields = (uint64_t *)entry;
+            const unsigned char *uuid = (const unsigned char *)&fields[3];
+            entry += allocationEntrySize(fields);
+            assert(entry <= allocations.data() + allocations.size());
+
+            log_range_t *range = ranges.find(uuid);
+            if (range == NULL) {
+                ranges.insert(uuid, { fields[1], 1 });
+            }
+            else {
+                range->head = std::min(range->head, fields[1]);
+                range->snapshots++;
+            }
+        }
+    }
 
-    // Reset last played commit IDs
-    for (auto it = manager->objects.begin();
-            it != manager->objects.end(); it++) {
-        assert(lastCommitIDs.find(it->first) != lastCommitIDs.end());
-        uint64_t commitID = lastCommitIDs.find(it->first)->second;
-        it->second->last_played_commit_id = commitID;
+    manager->lock();
+    for (auto it = manager->objects.begin(); it != manager->objects.end(); it++) {
+        log_range_t *range = ranges.find(it->first);
+        if (range == NULL || range->snapshots < snapshots.size()) continue;
+        Savitar_log_truncate(it->second->log, range->head);
     }
+    manager->unlock();
 }
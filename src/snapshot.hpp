@@ -1,13 +1,20 @@
 #pragma once
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <set>
+#include <thread>
 #include <experimental/filesystem>
 
 using namespace std;
 class NVManager;
+class PersistentObject;
+class ObjectAlloc;
+class NestedCalls;
 
 typedef struct {
     uint32_t identifier;
@@ -20,56 +27,225 @@ typedef struct {
     off_t global_offset;
     off_t alloc_offset;
     off_t data_offset;
+    off_t owners_offset; // block owners (see GlobalAlloc)
+    off_t blocks_offset; // blocks stored in this file
+    uint32_t parent_id; // 0 = full snapshot, otherwise a delta of parent_id
+    uint32_t chain_length; // deltas since the last full snapshot
+    off_t index_offset; // stored pages of each block (0 = one 2 MB slot per block)
+    uint64_t reserved[4];
 } snapshot_header_t;
 
+/*
+ * Sparse snapshots pack the allocated 4 KB pages of each stored block (in
+ * address order) at 'offset' bytes into the data region. All-zero pages
+ * are not written (holes in the file), 'pages' marks the stored ones.
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t pages[8]; // 2 MB = 512 x 4 KB
+} block_index_t;
+
+// Blocks of a persistent object that are restored on demand
+typedef struct {
+    ObjectAlloc *alloc;
+    uint64_t last_commit;
+    std::vector<size_t> blocks;
+} object_restore_t;
+
+// Allocation tables of the parent of a selective snapshot
+typedef struct {
+    std::vector<uint32_t> owners; // first blocks only
+    std::vector<uint64_t> bitmap;
+    std::vector<char> allocations;
+    uint32_t objects;
+} parent_tables_t;
+
+/*
+ * Blocks handed out to snapshot threads in chunks, one list per NUMA node
+ * holding the blocks (a single list on single-node machines)
+ */
+typedef struct {
+    std::vector<std::vector<size_t>> lists;
+    std::vector<size_t> cursors; // next block of each list
+} block_queues_t;
+
 namespace {
     class SnapshotTestSuite;
 }
 
 class Snapshot {
 public:
-    Snapshot(const char *);
+    Snapshot(const char *, bool active = true);
     ~Snapshot();
     static Snapshot *getInstance();
     static bool anyActiveSnapshot();
-    uint32_t create();
-    void snapshotWorker(off_t, size_t);
-    void restoreWorker(off_t, size_t);
+    uint32_t create(const std::set<PersistentObject *> *objects = NULL);
+    // Kept the objects that were not provided to create (selective)
+    bool isSelective() const { return !inherited.empty(); }
+    uint32_t checkpoint(NVManager *);
+    void snapshotBlock(size_t);
+    static size_t defaultThreads();
+    void parallelForBlocks(const std::vector<size_t> &,
+            void (Snapshot::*)(size_t));
+    void blockWorker(block_queues_t *, size_t, bool,
+            void (Snapshot::*)(size_t));
     void load(uint32_t id = 0, NVManager *manager = NULL);
+    bool saveImage(NVManager *);
+    bool loadImage(NVManager *, const std::set<std::string> &);
+    void restoreObject(PersistentObject *);
+    size_t pendingObjects() const { return restores.size(); }
+    bool pagingIn() const { return fillThread != NULL; }
     void pageFaultHandler(void *);
+    static bool trackedWrite(void *);
+    static bool waitsForCapture(PersistentObject *, PersistentObject *, bool);
+    static bool startWriteProtect();
+    static void writeProtect(void *, size_t, bool);
+    void waitForPaging();
     uint32_t lastSnapshotID();
+    uint32_t lastCompleteSnapshotID();
+    uint32_t chainLength(uint32_t);
+    bool acceptsDelta(uint32_t, uint32_t);
+    bool merge(uint32_t, uint64_t bytesPerSecond = 0);
+    size_t collectGarbage(uint32_t, uint64_t, NVManager *manager = NULL);
 
 protected:
     void loadSnapshot(uint32_t);
-    void prepareSnapshot();
+    snapshot_header_t *mapSnapshot(uint32_t, int *);
+    experimental::filesystem::path snapshotPath(uint32_t);
+    bool readHeader(uint32_t, snapshot_header_t *);
+    void mergeWorker(char *, size_t, size_t);
+    void throttle(size_t);
+    size_t allocatedBytes(size_t);
+    void startThrottling(uint64_t, bool adaptive = false);
+    void stopThrottling();
+    void adaptBandwidth(uint64_t);
+    void truncateLogs(const std::vector<uint32_t> &, NVManager *);
+    snapshot_header_t *sourceSnapshot(size_t);
+    char *blockSource(size_t);
+    const char *pageSource(const snapshot_header_t *, size_t, size_t);
+    bool isSparse(const snapshot_header_t *) const;
+    static bool storesBlock(const snapshot_header_t *, size_t);
+    static size_t blockMapSize();
+    void prepareSnapshot(const char *path = NULL);
+    void restore(NVManager *, bool);
     void blockNewTransactions();
     void unblockNewTransactions();
     void waitForRunningTransactions();
-    void saveAllocationTables();
+    bool readParentTables(uint32_t, size_t, parent_tables_t *);
+    static std::set<PersistentObject *> savedObjects(
+            const std::set<PersistentObject *> &,
+            const std::set<PersistentObject *> &, NestedCalls &);
+    void inheritObjects(const std::set<PersistentObject *> &,
+            const parent_tables_t &, size_t);
+    uint64_t captureObjects(size_t);
+    void waitForObjectTransactions(const std::set<PersistentObject *> &);
+    void captureBlock(size_t);
+    void resetCapture(size_t);
+    void saveAllocationTables(bool recovering = false);
     void extendSnapshot(size_t);
     void saveModifiedPages(size_t);
+    void forkWorker(size_t);
+    void saveBlock(size_t);
+    void savePage(size_t, size_t);
+    static size_t pageSlot(const uint64_t *, size_t);
+    void loadBlock(char *, size_t, bool);
     void cleanEnvironment();
-    void markPagesReadOnly();
+    void markPagesReadOnly(bool readOnly = true);
     void nonTemporalPageCopy(char *, char *);
-    void nonTemporalCacheLineCopy(char *, char *);
+    static bool zeroPage(const char *);
     void getExistingSnapshots(std::vector<uint32_t>&);
     void waitForFaultHandlers(size_t);
+    void restoreBlock(size_t);
+    void restoreBlocksParallel(const std::vector<size_t> &);
+    void mapBlock(size_t);
+    int sourceFd(const snapshot_header_t *);
+    void prepareObjectRestores();
+    bool startPaging(size_t);
+    void faultWorker();
+    void fillWorker();
+    void fillBlocks(size_t, size_t);
+    bool pageInBlock(size_t, char *);
+    static bool registerWriteProtect(size_t);
+    static void writeFaultWorker();
+    NVManager *manager();
 
 private:
     static Snapshot *instance;
     experimental::filesystem::path rootPath;
     int fd;
     snapshot_header_t *view;
+    size_t mappedSize; // view->size shrinks to the stored pages
+    size_t storedBytes; // data region of the snapshot being taken
     uint64_t *context;
+    volatile uint8_t *pageStates; // 4 KB copy-on-write (SNAPSHOT_PAGE_COW)
+    NVManager *nvm; // set while checkpointing recovery
+    uint32_t parent; // delta of this snapshot (0 = full snapshot)
+    bool trackWrites; // blocks stay read-only after they are saved
+    std::vector<uint8_t> inherited; // blocks kept from the parent (selective)
+    std::vector<snapshot_header_t *> chain; // parents of a loaded delta
+    std::vector<int> chainFds;
+
+    /*
+     * Blocks written since the last snapshot (incremental snapshots)
+     * Blocks stay write-protected after a snapshot, the first write to a
+     * block marks it as dirty (trackedWrite). NULL until the first snapshot.
+     */
+    static volatile uint8_t *dirtyBlocks;
+    static volatile uint8_t *spareDirtyBlocks;
+    static uint32_t trackedSnapshot;
+
+    /*
+     * Objects are being captured by a fuzzy snapshot (SNAPSHOT_FUZZY)
+     * crossedCapture: a nested transaction crossed two capture points, the
+     * snapshot is retaken with a global freeze (see waitsForCapture)
+     */
+    static volatile bool capturing;
+    static volatile bool crossedCapture;
+
+    // Heap write-protected with userfaultfd(2) (-1 = mprotect)
+    static int wpFd;
+    static size_t wpBlocks; // registered blocks
+
+    /*
+     * Copy bandwidth budget (bytes per second, 0 = no limit)
+     * Token bucket, nextCopy is when the bucket is empty (ns, monotonic).
+     * Adaptive budgets follow the log-append P99 (SNAPSHOT_LATENCY_TARGET).
+     */
+    volatile uint64_t bandwidth;
+    volatile uint64_t nextCopy;
+    volatile uint64_t lastAdapted;
+    bool adaptive;
+    std::map<PersistentObject *, object_restore_t> restores;
+
+    // Page runs mapped from snapshot files (SNAPSHOT_MAP_RESTORE)
+    volatile size_t mappedRuns;
+
+    // Heap paged in from the snapshot using userfaultfd(2) (UFFD_RESTORE)
+    int uffd;
+    int stopPipe[2]; // stops the fault handler
+    size_t pagedBlocks;
+    volatile uint8_t *blockStates;
+    char *zeroBlock; // source of unused blocks
+    std::thread *faultThread;
+    std::thread *fillThread;
 
     friend class ::SnapshotTestSuite;
 
 public:
-    const size_t SnapshotThreads = 4;
+    const size_t SnapshotThreads = defaultThreads(); // SNAPSHOT_THREADS
+    static const size_t WriteFaultThreads = 4;
     const uint64_t UsedHugePage = 0xAAAAAAAAAAAAAAAA;
     const uint64_t FreeHugePage = 0xFFFFFFFFFFFFFFFF;
     const uint64_t LockedHugePage = 0xAFAFAFAFAFAFAFAF;
     const uint64_t SavedHugePage = 0x0000000000000000;
-    static_assert(sizeof(snapshot_header_t) == 64,
+    const uint8_t BlockMissing = 0;
+    const uint8_t BlockCopying = 1;
+    const uint8_t BlockCopied = 2;
+    const uint8_t PagePending = 0;
+    const uint8_t PageCopying = 1;
+    const uint8_t PageCopied = 2;
+    static_assert(sizeof(snapshot_header_t) == 128,
             "Snapshot header is not cache-aligned!");
+    // Snapshots taken before block owners were recorded
+    const off_t LegacyHeaderSize = 64;
 };
@@ -0,0 +1,74 @@
+#include <assert.h>
+#include "snapshot_merger.hpp"
+#include "snapshot.hpp"
+#include "savitar.hpp"
+#include "nvm_manager.hpp"
+
+SnapshotMerger::SnapshotMerger() {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&condition, NULL);
+}
+
+SnapshotMerger::~SnapshotMerger() {
+    wait();
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&condition);
+}
+
+void SnapshotMerger::merge(uint32_t id) {
+    pthread_mutex_lock(&lock);
+    if (id > pending) pending = id;
+    start();
+    pthread_mutex_unlock(&lock);
+}
+
+void SnapshotMerger::collect() {
+    pthread_mutex_lock(&lock);
+    collecting = true;
+    start();
+    pthread_mutex_unlock(&lock);
+}
+
+// Must hold the lock
+void SnapshotMerger::start() {
+    if (running) return;
+    if (started) pthread_join(thread, NULL);
+    running = started = true;
+    assert(pthread_create(&thread, NULL, worker, this) == 0);
+}
+
+// Waits for running and pending merges (and garbage collections)
+void SnapshotMerger::wait() {
+    pthread_mutex_lock(&lock);
+    while (running) pthread_cond_wait(&condition, &lock);
+    if (started) pthread_join(thread, NULL);
+    started = false;
+    pthread_mutex_unlock(&lock);
+}
+
+void *SnapshotMerger::worker(void *arg) {
+    SnapshotMerger *me = (SnapshotMerger *)arg;
+
+    pthread_mutex_lock(&me->lock);
+    while (me->pending != 0 || me->collecting) {
+        uint32_t id = me->pending;
+        bool collecting = id == 0 && me->collecting;
+        me->pending = 0;
+        if (collecting) me->collecting = false;
+        pthread_mutex_unlock(&me->lock);
+
+        Snapshot *snapshot = new Snapshot(PMEM_PATH, false);
+        if (id != 0) snapshot->merge(id, SNAPSHOT_MERGE_BANDWIDTH);
+        else {
+            snapshot->collectGarbage(SNAPSHOT_RETAIN_COUNT,
+                    SNAPSHOT_RETAIN_MINUTES, &NVManager::getInstance());
+        }
+        delete snapshot;
+
+        pthread_mutex_lock(&me->lock);
+    }
+    me->running = false;
+    pthread_cond_broadcast(&me->condition);
+    pthread_mutex_unlock(&me->lock);
+    return NULL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Folds chains of incremental snapshots into full snapshots
+ * * Merges run on a background thread (see Snapshot::merge) and only read
+ *   snapshot files, so transactions and new snapshots are not blocked.
+ * * Copies are throttled to SNAPSHOT_MERGE_BANDWIDTH.
+ * * Requests are coalesced, only the latest requested snapshot is merged.
+ * * Also deletes snapshots outside the retention policy (SNAPSHOT_RETAIN_*)
+ *   and truncates logs accordingly, after the pending merge (if any).
+ */
+class SnapshotMerger {
+public:
+    SnapshotMerger();
+    ~SnapshotMerger();
+    static SnapshotMerger &getInstance() {
+        static SnapshotMerger instance;
+        return instance;
+    }
+
+    void merge(uint32_t id);
+    void collect();
+    void wait();
+
+private:
+    static void *worker(void *);
+    void start();
+
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    pthread_t thread;
+    bool started = false;
+    bool running = false;
+    uint32_t pending = 0; // 0 = no pending merge
+    bool collecting = false; // pending garbage collection
+};
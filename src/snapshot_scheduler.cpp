@@ -0,0 +1,220 @@
+#include <assert.h>
+#include <errno.h>
+#include "snapshot_scheduler.hpp"
+#include "snapshot.hpp"
+#include "savitar.hpp"
+#include "recovery_context.hpp"
+#include "nv_log.hpp"
+
+SnapshotScheduler::SnapshotScheduler() {
+    pthread_mutex_init(&lock, NULL);
+    sem_init(&wakeup, 0, 0);
+}
+
+SnapshotScheduler::~SnapshotScheduler() {
+    stop();
+    sem_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+/*
+ * Starts the scheduler thread (once objects are recovered)
+ * Logs are replayed from the last snapshot (or their head), so replaying
+ * starts there after a crash too.
+ */
+void SnapshotScheduler::start() {
+    pthread_mutex_lock(&lock);
+    if (!started) {
+        NVManager &manager = NVManager::getInstance();
+        snapshotLogBytes = 0;
+        for (auto it = manager.objects.begin(); it != manager.objects.end();
+                ++it) {
+            uint64_t head = RecoveryContext::getInstance().queryLogHeadOffset(
+                    it->first);
+            if (head == 0) head = it->second->log->head;
+            snapshotLogBytes += head;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &lastSnapshot);
+        stopping = false;
+        started = true;
+        assert(pthread_create(&thread, NULL, worker, this) == 0);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void SnapshotScheduler::stop() {
+    pthread_mutex_lock(&lock);
+    bool running = started;
+    started = false;
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+    if (!running) return;
+    sem_post(&wakeup);
+    pthread_join(thread, NULL);
+}
+
+std::future<uint32_t> SnapshotScheduler::trigger() {
+    std::promise<uint32_t> request;
+    std::future<uint32_t> result = request.get_future();
+    start();
+    pthread_mutex_lock(&lock);
+    requests.push_back(std::move(request));
+    pthread_mutex_unlock(&lock);
+    sem_post(&wakeup);
+    return result;
+}
+
+void SnapshotScheduler::signal() {
+    signaled = 1;
+    sem_post(&wakeup);
+}
+
+uint64_t SnapshotScheduler::logBytes() {
+    uint64_t bytes = 0;
+    NVManager &manager = NVManager::getInstance();
+    for (auto it = manager.objects.begin(); it != manager.objects.end(); ++it) {
+        bytes += it->second->log->tail;
+    }
+    return bytes;
+}
+
+double SnapshotScheduler::estimatedRecoveryTime() {
+    uint64_t throughput = NVManager::getInstance().replayThroughput();
+    if (throughput == 0) throughput = SNAPSHOT_REPLAY_THROUGHPUT;
+    uint64_t bytes = logBytes();
+    if (bytes < snapshotLogBytes) return 0; // objects were deleted
+    return (double)(bytes - snapshotLogBytes) / throughput;
+}
+
+// SNAPSHOT_QUIET_START to SNAPSHOT_QUIET_END (local time, may wrap around)
+bool SnapshotScheduler::quietHours() {
+    if (SNAPSHOT_QUIET_START == SNAPSHOT_QUIET_END) return false;
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    if (SNAPSHOT_QUIET_START < SNAPSHOT_QUIET_END) {
+        return local.tm_hour >= SNAPSHOT_QUIET_START &&
+            local.tm_hour < SNAPSHOT_QUIET_END;
+    }
+    return local.tm_hour >= SNAPSHOT_QUIET_START ||
+        local.tm_hour < SNAPSHOT_QUIET_END;
+}
+
+bool SnapshotScheduler::due() {
+    if (SNAPSHOT_RTO == 0) return false; // requested snapshots only
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - lastSnapshot.tv_sec < SNAPSHOT_MIN_INTERVAL) return false;
+    if (quietHours()) return false;
+    return estimatedRecoveryTime() >= SNAPSHOT_RTO * TriggerRatio;
+}
+
+/*
+ * Takes a snapshot of all objects, or a selective snapshot of the provided
+ * ones (their logs are not covered by the recovery time estimate)
+ */
+uint32_t SnapshotScheduler::takeSnapshot(
+        const std::set<PersistentObject *> *objects) {
+    // Entries appended while the snapshot is taken are counted (again)
+    uint64_t bytes = logBytes();
+    if (objects == NULL) {
+        PRINT("Scheduler: taking a snapshot, estimated recovery time = %.2f s\n",
+                estimatedRecoveryTime());
+    }
+    else {
+        PRINT("Scheduler: taking a snapshot of %zu objects\n", objects->size());
+    }
+    Snapshot *snapshot = new Snapshot(PMEM_PATH);
+    uint32_t id = snapshot->create(objects);
+    if (objects != NULL && !snapshot->isSelective()) {
+        objects = NULL; // taken as a full snapshot (see setInterval)
+    }
+    delete snapshot;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (objects == NULL) {
+        snapshotLogBytes = bytes;
+        lastSnapshot = now;
+    }
+    pthread_mutex_lock(&lock);
+    for (auto it = cadences.begin(); it != cadences.end(); ++it) {
+        if (objects == NULL || objects->count(it->first) > 0) {
+            it->second.last = now;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return id;
+}
+
+bool SnapshotScheduler::setInterval(PersistentObject *object,
+        uint32_t seconds) {
+#ifdef SNAPSHOT_FUZZY
+    bool selective = false; // objects are not captured at once
+#else
+    bool selective = SNAPSHOT_MAX_SELECTIVE > 0;
+#endif
+    if (seconds != 0 && !selective) {
+        PRINT("Scheduler: selective snapshots are off, no interval set\n");
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    if (seconds == 0) {
+        cadences.erase(object);
+    }
+    else {
+        cadence_t &cadence = cadences[object];
+        cadence.interval = seconds;
+        clock_gettime(CLOCK_MONOTONIC, &cadence.last);
+    }
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// Objects whose interval elapsed since their last snapshot
+void SnapshotScheduler::dueObjects(std::set<PersistentObject *> &objects) {
+    if (quietHours()) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&lock);
+    for (auto it = cadences.begin(); it != cadences.end(); ++it) {
+        if (now.tv_sec - it->second.last.tv_sec >= it->second.interval) {
+            objects.insert(it->first);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *SnapshotScheduler::worker(void *arg) {
+    SnapshotScheduler *me = (SnapshotScheduler *)arg;
+
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        if (sem_timedwait(&me->wakeup, &deadline) != 0) {
+            assert(errno == ETIMEDOUT || errno == EINTR);
+        }
+
+        std::vector<std::promise<uint32_t>> pending;
+        pthread_mutex_lock(&me->lock);
+        pending.swap(me->requests);
+        pthread_mutex_unlock(&me->lock);
+
+        bool requested = !pending.empty() || me->signaled;
+        me->signaled = 0;
+        if (requested || (!me->stopping && me->due())) {
+            uint32_t id = me->takeSnapshot();
+            for (auto it = pending.begin(); it != pending.end(); ++it) {
+                it->set_value(id);
+            }
+        }
+        else if (!me->stopping) {
+            std::set<PersistentObject *> objects;
+            me->dueObjects(objects);
+            if (!objects.empty()) me->takeSnapshot(&objects);
+        }
+        if (me->stopping) break;
+    }
+    return NULL;
+}
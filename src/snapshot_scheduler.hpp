@@ -0,0 +1,84 @@
+#pragma once
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <future>
+#include <map>
+#include <set>
+#include <vector>
+
+/*
+ * Takes snapshots to keep the estimated recovery time under SNAPSHOT_RTO
+ * * Recovery time is estimated from the log bytes appended since the last
+ *   snapshot and the replay throughput measured by the last recovery
+ *   (SNAPSHOT_REPLAY_THROUGHPUT until a recovery is measured).
+ * * Snapshots are taken before the estimate reaches the objective, at most
+ *   once every SNAPSHOT_MIN_INTERVAL seconds and never during quiet hours.
+ * * Snapshots can also be requested (trigger or SIGUSR1). Requests are
+ *   served by the scheduler thread, so snapshots never overlap.
+ * * Objects can be snapshotted at their own interval (setInterval), using
+ *   selective snapshots that keep the other objects from the last one.
+ *   Selective snapshots are deltas: without a previous snapshot, or after
+ *   SNAPSHOT_MAX_SELECTIVE of them, a full snapshot is taken instead (and
+ *   counts as one). setInterval refuses intervals when selective snapshots
+ *   are off (SNAPSHOT_MAX_SELECTIVE = 0 or SNAPSHOT_FUZZY).
+ */
+class PersistentObject;
+
+class SnapshotScheduler {
+public:
+    static SnapshotScheduler &getInstance() {
+        static SnapshotScheduler instance;
+        return instance;
+    }
+
+    void start();
+    // Serves pending requests and waits for the running snapshot
+    void stop();
+
+    // Requests a snapshot, the future returns its identifier
+    std::future<uint32_t> trigger();
+
+    // Same as above, without a future (async-signal-safe)
+    void signal();
+
+    // Snapshots the object every 'seconds' (0 = only with the others),
+    // false if selective snapshots are off
+    bool setInterval(PersistentObject *, uint32_t seconds);
+
+    // Seconds to replay the logs appended since the last snapshot
+    double estimatedRecoveryTime();
+
+    // Fraction of SNAPSHOT_RTO at which snapshots are taken
+    const double TriggerRatio = 0.75;
+
+protected:
+    static void *worker(void *);
+    bool due();
+    bool quietHours();
+    uint64_t logBytes();
+    uint32_t takeSnapshot(const std::set<PersistentObject *> *objects = NULL);
+    void dueObjects(std::set<PersistentObject *> &);
+
+private:
+    SnapshotScheduler();
+    ~SnapshotScheduler();
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    sem_t wakeup;
+    bool started = false;
+    volatile bool stopping = false;
+    volatile sig_atomic_t signaled = 0;
+    std::vector<std::promise<uint32_t>> requests;
+    uint64_t snapshotLogBytes = 0; // log bytes covered by the last snapshot
+    struct timespec lastSnapshot;
+
+    typedef struct {
+        uint32_t interval; // seconds
+        struct timespec last; // last snapshot of the object
+    } cadence_t;
+    std::map<PersistentObject *, cadence_t> cadences;
+};
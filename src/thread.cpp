@@ -6,6 +6,8 @@
 #include "persister.hpp"
 #include "nvm_manager.hpp"
 #include "recovery_context.hpp"
+#include "recovery_scheduler.hpp"
+#include "snapshot.hpp"
 
 void get_cpu_info(uint8_t *core_map, int *map_size);
 
@@ -261,6 +263,36 @@ inline void Savitar_persister_log(uint64_t active_tx_id) {
     sync_buffer[active_tx_id].method_tag = 0;
 }
 
+#ifdef SNAPSHOT_FUZZY
+/*
+ * Checks if a capture waits for an outer transaction of this thread, one
+ * that uses the object or an object being captured. Transactions nested
+ * in such transactions must not block.
+ */
+static bool isHeldByCapture(uint64_t object_ptr, uint64_t active) {
+    for (uint64_t i = 0; i + 1 < active; i++) {
+        if (sync_buffer[i].obj_ptr == object_ptr) return true;
+        if (((PersistentObject *)sync_buffer[i].obj_ptr)->isBeingCaptured()) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// Checks if the (active-th) transaction on the object waits for a snapshot
+static inline bool waitsForSnapshot(PersistentObject *obj, uint64_t active) {
+#ifdef SNAPSHOT_FUZZY
+    PersistentObject *parent = active > 1 ?
+        (PersistentObject *)sync_buffer[active - 2].obj_ptr : NULL;
+    return Snapshot::waitsForCapture(obj, parent,
+            isHeldByCapture((uint64_t)obj, active));
+#else
+    // Don't wait if inside a nested transaction
+    return active == 1 && obj->isWaitingForSnapshot();
+#endif
+}
+
 void Savitar_thread_notify(int num, ...) {
 #ifdef DEBUG
     PRINT("[%d] Notifying persister with %d arguments!\n",
@@ -275,17 +307,26 @@ void Savitar_thread_notify(int num, ...) {
     uint64_t method_tag = va_arg(valist, uint64_t);
 
     PersistentObject *obj = (PersistentObject *)object_ptr;
+    NVManager *manager = RecoveryContext::getInstance().getManager();
+    if (manager != NULL) manager->restoreObject(obj); // not restored yet
+    if (obj->isRecovering() && !RecoveryScheduler::isReplaying()) {
+        // Live thread accessing an object that is not recovered yet (lazy)
+        RecoveryContext::getInstance().getScheduler()->expedite(obj);
+    }
     if (obj->isRecovering()) {
         RecoveryContext& context = RecoveryContext::getInstance();
         PersistentObject *me = (PersistentObject *)object_ptr;
         PersistentObject *parent = context.popParentObject();
         if (parent != NULL) {
-            while (!me->isWaitingForParent(parent)) { }
+            context.getScheduler()->awaitChild(me, parent);
         }
         context.pushParentObject(me);
         return;
     }
     assert(tx_buffer[0] < MAX_ACTIVE_TXS);
+#ifdef LAZY_RECOVERY
+    obj->countAccess(); // orders the next lazy recovery
+#endif
 
     sync_buffer[tx_buffer[0]].obj_ptr = object_ptr;
     for (int i = 2; i < num; i++) {
@@ -299,18 +340,23 @@ void Savitar_thread_notify(int num, ...) {
     asm volatile("sfence" : : : "memory");
 #endif // SYNC_SL
 
-    // Don't wait if inside a nested transaction
-    if (tx_buffer[0] == 1 && obj->isWaitingForSnapshot()) {
+    // Snapshots take the objects of a nested transaction together
+    uint64_t active = tx_buffer[0];
+    if (active > 1) {
+        obj->addCaller((PersistentObject *)sync_buffer[active - 2].obj_ptr);
+    }
+
+    if (waitsForSnapshot(obj, active)) {
         PRINT("[%d] Worker thread is now blocked!\n", (int)pthread_self());
-        tx_buffer[0] = 0;
+        tx_buffer[0] = active - 1;
         pthread_mutex_t *ckptLock = NVManager::getInstance().ckptLock();
         pthread_cond_t *ckptCond = NVManager::getInstance().ckptCondition();
         pthread_mutex_lock(ckptLock);
-        while (obj->isWaitingForSnapshot()) {
+        while (waitsForSnapshot(obj, active)) {
             pthread_cond_wait(ckptCond, ckptLock);
         }
         pthread_mutex_unlock(ckptLock);
-        tx_buffer[0] = 1;
+        tx_buffer[0] = active;
         PRINT("[%d] Worker thread is now unblocked!\n", (int)pthread_self());
     }
 
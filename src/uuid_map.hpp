@@ -0,0 +1,166 @@
+#pragma once
+#include <pthread.h>
+#include <uuid/uuid.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <atomic>
+#include <vector>
+
+/*
+ * Hash table keyed by binary (16-byte) UUIDs
+ * * Open addressing with linear probing, no string formatting or tree walks.
+ * * Lookups are lock-free, insertions are serialized using a mutex.
+ * * Keys are never removed. The table grows (doubles) when 75% full, old
+ *   tables are kept until the map is destroyed since lock-free readers
+ *   may still be probing them.
+ * Slots expose 'first' (key) and 'second' (value) so iterating over the
+ * map looks like iterating over a std::map.
+ */
+template <class V>
+class UUIDMap {
+public:
+    typedef struct Slot {
+        uuid_t first;
+        V second;
+        std::atomic<uint32_t> used;
+    } Slot;
+
+    class iterator {
+    public:
+        iterator(Slot *s, Slot *e) : slot(s), end(e) { skip(); }
+        Slot &operator*() const { return *slot; }
+        Slot *operator->() const { return slot; }
+        iterator &operator++() { slot++; skip(); return *this; }
+        iterator operator++(int) { iterator t = *this; ++(*this); return t; }
+        bool operator==(const iterator &o) const { return slot == o.slot; }
+        bool operator!=(const iterator &o) const { return slot != o.slot; }
+    private:
+        void skip() {
+            while (slot != end && slot->used.load(std::memory_order_acquire) == 0)
+                slot++;
+        }
+        Slot *slot;
+        Slot *end;
+    };
+
+    UUIDMap(size_t capacity = 64) {
+        assert((capacity & (capacity - 1)) == 0);
+        pthread_mutex_init(&lock, NULL);
+        table.store(newTable(capacity), std::memory_order_release);
+    }
+
+    ~UUIDMap() {
+        for (auto it = retired.begin(); it != retired.end(); ++it) {
+            delete[] (*it)->slots;
+            delete *it;
+        }
+        Table *t = table.load(std::memory_order_acquire);
+        delete[] t->slots;
+        delete t;
+        pthread_mutex_destroy(&lock);
+    }
+
+    // Returns a pointer to the value, or NULL if the key does not exist
+    V *find(const uuid_t key) const {
+        Table *t = table.load(std::memory_order_acquire);
+        for (size_t i = hash(key) & t->mask;; i = (i + 1) & t->mask) {
+            Slot *slot = &t->slots[i];
+            if (slot->used.load(std::memory_order_acquire) == 0) return NULL;
+            if (memcmp(slot->first, key, sizeof(uuid_t)) == 0) {
+                return &slot->second;
+            }
+        }
+    }
+
+    // Same as std::map::insert, existing values are not replaced
+    bool insert(const uuid_t key, V value) {
+        pthread_mutex_lock(&lock);
+        Table *t = table.load(std::memory_order_relaxed);
+        if ((count + 1) * 4 > (t->mask + 1) * 3) {
+            t = grow(t);
+        }
+        bool inserted = put(t, key, value);
+        if (inserted) count++;
+        pthread_mutex_unlock(&lock);
+        return inserted;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Not thread-safe, no concurrent readers or writers are allowed
+    void clear() {
+        Table *t = table.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= t->mask; i++) {
+            t->slots[i].used.store(0, std::memory_order_relaxed);
+        }
+        count = 0;
+    }
+
+    iterator begin() const {
+        Table *t = table.load(std::memory_order_acquire);
+        return iterator(t->slots, t->slots + t->mask + 1);
+    }
+
+    iterator end() const {
+        Table *t = table.load(std::memory_order_acquire);
+        return iterator(t->slots + t->mask + 1, t->slots + t->mask + 1);
+    }
+
+private:
+    typedef struct Table {
+        size_t mask;
+        Slot *slots;
+    } Table;
+
+    // UUIDs are (mostly) random, folding both halves is good enough
+    static inline size_t hash(const uuid_t key) {
+        uint64_t h[2];
+        memcpy(h, key, sizeof(h));
+        h[0] ^= h[1];
+        return (size_t)(h[0] ^ (h[0] >> 29));
+    }
+
+    static Table *newTable(size_t capacity) {
+        Table *t = new Table();
+        t->mask = capacity - 1;
+        t->slots = new Slot[capacity];
+        for (size_t i = 0; i < capacity; i++) {
+            t->slots[i].used.store(0, std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+    // Must hold the lock
+    static bool put(Table *t, const uuid_t key, V value) {
+        for (size_t i = hash(key) & t->mask;; i = (i + 1) & t->mask) {
+            Slot *slot = &t->slots[i];
+            if (slot->used.load(std::memory_order_relaxed) == 0) {
+                memcpy(slot->first, key, sizeof(uuid_t));
+                slot->second = value;
+                slot->used.store(1, std::memory_order_release); // publish
+                return true;
+            }
+            if (memcmp(slot->first, key, sizeof(uuid_t)) == 0) return false;
+        }
+    }
+
+    // Must hold the lock
+    Table *grow(Table *t) {
+        Table *bigger = newTable((t->mask + 1) * 2);
+        for (size_t i = 0; i <= t->mask; i++) {
+            Slot *slot = &t->slots[i];
+            if (slot->used.load(std::memory_order_relaxed) == 0) continue;
+            put(bigger, slot->first, slot->second);
+        }
+        table.store(bigger, std::memory_order_release);
+        retired.push_back(t);
+        return bigger;
+    }
+
+    std::atomic<Table *> table;
+    std::vector<Table *> retired;
+    pthread_mutex_t lock;
+    size_t count = 0;
+};
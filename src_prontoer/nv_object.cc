@@ -4,6 +4,7 @@
 #include <queue>
 #include "nv_object.h"
 #include "nv_log.h"
+#include "../src/log_scanner.hpp"
 
 /*
  * Constructor is only called for new objects:
@@ -108,8 +109,6 @@ void PersistentObject::Recover() {
     assert(log != nullptr);
     assert(sizeof(uint64_t) == 8); // We assume 2 * sizeof(uint64_t) == 16
     uint64_t log_head = log->head;
-    char* ptr = (char*)log + log_head;
-    const char* limit = (char*)log + log->tail; 
 
     char uuid_str[64], uuid_prefix[9];
     uuid_unparse(uuid, uuid_str);
@@ -122,31 +121,41 @@ void PersistentObject::Recover() {
 
     // Creating data-structures to handle out-of-order entries
     std::priority_queue<CommitRecord> commit_queue;
-    uint64_t slot_index = 0;
-    while (ptr < limit) {
-        size_t data_size = sizeof(uint64_t); // Need to make it generic.
-        size_t slot_size = 2 * sizeof(uint64_t);
-        slot_size +=  data_size;
-        if (slot_size % CACHE_LINE_WIDTH != 0) {
-            slot_size += CACHE_LINE_WIDTH - (slot_size % CACHE_LINE_WIDTH);
-        }
-        // 1. Read commit id and method tag from persistent log
-        uint64_t commit_id = *((uint64_t *)ptr);
-        PRINT("[%s] Found record with commit order = %zu\n",
-                uuid_prefix, commit_id);
-        uint64_t magic_offset = sizeof(uint64_t);
-        uint64_t magic = *((uint64_t *)(ptr + magic_offset));
+    size_t data_size = sizeof(uint64_t); // Need to make it generic.
+    size_t slot_size = 2 * sizeof(uint64_t);
+    slot_size +=  data_size;
+    if (slot_size % CACHE_LINE_WIDTH != 0) {
+        slot_size += CACHE_LINE_WIDTH - (slot_size % CACHE_LINE_WIDTH);
+    }
+    assert(slot_size == CACHE_LINE_WIDTH); // the scanner tests every line
 
-        if (magic != REDO_LOG_MAGIC) { // free slot
-            AddFreeSlot(slot_index);
-        } else { // filled slot.
-            uint64_t data_offset = magic_offset + sizeof(uint64_t);
-            uint64_t* args = ((uint64_t*)(ptr + data_offset));
+    // 1. Find filled slots (SIMD scan of slot headers), others are free
+    const char *base = (const char *)log;
+    const uint64_t slot_count = (log->tail - log_head + slot_size - 1) / slot_size;
+    const size_t BatchSize = 256;
+    LogScanRecord records[BatchSize];
+    uint64_t slot_index = 0;
+    uint64_t next = log_head;
+    while (next < log->tail) {
+        size_t count = Savitar_log_scan(base, next, log->tail, REDO_LOG_MAGIC,
+                records, BatchSize, &next);
+        for (size_t i = 0; i < count; i++) {
+            uint64_t filled_index = (records[i].offset - log_head) / slot_size;
+            for (; slot_index < filled_index; slot_index++) { // free slots
+                AddFreeSlot(slot_index);
+            }
+            PRINT("[%s] Found record with commit order = %zu\n",
+                    uuid_prefix, records[i].commit_id);
+            // 2. Play the filled slot
+            uint64_t data_offset = 2 * sizeof(uint64_t);
+            uint64_t* args = ((uint64_t*)(base + records[i].offset + data_offset));
             uint64_t op_tag = 1; // Insert operation
-            this->Play(op_tag, args, slot_index, false);            
+            this->Play(op_tag, args, slot_index, false);
+            slot_index++;
         }
-        ptr += slot_size;
-        slot_index++;
+    }
+    for (; slot_index < slot_count; slot_index++) {
+        AddFreeSlot(slot_index);
     }
     printf("[%s] Finished recovering %s\n", uuid_prefix, uuid_str);
 }
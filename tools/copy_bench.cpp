@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <emmintrin.h>
+#include <iostream>
+#include <iomanip>
+#include "../src/copy_kernels.hpp"
+
+using namespace std;
+
+/*
+ * Measures the write bandwidth of the non-temporal copy kernels
+ * Copies 4 KB pages (fenced after each 2 MB block, same as snapshots) from
+ * DRAM to a file (e.g., on the NVM file-system) or to DRAM.
+ */
+int main(int argc, char **argv) {
+    const size_t PageSize = 4096;
+    const size_t BlockSize = (size_t)2 << 20;
+    const char *path = argc > 1 ? argv[1] : NULL;
+    size_t size = (size_t)(argc > 2 ? atoi(argv[2]) : 1024) << 20; // MB
+    const int Rounds = 5;
+    assert(size >= BlockSize && size % BlockSize == 0);
+
+    char *src = (char *)aligned_alloc(BlockSize, size);
+    assert(src != NULL);
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        *(uint64_t *)(src + i) = i * 0x9E3779B97F4A7C15;
+    }
+
+    char *dst = NULL;
+    int fd = -1;
+    if (path != NULL) {
+        fd = open(path, O_CREAT | O_RDWR, 0666);
+        assert(fd >= 0);
+        assert(ftruncate(fd, size) == 0);
+        dst = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    }
+    else {
+        dst = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    assert(dst != MAP_FAILED);
+    memset(dst, 0, size); // no page faults while measuring
+
+    CopyKernel kernels[8];
+    size_t count = Savitar_copy_kernels(kernels, 8);
+    cout << "Destination:\t" << (path != NULL ? path : "DRAM") << endl;
+    cout << "Size:\t\t" << (size >> 20) << " MB" << endl;
+    cout << "Default:\t" << Savitar_stream_copy_kernel()->name << endl;
+    cout << "Kernel\t\tGB/s (best of " << Rounds << ")" << endl;
+
+    for (size_t k = 0; k < count; k++) {
+        double best = 0;
+        for (int r = 0; r < Rounds; r++) {
+            struct timespec t1, t2;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            for (size_t b = 0; b < size; b += BlockSize) {
+                for (size_t p = b; p < b + BlockSize; p += PageSize) {
+                    kernels[k].copy(dst + p, src + p, PageSize);
+                }
+                _mm_sfence();
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            double elapsed = (t2.tv_sec - t1.tv_sec) +
+                (t2.tv_nsec - t1.tv_nsec) / 1E9;
+            best = max(best, size / elapsed / 1E9);
+        }
+        assert(memcmp(dst, src, size) == 0);
+        memset(dst, 0, size);
+        const char *tabs = strlen(kernels[k].name) < 8 ? "\t\t" : "\t";
+        cout << kernels[k].name << tabs << fixed << setprecision(2)
+            << best << endl;
+    }
+
+    munmap(dst, size);
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    free(src);
+    return 0;
+}
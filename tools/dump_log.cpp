@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <uuid/uuid.h>
 #include <iostream>
+#include <algorithm>
 #include "../src/nv_log.hpp"
+#include "../src/log_scanner.hpp"
 #include "../src/savitar.hpp"
 #define NESTED_TX_TAG               0x8000000000000000
 
@@ -9,7 +11,7 @@ using namespace std;
 
 int main(int argc, char **argv) {
     uuid_t uuid;
-    assert(argc == 2);
+    assert(argc == 2 || argc == 3);
     assert(uuid_parse(argv[1], uuid) == 0);
 
     SavitarLog *log = Savitar_log_open(uuid);
@@ -30,6 +32,9 @@ int main(int argc, char **argv) {
     }
     cout << endl;
     cout << "Last commit:\t" << log->last_commit << endl;
+    const uint64_t capacity = Savitar_log_capacity(log);
+    cout << "Index:\t\t" << capacity << " (stride = ";
+    cout << LOG_INDEX_STRIDE << " bytes)" << endl;
     cout << "=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=";
     cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << endl;
     cout << "Offset\tMagic\t\t\tCommit\tTag\tParent object UUID\t\t\tOffset" << endl;
@@ -37,29 +42,45 @@ int main(int argc, char **argv) {
     off_t offset = sizeof(SavitarLog);
     char *data = (char *)log;
 
-    while (offset < log->tail && offset < log->size) {
-        uint64_t magic = *reinterpret_cast<uint64_t *>(&data[offset + 8]);
-        if (magic != REDO_LOG_MAGIC) { offset+= 64; continue; }
-        cout << "[" << offset << "]\t";
-        cout << std::hex << magic << "\t";
-        cout << std::dec << *((uint64_t *)(&data[offset])) << "\t";
-        uint64_t method_tag = *((uint64_t *)&data[offset + 16]);
-        if (method_tag & NESTED_TX_TAG) {
-            cout << "-\t";
-            struct uuid_wrapper {
-                uuid_t uuid;
-            } *uuid_ptr = (struct uuid_wrapper *)&data[offset + 24];
-            char uuid_str[64];
-            uuid_unparse(uuid_ptr->uuid, uuid_str);
-            cout << uuid_str << "\t" << (method_tag & (~NESTED_TX_TAG));
-        }
-        else {
-            cout << method_tag << "\t-\t\t\t\t\t-";
+    // Seek to the provided commit id using the commit index
+    if (argc == 3) {
+        uint64_t commit_id = strtoull(argv[2], NULL, 10);
+        offset = Savitar_log_find_commit(log, commit_id);
+        if (offset == 0) {
+            cout << "Commit " << commit_id << " not found!" << endl;
+            offset = log->tail;
         }
+    }
 
-        cout << endl;
-        offset += 64;
+    // Find entry headers in batches (SIMD scanner)
+    const uint64_t end = std::min((uint64_t)log->tail, capacity);
+    const size_t BatchSize = 1024;
+    LogScanRecord *records = new LogScanRecord[BatchSize];
+    uint64_t next = offset;
+    while (next < end) {
+        size_t count = Savitar_log_scan(data, next, end, REDO_LOG_MAGIC,
+                records, BatchSize, &next);
+        for (size_t i = 0; i < count; i++) {
+            cout << "[" << records[i].offset << "]\t";
+            cout << std::hex << REDO_LOG_MAGIC << "\t";
+            cout << std::dec << records[i].commit_id << "\t";
+            uint64_t method_tag = records[i].tag;
+            if (method_tag & NESTED_TX_TAG) {
+                cout << "-\t";
+                struct uuid_wrapper {
+                    uuid_t uuid;
+                } *uuid_ptr = (struct uuid_wrapper *)&data[records[i].offset + 24];
+                char uuid_str[64];
+                uuid_unparse(uuid_ptr->uuid, uuid_str);
+                cout << uuid_str << "\t" << (method_tag & (~NESTED_TX_TAG));
+            }
+            else {
+                cout << method_tag << "\t-\t\t\t\t\t-";
+            }
+            cout << endl;
+        }
     }
+    delete[] records;
 
     cout << "=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=";
     cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << endl;
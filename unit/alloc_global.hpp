@@ -1,5 +1,6 @@
 #include "../src/ckpt_alloc.hpp"
 #include "gtest/gtest.h"
+#include <uuid/uuid.h>
 #include <limits.h>
 #include <stdint.h>
 #include <emmintrin.h>
@@ -166,4 +167,35 @@ namespace {
         void *ptr = instance->alloc(FreeList::BlockSize);
         EXPECT_EQ((uintptr_t)ptr, expected);
     }
+
+    TEST_F(GlobalAllocTestSuite, BlockOwners) {
+        const size_t blockSize = FreeList::BlockSize;
+        uuid_t uuid;
+        uuid_generate(uuid);
+        ObjectAlloc *alloc = instance->newAllocator(uuid);
+        uint32_t owner = instance->ownerID(alloc);
+        EXPECT_NE(owner, 0);
+
+        uintptr_t owned = (uintptr_t)instance->alloc(2 * blockSize, alloc);
+        uintptr_t unowned = (uintptr_t)instance->alloc(blockSize);
+        size_t block = (owned - GlobalAlloc::BaseAddress) / blockSize;
+        EXPECT_EQ(instance->blockOwner(block), owner);
+        EXPECT_EQ(instance->blockOwner(block + 1), owner);
+        EXPECT_EQ(instance->blockOwner(
+                    (unowned - GlobalAlloc::BaseAddress) / blockSize), 0);
+
+        // Owners are saved with snapshots
+        char *owners = (char *)malloc(instance->ownersSize());
+        instance->saveOwners(owners);
+        instance->save(snapshot);
+        instance->release((void *)owned, 2 * blockSize);
+        EXPECT_EQ(instance->blockOwner(block), 0);
+        EXPECT_EQ(instance->blockOwner(block + 1), 0);
+
+        delete instance;
+        instance = new GlobalAlloc(snapshot, NULL, owners);
+        EXPECT_EQ(instance->blockOwner(block), owner);
+        EXPECT_EQ(instance->blockOwner(block + 1), owner);
+        free(owners);
+    }
 }
@@ -0,0 +1,60 @@
+#include "../src/copy_kernels.hpp"
+#include "gtest/gtest.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+
+namespace {
+
+    class CopyKernelsTestSuite : public testing::Test {
+        protected:
+            virtual void SetUp() {
+                src = (char *)aligned_alloc(Alignment, Size + Alignment);
+                dst = (char *)aligned_alloc(Alignment, Size + Alignment);
+                for (size_t i = 0; i < Size + Alignment; i++) {
+                    src[i] = (char)(i * 31 + 7);
+                }
+                memset(dst, 0, Size + Alignment);
+            }
+
+            virtual void TearDown() {
+                free(src);
+                free(dst);
+            }
+
+            const size_t Alignment = 64;
+            const size_t Size = 64 << 10; // 64 KB
+            char *src = NULL;
+            char *dst = NULL;
+    };
+
+    TEST_F(CopyKernelsTestSuite, AllKernels) {
+        CopyKernel kernels[8];
+        size_t count = Savitar_copy_kernels(kernels, 8);
+        ASSERT_GE(count, 1);
+        EXPECT_STREQ(kernels[0].name, "sse2");
+        for (size_t k = 0; k < count; k++) {
+            memset(dst, 0, Size);
+            kernels[k].copy(dst, src + 8, Size); // unaligned source
+            _mm_sfence();
+            EXPECT_EQ(memcmp(dst, src + 8, Size), 0) << kernels[k].name;
+        }
+    }
+
+    TEST_F(CopyKernelsTestSuite, StreamCopy) {
+        EXPECT_NE(Savitar_stream_copy_kernel(), nullptr);
+        // Aligned, unaligned and partial batches
+        const size_t offsets[] = { 0, 16, 3 };
+        const size_t sizes[] = { 4096, 4096 + 64, 100, 0 };
+        for (size_t o : offsets) {
+            for (size_t s : sizes) {
+                memset(dst, 0, Size + Alignment);
+                Savitar_stream_copy(dst + o, src, s);
+                _mm_sfence();
+                EXPECT_EQ(memcmp(dst + o, src, s), 0);
+                EXPECT_EQ(dst[o + s], 0); // no overrun
+            }
+        }
+    }
+}
@@ -0,0 +1,141 @@
+#include "../src/nv_log.hpp"
+#include "../src/savitar.hpp"
+#include "gtest/gtest.h"
+#include <uuid/uuid.h>
+#include <stdint.h>
+#include <vector>
+
+void Savitar_log_path(uuid_t, char *);
+
+namespace {
+
+    class LogIndexTestSuite : public testing::Test {
+        protected:
+            virtual void SetUp() {
+                uuid_generate(uuid);
+                log = Savitar_log_create(uuid, LogSize);
+                ASSERT_NE(log, nullptr);
+            }
+
+            virtual void TearDown() {
+                char path[255];
+                Savitar_log_path(uuid, path);
+                Savitar_log_close(log);
+                remove(path);
+            }
+
+            // Appends an entry with (roughly) the provided size
+            uint64_t append(size_t size) {
+                std::vector<char> buffer(size, 'A');
+                uint64_t method_tag = 1;
+                ArgVector vector[2];
+                vector[0].addr = &method_tag;
+                vector[0].len = sizeof(method_tag);
+                vector[1].addr = buffer.data();
+                vector[1].len = size;
+                return Savitar_log_append(log, vector, 2);
+            }
+
+            const size_t LogSize = (size_t)16 << 20; // 16 MB
+            uuid_t uuid;
+            SavitarLog *log = NULL;
+    };
+
+    TEST_F(LogIndexTestSuite, Capacity) {
+        uint64_t capacity = Savitar_log_capacity(log);
+        EXPECT_LT(capacity, log->size);
+        EXPECT_EQ(capacity % CACHE_LINE_WIDTH, 0);
+        uint64_t slots = (log->size - capacity) / sizeof(SavitarLogIndexSlot);
+        EXPECT_GE(slots, log->size / LOG_INDEX_STRIDE);
+    }
+
+    TEST_F(LogIndexTestSuite, FindInOrderCommits) {
+        std::vector<uint64_t> offsets;
+        for (size_t i = 0; i < 4 * LOG_INDEX_STRIDE / 256; i++) {
+            offsets.push_back(append(200 + (i % 7) * 64));
+            Savitar_log_commit(log, offsets.back());
+        }
+        for (size_t i = 0; i < offsets.size(); i++) {
+            EXPECT_EQ(Savitar_log_find_commit(log, i + 1), offsets[i]);
+        }
+    }
+
+    TEST_F(LogIndexTestSuite, FindOutOfOrderCommits) {
+        std::vector<uint64_t> offsets;
+        for (size_t i = 0; i < 3 * LOG_INDEX_STRIDE / 128; i++) {
+            offsets.push_back(append(100));
+        }
+        // Commit in reverse order, entries appended first commit last
+        for (size_t i = offsets.size(); i > 0; i--) {
+            Savitar_log_commit(log, offsets[i - 1]);
+        }
+        for (size_t i = 0; i < offsets.size(); i++) {
+            EXPECT_EQ(Savitar_log_find_commit(log, offsets.size() - i),
+                    offsets[i]);
+        }
+    }
+
+    TEST_F(LogIndexTestSuite, MissingCommits) {
+        uint64_t offset = append(64);
+        EXPECT_EQ(Savitar_log_find_commit(log, 1), 0);
+        Savitar_log_commit(log, offset);
+        EXPECT_EQ(Savitar_log_find_commit(log, 1), offset);
+        EXPECT_EQ(Savitar_log_find_commit(log, 2), 0);
+        EXPECT_EQ(Savitar_log_find_commit(log, 0), 0);
+    }
+
+    TEST_F(LogIndexTestSuite, Truncate) {
+        std::vector<uint64_t> offsets;
+        for (size_t i = 0; i < 2 * LOG_INDEX_STRIDE / 128; i++) {
+            offsets.push_back(append(100));
+            Savitar_log_commit(log, offsets.back());
+        }
+        size_t first = offsets.size() / 2;
+        Savitar_log_truncate(log, offsets[first]);
+        EXPECT_EQ(log->head, offsets[first]);
+        Savitar_log_truncate(log, offsets[0]); // never moves backwards
+        EXPECT_EQ(log->head, offsets[first]);
+
+        EXPECT_EQ(Savitar_log_find_commit(log, first), 0);
+        for (size_t i = first; i < offsets.size(); i++) {
+            EXPECT_EQ(Savitar_log_find_commit(log, i + 1), offsets[i]);
+        }
+    }
+
+    TEST_F(LogIndexTestSuite, UnindexedLog) {
+        log->checksum ^= REDO_LOG_INDEXED; // created before the commit index
+        EXPECT_EQ(Savitar_log_capacity(log), log->size);
+
+        // Entries may fill the end of the log, no index is written there
+        log->tail = log->size - LOG_INDEX_STRIDE;
+        log->head = log->tail;
+        std::vector<uint64_t> offsets;
+        while (log->tail + 256 <= log->size) {
+            offsets.push_back(append(200));
+            Savitar_log_commit(log, offsets.back());
+        }
+        EXPECT_EQ(log->tail, log->size);
+        for (size_t i = 0; i < offsets.size(); i++) {
+            EXPECT_EQ(Savitar_log_find_commit(log, i + 1), offsets[i]);
+        }
+    }
+
+    TEST_F(LogIndexTestSuite, LatencyHistogram) {
+        Savitar_log_latency_sampling(false);
+        append(64);
+        EXPECT_EQ(Savitar_log_latency(0.99), 0); // not sampled
+
+        Savitar_log_latency_sampling(true);
+        for (size_t i = 0; i < 100; i++) append(64 + (i % 4) * 64);
+        Savitar_log_latency_sampling(false);
+        uint64_t p50 = Savitar_log_latency(0.5);
+        EXPECT_GT(p50, 0);
+        EXPECT_EQ(p50 & (p50 - 1), 0); // bucket bound (power of two)
+        EXPECT_EQ(Savitar_log_latency(0.5), 0); // emptied by the read
+
+        Savitar_log_latency_sampling(true);
+        for (size_t i = 0; i < 100; i++) append(64);
+        Savitar_log_latency_sampling(false);
+        EXPECT_GT(Savitar_log_latency(0.99), 0);
+    }
+}
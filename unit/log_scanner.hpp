@@ -0,0 +1,80 @@
+#include "../src/log_scanner.hpp"
+#include "gtest/gtest.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+    class LogScannerTestSuite : public testing::Test {
+        protected:
+            virtual void SetUp() {
+                log = (char *)aligned_alloc(Line, Lines * Line);
+                memset(log, 0, Lines * Line);
+                srand(0);
+                for (uint64_t i = 0; i < Lines; i++) {
+                    if (rand() % 3 != 0) continue;
+                    uint64_t *line = (uint64_t *)(log + i * Line);
+                    line[0] = i + 1; // commit id
+                    line[1] = Magic;
+                    line[2] = i * 7; // tag
+                    expected.push_back(i * Line);
+                }
+            }
+
+            virtual void TearDown() {
+                free(log);
+                expected.clear();
+            }
+
+            const uint64_t Magic = 0x5265646F4C6F6745;
+            const uint64_t Line = 64;
+            const uint64_t Lines = 10007;
+            char *log = NULL;
+            std::vector<uint64_t> expected;
+    };
+
+    TEST_F(LogScannerTestSuite, FindAll) {
+        std::vector<LogScanRecord> records(Lines);
+        uint64_t next = 0;
+        size_t count = Savitar_log_scan(log, 0, Lines * Line, Magic,
+                records.data(), records.size(), &next);
+        EXPECT_EQ(next, Lines * Line);
+        ASSERT_EQ(count, expected.size());
+        for (size_t i = 0; i < count; i++) {
+            EXPECT_EQ(records[i].offset, expected[i]);
+            EXPECT_EQ(records[i].commit_id, expected[i] / Line + 1);
+            EXPECT_EQ(records[i].tag, (expected[i] / Line) * 7);
+        }
+    }
+
+    TEST_F(LogScannerTestSuite, Batches) {
+        // Odd batch sizes stop scanning in the middle of SIMD batches
+        for (size_t batch = 1; batch < 20; batch += 3) {
+            std::vector<LogScanRecord> records(batch);
+            size_t total = 0;
+            uint64_t next = Line; // unaligned to SIMD batches
+            size_t first = expected[0] == 0 ? 1 : 0;
+            while (next < Lines * Line) {
+                size_t count = Savitar_log_scan(log, next, Lines * Line,
+                        Magic, records.data(), batch, &next);
+                ASSERT_LE(count, batch);
+                for (size_t i = 0; i < count; i++) {
+                    ASSERT_EQ(records[i].offset, expected[first + total + i]);
+                }
+                total += count;
+            }
+            EXPECT_EQ(total + first, expected.size());
+        }
+    }
+
+    TEST_F(LogScannerTestSuite, EmptyRange) {
+        LogScanRecord record;
+        uint64_t next = 0;
+        EXPECT_EQ(Savitar_log_scan(log, Line, Line, Magic, &record, 1, &next), 0);
+        EXPECT_EQ(next, Line);
+        EXPECT_EQ(Savitar_log_scan(log, 0, Line, Magic, &record, 0, &next), 0);
+        EXPECT_EQ(next, 0);
+    }
+}
@@ -6,6 +6,10 @@
 #include "alloc_object.hpp"
 #include "alloc_free_list.hpp"
 #include "snapshot.hpp"
+#include "log_index.hpp"
+#include "uuid_map.hpp"
+#include "log_scanner.hpp"
+#include "copy_kernels.hpp"
 #include "../src/savitar.hpp"
 
 namespace {
@@ -1,9 +1,11 @@
 #include "../src/snapshot.hpp"
 #include "../src/savitar.hpp"
+#include "../src/nested_calls.hpp"
 #include "gtest/gtest.h"
 #include <limits.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 namespace {
 
@@ -31,6 +33,36 @@ namespace {
             void extendSnapshot(Snapshot *o, size_t blocks) {
                 o->extendSnapshot(blocks);
             }
+            size_t blockMapSize() { return Snapshot::blockMapSize(); }
+            void setChain(Snapshot *o, snapshot_header_t *view,
+                    std::vector<snapshot_header_t *> chain) {
+                o->view = view;
+                o->chain = chain;
+            }
+            char *blockSource(Snapshot *o, size_t block) {
+                return o->blockSource(block);
+            }
+            const char *pageSource(Snapshot *o, snapshot_header_t *h,
+                    size_t block, size_t page) {
+                return o->pageSource(h, block, page);
+            }
+            void loadBlock(Snapshot *o, char *dst, size_t block) {
+                o->loadBlock(dst, block, false);
+            }
+            void mapBlock(Snapshot *o, int fd, size_t block) {
+                o->fd = fd;
+                o->mapBlock(block);
+                o->fd = 0;
+            }
+            bool readHeader(Snapshot *o, uint32_t id, snapshot_header_t *h) {
+                return o->readHeader(id, h);
+            }
+            std::set<PersistentObject *> savedObjects(
+                    const std::set<PersistentObject *> &selected,
+                    const std::set<PersistentObject *> &unkept,
+                    NestedCalls &calls) {
+                return Snapshot::savedObjects(selected, unkept, calls);
+            }
     };
 
     TEST_F(SnapshotTestSuite, Singleton) {
@@ -56,6 +88,8 @@ namespace {
         size_t snapshotSize = sizeof(snapshot_header_t);
         snapshotSize += GlobalAlloc::snapshotSize();
         snapshotSize += GlobalAlloc::getInstance()->bitmapSize();
+        snapshotSize += GlobalAlloc::getInstance()->ownersSize();
+        snapshotSize += blockMapSize();
         if (snapshotSize % 64 != 0) snapshotSize += 64 - (snapshotSize % 64);
         snapshot_header_t *header = getView(ckpt);
         EXPECT_EQ(header->identifier, 1);
@@ -66,8 +100,13 @@ namespace {
         EXPECT_EQ(header->global_offset, sizeof(snapshot_header_t) +
                 GlobalAlloc::getInstance()->bitmapSize());
         EXPECT_EQ(header->data_offset, snapshotSize);
-        EXPECT_EQ(header->alloc_offset, header->global_offset +
+        EXPECT_EQ(header->owners_offset, header->global_offset +
                 GlobalAlloc::getInstance()->snapshotSize());
+        EXPECT_EQ(header->blocks_offset, header->owners_offset +
+                GlobalAlloc::getInstance()->ownersSize());
+        EXPECT_EQ(header->alloc_offset, header->blocks_offset + blockMapSize());
+        EXPECT_EQ(header->parent_id, 0);
+        EXPECT_EQ(header->chain_length, 0);
 
         cleanEnvironment(ckpt);
         EXPECT_EQ(getView(ckpt), nullptr);
@@ -145,8 +184,12 @@ namespace {
         size_t oldSize = getView(ckpt)->size;
         size_t blocks = 1 + rand() % 10;
         extendSnapshot(ckpt, blocks);
-        size_t newSize = getView(ckpt)->size;
-        EXPECT_EQ(newSize, oldSize + blocks * FreeList::BlockSize);
+        snapshot_header_t *header = getView(ckpt);
+        EXPECT_EQ(header->index_offset, (oldSize + 4095) & ~4095);
+        EXPECT_EQ(header->data_offset, header->index_offset +
+                ((blocks * sizeof(block_index_t) + 4095) & ~4095));
+        EXPECT_EQ(header->size, header->data_offset +
+                blocks * FreeList::BlockSize);
         delete ckpt;
         removeSnapshot();
     }
@@ -175,44 +218,30 @@ namespace {
         }
         context[0] = Snapshot::getInstance()->UsedHugePage;
 
-        // Extend snapshot by one block
-        size_t oldSize = getView(ckpt)->size;
+        // Extend snapshot by one block (stored at the beginning of the data)
         extendSnapshot(ckpt, 1);
-        EXPECT_EQ(getView(ckpt)->size, oldSize + FreeList::BlockSize);
-        char *dataPtr = (char *)getView(ckpt) + getView(ckpt)->data_offset;
-        memset(dataPtr, 0, FreeList::BlockSize);
-
-        // Verify data region
-        for (size_t i = 0; i < PPBlk; i++) {
-            for (size_t b = 0; b < GlobalAlloc::BitmapGranularity; b++) {
-                EXPECT_EQ(dataPtr[b], 0);
-            }
-            dataPtr += GlobalAlloc::BitmapGranularity;
-        }
+        bitmap = (uint64_t *)((char *)getView(ckpt) +
+                getView(ckpt)->bitmap_offset);
+        block_index_t *index = (block_index_t *)((char *)getView(ckpt) +
+                getView(ckpt)->index_offset);
+        EXPECT_EQ(index[0].offset, 0);
 
         // Simulate page-fault
         ckpt->pageFaultHandler((char *)base + rand() % FreeList::BlockSize);
 
-        // Verify snapshot and context
-        char expectedChar = 0;
-        dataPtr = (char *)getView(ckpt) + getView(ckpt)->data_offset;
-        for (size_t i = 0; i < PPBlk / 64; i++) {
-            uint64_t bit = bitmap[i];
-            for (size_t p = 0; p < 64; p++) {
-                if (bit & 0x0000000000000001) {
-                    for (size_t j = 0; j < GlobalAlloc::BitmapGranularity; j++)
-                        EXPECT_EQ(dataPtr[j], expectedChar);
-                }
-                // TODO fix this
-                /*else {
-                    for (size_t j = 0; j < GlobalAlloc::BitmapGranularity; j++) {
-                        EXPECT_EQ(dataPtr[j], 0);
-                        if (dataPtr[j] != 0) break;
-                    }
-                }*/
-                expectedChar = (expectedChar + 1) % 255;
-                dataPtr += GlobalAlloc::BitmapGranularity;
-                bit = bit >> 1;
+        // Verify snapshot and context, zero pages are not stored
+        // (no ASSERT_* before delete, a leaked instance breaks later tests)
+        for (size_t p = 0; p < PPBlk; p++) {
+            const unsigned char expectedChar = p % 255; // as populated
+            const char *page = pageSource(ckpt, getView(ckpt), 0, p);
+            if ((bitmap[p >> 6] >> (p & 63)) & 1 && expectedChar != 0) {
+                EXPECT_NE(page, nullptr);
+                if (page == nullptr) continue;
+                for (size_t j = 0; j < GlobalAlloc::BitmapGranularity; j++)
+                    EXPECT_EQ((unsigned char)page[j], expectedChar);
+            }
+            else {
+                EXPECT_EQ(page, nullptr);
             }
         }
         EXPECT_EQ(context[0], Snapshot::getInstance()->SavedHugePage);
@@ -221,6 +250,280 @@ namespace {
         delete ckpt;
     }
 
+    TEST_F(SnapshotTestSuite, DeltaChain) {
+        Snapshot *ckpt = new Snapshot(PMEM_PATH);
+        const size_t Snapshots = 3; // delta, delta, full
+        const size_t headerSize = sizeof(snapshot_header_t) + blockMapSize();
+        std::vector<snapshot_header_t *> headers;
+        for (size_t i = 0; i < Snapshots; i++) {
+            snapshot_header_t *header = (snapshot_header_t *)calloc(1, headerSize);
+            header->blocks_offset = sizeof(snapshot_header_t);
+            header->data_offset = headerSize;
+            header->parent_id = i + 1 < Snapshots ? i + 2 : 0;
+            headers.push_back(header);
+        }
+
+        // Block 1 is stored by both deltas, block 2 by the oldest delta only
+        uint64_t *blocks = (uint64_t *)((char *)headers[0] + headerSize -
+                blockMapSize());
+        blocks[0] = 0x2;
+        blocks = (uint64_t *)((char *)headers[1] + headerSize - blockMapSize());
+        blocks[0] = 0x6;
+        setChain(ckpt, headers[0], std::vector<snapshot_header_t *>(
+                    headers.begin() + 1, headers.end()));
+
+        for (size_t block = 0; block < 4; block++) {
+            size_t expected = block == 1 ? 0 : (block == 2 ? 1 : 2);
+            EXPECT_EQ(blockSource(ckpt, block), (char *)headers[expected] +
+                    headerSize + block * FreeList::BlockSize);
+        }
+
+        setChain(ckpt, NULL, std::vector<snapshot_header_t *>());
+        for (size_t i = 0; i < Snapshots; i++) free(headers[i]);
+        delete ckpt;
+    }
+
+    TEST_F(SnapshotTestSuite, MergeDeltaChain) {
+        const size_t Blocks = 2;
+        const size_t bitmapOffset = sizeof(snapshot_header_t);
+        const size_t blocksOffset = bitmapOffset + Blocks * 8 * sizeof(uint64_t);
+        const size_t dataOffset = (blocksOffset + blockMapSize() + 4095) & ~4095;
+        const size_t snapshotSize = dataOffset + Blocks * FreeList::BlockSize;
+
+        // Snapshot 1 (full) stores both blocks, snapshot 2 only block 1
+        for (uint32_t id = 1; id <= 2; id++) {
+            std::vector<char> file(snapshotSize, 0);
+            snapshot_header_t *header = (snapshot_header_t *)file.data();
+            header->identifier = id;
+            header->time = 100 + id;
+            header->size = snapshotSize;
+            header->bitmap_offset = bitmapOffset;
+            header->blocks_offset = blocksOffset;
+            header->alloc_offset = blocksOffset + blockMapSize();
+            header->data_offset = dataOffset;
+            header->parent_id = id - 1;
+            header->chain_length = id - 1;
+            memset(&file[bitmapOffset], 0xFF, blocksOffset - bitmapOffset);
+            uint64_t *blocks = (uint64_t *)&file[blocksOffset];
+            blocks[0] = id == 1 ? 0x3 : 0x2;
+            for (size_t b = 0; b < Blocks; b++) {
+                if ((blocks[0] & (1 << b)) == 0) continue;
+                memset(&file[dataOffset + b * FreeList::BlockSize],
+                        'a' + id * Blocks + b, FreeList::BlockSize);
+            }
+            // Zero pages are not stored by the merged snapshot
+            if (id == 1) memset(&file[dataOffset + 4096], 0, 4096);
+
+            std::string path = PMEM_PATH;
+            path += "/snapshot." + std::to_string(id);
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+            ASSERT_GT(fd, 0);
+            ASSERT_EQ(write(fd, file.data(), snapshotSize), snapshotSize);
+            close(fd);
+        }
+
+        Snapshot *ckpt = new Snapshot(PMEM_PATH, false);
+        EXPECT_EQ(Snapshot::anyActiveSnapshot(), false);
+        EXPECT_EQ(ckpt->chainLength(2), 1);
+        EXPECT_FALSE(ckpt->merge(1)); // not a delta
+        EXPECT_TRUE(ckpt->merge(2));
+        EXPECT_EQ(ckpt->chainLength(2), 0);
+
+        std::string path = PMEM_PATH;
+        path += "/snapshot.2";
+        int fd = open(path.c_str(), O_RDONLY);
+        ASSERT_GT(fd, 0);
+        std::vector<char> file(lseek(fd, 0, SEEK_END), 0);
+        ASSERT_EQ(pread(fd, file.data(), file.size(), 0), file.size());
+        close(fd);
+        snapshot_header_t *header = (snapshot_header_t *)file.data();
+        EXPECT_EQ(header->parent_id, 0);
+        EXPECT_EQ(header->time, 102);
+        EXPECT_EQ(header->size, file.size());
+        EXPECT_NE(header->index_offset, 0); // sparse
+        EXPECT_EQ(header->data_offset - header->index_offset, 4096);
+        EXPECT_EQ(((uint64_t *)&file[blocksOffset])[0], 0x3);
+        const size_t PPBlk = FreeList::BlockSize / 4096;
+        EXPECT_EQ(*pageSource(ckpt, header, 0, 0), 'a' + Blocks); // from 1
+        EXPECT_EQ(pageSource(ckpt, header, 0, 1), nullptr); // zero page
+        EXPECT_EQ(pageSource(ckpt, header, 1, PPBlk - 1)[4095],
+                'a' + 2 * Blocks + 1);
+
+        delete ckpt;
+        removeSnapshot(1);
+        removeSnapshot(2);
+    }
+
+    TEST_F(SnapshotTestSuite, SparseBlock) {
+        // Pages 0, 2 and 3 are allocated, page 3 is a zero page
+        const size_t PageSize = 4096;
+        const size_t indexOffset = sizeof(snapshot_header_t) + 8 * sizeof(uint64_t);
+        const size_t dataOffset = indexOffset + sizeof(block_index_t);
+        std::vector<char> file(dataOffset + 3 * PageSize, 0);
+        snapshot_header_t *header = (snapshot_header_t *)file.data();
+        header->bitmap_offset = sizeof(snapshot_header_t);
+        header->index_offset = indexOffset;
+        header->data_offset = dataOffset;
+        ((uint64_t *)&file[header->bitmap_offset])[0] = 0xD;
+        block_index_t *entry = (block_index_t *)&file[indexOffset];
+        entry->offset = 0;
+        entry->pages[0] = 0x5;
+        memset(&file[dataOffset], 'x', PageSize);
+        memset(&file[dataOffset + PageSize], 'y', PageSize);
+
+        Snapshot *ckpt = new Snapshot(PMEM_PATH, false);
+        EXPECT_EQ(pageSource(ckpt, header, 0, 0), &file[dataOffset]);
+        EXPECT_EQ(pageSource(ckpt, header, 0, 1), nullptr);
+        EXPECT_EQ(pageSource(ckpt, header, 0, 2), &file[dataOffset + PageSize]);
+        EXPECT_EQ(pageSource(ckpt, header, 0, 3), nullptr);
+        EXPECT_EQ(pageSource(ckpt, header, 1, 0), nullptr); // not indexed
+
+        // Pages that are not stored are cleared
+        char *block = (char *)aligned_alloc(PageSize, FreeList::BlockSize);
+        memset(block, 'z', FreeList::BlockSize);
+        setChain(ckpt, header, std::vector<snapshot_header_t *>());
+        loadBlock(ckpt, block, 0);
+        setChain(ckpt, NULL, std::vector<snapshot_header_t *>());
+        EXPECT_EQ(block[0], 'x');
+        EXPECT_EQ(block[PageSize], 0);
+        EXPECT_EQ(block[2 * PageSize + PageSize - 1], 'y');
+        EXPECT_EQ(block[3 * PageSize], 0);
+        EXPECT_EQ(block[FreeList::BlockSize - 1], 0);
+        free(block);
+        delete ckpt;
+    }
+
+    TEST_F(SnapshotTestSuite, MapBlock) {
+        // Pages 0-31 and 40 are stored, page 50 is a zero page
+        const size_t PageSize = 4096;
+        const size_t Block = 1024; // far from the blocks of other tests
+        const size_t bitmapOffset = PageSize;
+        size_t indexOffset = bitmapOffset + (Block + 1) * 8 * sizeof(uint64_t);
+        indexOffset = (indexOffset + PageSize - 1) & ~(PageSize - 1);
+        size_t dataOffset = indexOffset + (Block + 1) * sizeof(block_index_t);
+        dataOffset = (dataOffset + PageSize - 1) & ~(PageSize - 1);
+        std::vector<char> file(dataOffset + 33 * PageSize, 0);
+        snapshot_header_t *header = (snapshot_header_t *)file.data();
+        header->bitmap_offset = bitmapOffset;
+        header->index_offset = indexOffset;
+        header->data_offset = dataOffset;
+        header->size = file.size();
+        uint64_t *bitmap = (uint64_t *)&file[bitmapOffset] + Block * 8;
+        bitmap[0] = 0xFFFFFFFF | ((uint64_t)1 << 40) | ((uint64_t)1 << 50);
+        block_index_t *entry = (block_index_t *)&file[indexOffset] + Block;
+        entry->offset = 0;
+        entry->pages[0] = 0xFFFFFFFF | ((uint64_t)1 << 40);
+        for (size_t p = 0; p < 33; p++) {
+            memset(&file[dataOffset + p * PageSize], 'A' + p, PageSize);
+        }
+
+        std::string path = PMEM_PATH;
+        path += "/mapblock.test";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        ASSERT_GT(fd, 0);
+        ASSERT_EQ(write(fd, file.data(), file.size()), (ssize_t)file.size());
+        snapshot_header_t *view = (snapshot_header_t *)mmap(NULL, file.size(),
+                PROT_READ, MAP_SHARED, fd, 0);
+        ASSERT_NE(view, MAP_FAILED);
+
+        char *heap = (char *)GlobalAlloc::BaseAddress + Block * FreeList::BlockSize;
+        ASSERT_EQ(mmap(heap, FreeList::BlockSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0),
+                heap);
+        Snapshot *ckpt = new Snapshot(PMEM_PATH, false);
+        setChain(ckpt, view, std::vector<snapshot_header_t *>());
+        mapBlock(ckpt, fd, Block);
+        setChain(ckpt, NULL, std::vector<snapshot_header_t *>());
+        delete ckpt;
+
+        for (size_t p = 0; p < 32; p++) EXPECT_EQ(heap[p * PageSize], 'A' + p);
+        EXPECT_EQ(heap[40 * PageSize + PageSize - 1], 'A' + 32);
+        EXPECT_EQ(heap[32 * PageSize], 0);
+        EXPECT_EQ(heap[50 * PageSize], 0);
+
+        // Writes are private, the snapshot is unchanged
+        heap[0] = 'W';
+        EXPECT_EQ(heap[0], 'W');
+        EXPECT_EQ(((char *)view)[dataOffset], 'A');
+
+        munmap(heap, FreeList::BlockSize);
+        munmap(view, file.size());
+        close(fd);
+        remove(path.c_str());
+    }
+
+    TEST_F(SnapshotTestSuite, Retention) {
+        // 1 full, 2 incomplete, 3 full, 4 and 5 deltas, 6 being written
+        const uint32_t Snapshots = 6;
+        const uint32_t parents[Snapshots + 1] = { 0, 0, 0, 0, 3, 4, 5 };
+        for (uint32_t id = 1; id <= Snapshots; id++) {
+            snapshot_header_t header;
+            memset(&header, 0, sizeof(header));
+            header.identifier = id;
+            header.time = (id == 2 || id == Snapshots) ? 0 : 100 + id;
+            header.size = sizeof(header);
+            header.bitmap_offset = sizeof(header);
+            header.alloc_offset = sizeof(header);
+            header.data_offset = sizeof(header);
+            header.parent_id = parents[id];
+
+            std::string path = PMEM_PATH;
+            path += "/snapshot." + std::to_string(id);
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+            ASSERT_GT(fd, 0);
+            ASSERT_EQ(write(fd, &header, sizeof(header)), sizeof(header));
+            close(fd);
+        }
+        std::string mergePath = PMEM_PATH;
+        mergePath += "/snapshot.3.merge";
+        close(open(mergePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666));
+
+        Snapshot *ckpt = new Snapshot(PMEM_PATH, false);
+        EXPECT_EQ(ckpt->collectGarbage(0, 0), 0); // retention is disabled
+        EXPECT_EQ(ckpt->lastSnapshotID(), Snapshots);
+
+        // Keeps 4 and 5, their full snapshot and the one being written
+        EXPECT_EQ(ckpt->collectGarbage(2, 0), 2);
+        EXPECT_EQ(access(mergePath.c_str(), F_OK), -1);
+        snapshot_header_t header;
+        EXPECT_FALSE(readHeader(ckpt, 1, &header));
+        EXPECT_FALSE(readHeader(ckpt, 2, &header));
+        for (uint32_t id = 3; id <= Snapshots; id++) {
+            EXPECT_TRUE(readHeader(ckpt, id, &header));
+        }
+        EXPECT_EQ(ckpt->collectGarbage(1, 0), 0); // 5 needs 3 and 4
+
+        delete ckpt;
+        for (uint32_t id = 1; id <= Snapshots; id++) removeSnapshot(id);
+    }
+
+    TEST_F(SnapshotTestSuite, SelectiveNestedTransactions) {
+        // Only used as keys, never dereferenced
+        char objects[5];
+        PersistentObject *selected = (PersistentObject *)&objects[0];
+        PersistentObject *kept = (PersistentObject *)&objects[1];
+        PersistentObject *unrelated = (PersistentObject *)&objects[2];
+        PersistentObject *unkept = (PersistentObject *)&objects[3];
+        PersistentObject *callee = (PersistentObject *)&objects[4];
+
+        // The kept object runs a transaction nested in the selected one
+        NestedCalls calls;
+        calls.add(selected, kept);
+        std::set<PersistentObject *> saved = savedObjects({ selected }, {},
+                calls);
+        EXPECT_EQ(saved.size(), 2);
+        EXPECT_EQ(saved.count(selected), 1);
+        EXPECT_EQ(saved.count(kept), 1);
+        EXPECT_EQ(saved.count(unrelated), 0);
+
+        // Objects that cannot be kept take their callees with them
+        calls.add(unkept, callee);
+        saved = savedObjects({ selected }, { unkept }, calls);
+        EXPECT_EQ(saved.size(), 4);
+        EXPECT_EQ(saved.count(callee), 1);
+        EXPECT_EQ(saved.count(unrelated), 0);
+    }
+
     TEST_F(SnapshotTestSuite, MarkPagesReadOnly) {
         // TODO
     }
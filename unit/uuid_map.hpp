@@ -0,0 +1,95 @@
+#include "../src/uuid_map.hpp"
+#include "gtest/gtest.h"
+#include <uuid/uuid.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+    class UUIDMapTestSuite : public testing::Test {
+        protected:
+            virtual void SetUp() {
+                keys.resize(Keys);
+                for (size_t i = 0; i < Keys; i++) {
+                    uuid_generate(keys[i].id);
+                }
+            }
+            virtual void TearDown() { keys.clear(); }
+
+            typedef struct { uuid_t id; } Key;
+            const size_t Keys = 10000;
+            std::vector<Key> keys;
+    };
+
+    TEST_F(UUIDMapTestSuite, InsertAndFind) {
+        UUIDMap<uint64_t> map(4);
+        EXPECT_TRUE(map.empty());
+        for (size_t i = 0; i < Keys; i++) {
+            EXPECT_TRUE(map.insert(keys[i].id, i));
+        }
+        EXPECT_EQ(map.size(), Keys);
+        for (size_t i = 0; i < Keys; i++) {
+            uint64_t *value = map.find(keys[i].id);
+            ASSERT_NE(value, nullptr);
+            EXPECT_EQ(*value, i);
+        }
+
+        uuid_t missing;
+        uuid_generate(missing);
+        EXPECT_EQ(map.find(missing), nullptr);
+    }
+
+    TEST_F(UUIDMapTestSuite, NoReplace) {
+        UUIDMap<uint64_t> map;
+        EXPECT_TRUE(map.insert(keys[0].id, 1));
+        EXPECT_FALSE(map.insert(keys[0].id, 2));
+        EXPECT_EQ(*map.find(keys[0].id), 1);
+        EXPECT_EQ(map.size(), 1);
+    }
+
+    TEST_F(UUIDMapTestSuite, Iterate) {
+        UUIDMap<uint64_t> map;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < Keys; i++) {
+            map.insert(keys[i].id, i);
+            sum += i;
+        }
+        size_t count = 0;
+        for (auto it = map.begin(); it != map.end(); it++) {
+            EXPECT_EQ(*map.find(it->first), it->second);
+            sum -= it->second;
+            count++;
+        }
+        EXPECT_EQ(count, Keys);
+        EXPECT_EQ(sum, 0);
+
+        map.clear();
+        EXPECT_EQ(map.size(), 0);
+        EXPECT_TRUE(map.begin() == map.end());
+    }
+
+    TEST_F(UUIDMapTestSuite, ConcurrentReaders) {
+        UUIDMap<uint64_t> map(4);
+        const size_t Readers = 4;
+        std::vector<std::thread> threads;
+        volatile size_t inserted = 0;
+        for (size_t t = 0; t < Readers; t++) {
+            threads.push_back(std::thread([&]() {
+                while (inserted < Keys) {
+                    size_t n = inserted;
+                    for (size_t i = 0; i < n; i++) {
+                        uint64_t *value = map.find(keys[i].id);
+                        ASSERT_NE(value, nullptr);
+                        ASSERT_EQ(*value, i);
+                    }
+                }
+            }));
+        }
+        for (size_t i = 0; i < Keys; i++) {
+            map.insert(keys[i].id, i);
+            inserted = i + 1;
+        }
+        for (auto &t : threads) t.join();
+    }
+}